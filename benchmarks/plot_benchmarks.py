@@ -90,9 +90,70 @@ plt.rcParams['axes.titlesize'] = 14
 plt.rcParams['axes.titleweight'] = 'normal'
 plt.rcParams['axes.labelsize'] = 12
 
+# Unit benchmarks indexed by something else than the size, by the name of their first column:
+# label of the x axis, label of the y axis, log2 scale for x, log10 scale for y, and whether the y axis is a time
+INDEXED_BENCHMARKS = {
+    "threads": ("Nombre de threads", "Temps par malloc + free", True, True, True),
+    "pairs": ("Nombre de paires producteur/consommateur", "Temps par buffer", True, True, True),
+    "occupancy": ("Occupation de la page de slab (%)", "Temps par malloc + free", False, False, True),
+    "request": ("Taille demandée (octets)", "Octets en plus par allocation", True, False, False),
+    "step": ("Octets ajoutés à chaque realloc", "Temps par realloc", True, True, True),
+    "live": ("Nombre de gros buffers vivants", "Temps par malloc + free", False, False, True),
+    "batch": ("Nombre de pointeurs par lot", "Temps par malloc + free", True, False, True),
+}
+
+# Style and legend of each curve of the indexed benchmarks, the other columns aren't curves
+CURVES = {
+    "libc": ('bo-', 'libc'),
+    "challoc": ('ro-', 'challoc'),
+    "challoc_mutex": ('mo-', 'challoc (mutex)'),
+    "challoc_remote": ('go-', 'challoc (remote free)'),
+    "challoc_batch": ('go-', 'challoc (batch)'),
+}
+
+# Columns shown next to the points of a curve: the curve, how to write a value, and where to put it
+ANNOTATIONS = {
+    "challoc_hit_rate": ("challoc", lambda v: f'{v * 100:.0f}%', 8),
+    "challoc_futex_waits": ("challoc", lambda v: f'{v} futex', 8),
+    "challoc_copied": ("challoc", lambda v: f'{v:.2f} o copiés/o', 8),
+    "libc_copied": ("libc", lambda v: f'{v:.2f} o copiés/o', -14),
+}
+
+def plot_indexed(ub, data, index):
+    (x_label, y_label, log_x, log_y, is_time) = INDEXED_BENCHMARKS[index]
+    xs = data[index].to_numpy()
+    if log_x:
+        plt.xscale('log', base=2)
+    if log_y:
+        plt.yscale('log', base=10)
+    plt.ylabel(y_label)
+    plt.xlabel(x_label)
+    plt.xticks(xs, [str(x) for x in xs], rotation=0 if is_time else 45)
+    if is_time:
+        plt.gca().yaxis.set_major_formatter(FuncFormatter(time_formatter_truncated))
+
+    for column in data.columns:
+        if column in CURVES:
+            (style, label) = CURVES[column]
+            plt.plot(xs, data[column].to_numpy(), style, label=label)
+        elif column in ANNOTATIONS:
+            (curve, text, offset) = ANNOTATIONS[column]
+            for x, y, value in zip(xs, data[curve].to_numpy(), data[column].to_numpy()):
+                plt.annotate(text(value), (x, y), textcoords="offset points", xytext=(0, offset), ha='center', fontsize=9)
+
+    ub = ub.replace(".csv", "")
+    plt.title(ub)
+    plt.legend()
+    plt.tight_layout()
+    plt.savefig(where_to_save + '/' + ub + '.svg')
+    plt.clf()
+
 units = [bench for bench in os.listdir(data_dir + "/unit")]
 for ub in units:
     data = polars.read_csv(data_dir + "/unit/" + ub)
+    if data.columns[0] in INDEXED_BENCHMARKS:
+        plot_indexed(ub, data, data.columns[0])
+        continue
 
     sizes = data["size"].to_numpy()
     libc_data = data["libc"].to_numpy()
@@ -106,8 +167,12 @@ for ub in units:
     plt.ylabel("Temps CPU (cycles)")
     plt.xlabel("Taille (octets)")
 
-    # set the axis ticks
-    x_ticks = [sizes[i] for i in range(0, len(sizes), 6)]
+    # set the axis ticks, the size sweep goes linearly through every multiple of 8 bytes
+    if "sweep" in ub:
+        plt.xscale('linear')
+        x_ticks = [sizes[i] for i in range(len(sizes) // 8 - 1, len(sizes), len(sizes) // 8)]
+    else:
+        x_ticks = [sizes[i] for i in range(0, len(sizes), 6)]
     plt.xticks(x_ticks)
     plt.gca().xaxis.set_major_formatter(FuncFormatter(bytes_formatter))
 
@@ -141,6 +206,41 @@ for ub in units:
     plt.clf()
 
 
+# Thread scaling benchmarks, in operations per second for each number of threads
+def ops_formatter(x, pos):
+    if x < 10 ** 3:
+        return f'{x:.0f}'
+    elif x < 10 ** 6:
+        return f'{x / 10**3:.0f} K'
+    elif x < 10 ** 9:
+        return f'{x / 10**6:.0f} M'
+    return f'{x / 10**9:.0f} G'
+
+scalings = [bench for bench in os.listdir(data_dir + "/threads")] if os.path.isdir(data_dir + "/threads") else []
+for sb in scalings:
+    data = polars.read_csv(data_dir + "/threads/" + sb)
+    threads = data["threads"].to_numpy()
+    plt.xscale('log', base=2)
+    plt.yscale('log', base=10)
+    plt.ylabel("Opérations par seconde")
+    plt.xlabel("Nombre de threads")
+    plt.xticks(threads, [str(t) for t in threads])
+    plt.gca().yaxis.set_major_formatter(FuncFormatter(ops_formatter))
+
+    colors = {"libc": 'b', "challoc": 'r'}
+    for allocator in data.columns[1:]:
+        ops = data[allocator].to_numpy()
+        color = colors.get(allocator, 'g')
+        plt.plot(threads, ops, color + 'o-', label=allocator)
+        # Perfect scaling from the single-threaded throughput
+        plt.plot(threads, ops[0] * threads, color + ':', alpha=0.5)
+
+    sb = sb.replace(".csv", "")
+    plt.title(sb + " (pointillés : passage à l'échelle idéal)")
+    plt.legend()
+    plt.savefig(where_to_save + '/threads_' + sb + '.svg')
+    plt.clf()
+
 # Plot parameters for the program benchmarks
 plt.rcParams['font.size'] = 24
 plt.rcParams['axes.titlesize'] = 26
@@ -0,0 +1,32 @@
+/**
+ * @file benchmarks/programs/basic/burst_then_idle.c
+ * @brief A program that goes through bursts of small allocations of a different size each time, freeing everything and staying idle
+ * between them, so its peak memory usage shows whether the memory of a burst is given back before the next one
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#define NB_OBJECTS 200000 // Per burst
+
+int main() {
+	// None of these sizes are close to a power of two, so each burst uses its own size class
+	const size_t SIZES[]	= {24, 48, 100, 200, 300, 420};
+	const size_t NB_BURSTS	= sizeof(SIZES) / sizeof(SIZES[0]);
+	volatile char** objects = malloc(NB_OBJECTS * sizeof(char*));
+	for (size_t burst = 0; burst < NB_BURSTS; burst++) {
+		for (int i = 0; i < NB_OBJECTS; i++) {
+			objects[i]    = malloc(SIZES[burst]);
+			objects[i][0] = (char)i;
+		}
+		for (int i = 0; i < NB_OBJECTS; i++) {
+			free((void*)objects[i]);
+		}
+
+		// Idle for a while, like a server between two peaks of requests
+		struct timespec idle = {.tv_sec = 0, .tv_nsec = 20 * 1000 * 1000};
+		nanosleep(&idle, NULL);
+	}
+	free(objects);
+	return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file benchmarks/programs/threads/larson.c
+ * @brief A Larson-style program: each thread replaces random objects of its slots, then hands its slots over to a new thread,
+ * so objects are often freed by another thread than the one which allocated them
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define NB_THREADS	   8
+#define NB_ROUNDS	   6
+#define NB_SLOTS	   1000 // Per thread
+#define NB_OPS_PER_ROUND 20000
+#define MIN_SIZE	   8
+#define MAX_SIZE	   1000
+
+// The objects a thread works on, passed to the next thread of the same lineage
+typedef struct {
+	void* slots[NB_SLOTS];
+	uint64_t state;
+	int rounds_left;
+	int done;
+} Lineage;
+
+// Generate a pseudo-random number
+uint64_t next_random(uint64_t* state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+void* round_thread(void* arg) {
+	Lineage* lineage = arg;
+	for (int i = 0; i < NB_OPS_PER_ROUND; i++) {
+		size_t slot = next_random(&lineage->state) % NB_SLOTS;
+		size_t size = MIN_SIZE + next_random(&lineage->state) % (MAX_SIZE - MIN_SIZE + 1);
+		free(lineage->slots[slot]);
+		lineage->slots[slot]		 = malloc(size);
+		*(volatile uint8_t*)lineage->slots[slot] = (uint8_t)i;
+	}
+
+	// Like a server thread exiting and being replaced, the objects survive in the next thread
+	lineage->rounds_left--;
+	if (lineage->rounds_left > 0) {
+		pthread_t next;
+		pthread_create(&next, NULL, round_thread, lineage);
+		pthread_detach(next);
+	}
+	else {
+		for (int i = 0; i < NB_SLOTS; i++) {
+			free(lineage->slots[i]);
+		}
+		__atomic_store_n(&lineage->done, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+int main() {
+	// The main thread allocates every initial object, so the first round only frees remote ones
+	Lineage* lineages = malloc(NB_THREADS * sizeof(Lineage));
+	for (int t = 0; t < NB_THREADS; t++) {
+		lineages[t].state	= 0x9E3779B97F4A7C15ULL * (t + 1);
+		lineages[t].rounds_left = NB_ROUNDS;
+		lineages[t].done	= 0;
+		for (int i = 0; i < NB_SLOTS; i++) {
+			lineages[t].slots[i] = malloc(MIN_SIZE + next_random(&lineages[t].state) % (MAX_SIZE - MIN_SIZE + 1));
+		}
+	}
+
+	for (int t = 0; t < NB_THREADS; t++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, round_thread, &lineages[t]);
+		pthread_detach(thread);
+	}
+
+	// The threads are detached, so wait for the last round of each lineage
+	for (int t = 0; t < NB_THREADS; t++) {
+		while (!__atomic_load_n(&lineages[t].done, __ATOMIC_ACQUIRE)) {
+			sched_yield();
+		}
+	}
+	free(lineages);
+	return 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file benchmarks/programs/threads/server_pipeline.c
+ * @brief A program that simulates a pipelined server: receiver threads allocate buffers, hand them to worker threads
+ * through queues, and the workers free them once the request is processed
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NB_PAIRS	 4
+#define NB_BUFFERS	 50000 // Per receiver
+#define QUEUE_CAPACITY 256
+
+// A buffer received from the network
+typedef struct {
+	size_t size;
+	uint8_t* data;
+} Buffer;
+
+// A bounded queue between a receiver and a worker
+typedef struct {
+	Buffer* buffers[QUEUE_CAPACITY];
+	size_t head;
+	size_t tail;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} Queue;
+
+Queue queues[NB_PAIRS];
+
+// Push a buffer, waiting if the queue is full
+void queue_push(Queue* queue, Buffer* buffer) {
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->tail - queue->head == QUEUE_CAPACITY) {
+		pthread_cond_wait(&queue->not_full, &queue->mutex);
+	}
+	queue->buffers[queue->tail % QUEUE_CAPACITY] = buffer;
+	queue->tail++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+// Pop a buffer, waiting if the queue is empty
+Buffer* queue_pop(Queue* queue) {
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->tail == queue->head) {
+		pthread_cond_wait(&queue->not_empty, &queue->mutex);
+	}
+	Buffer* buffer = queue->buffers[queue->head % QUEUE_CAPACITY];
+	queue->head++;
+	pthread_cond_signal(&queue->not_full);
+	pthread_mutex_unlock(&queue->mutex);
+	return buffer;
+}
+
+void* receiver(void* arg) {
+	Queue* queue   = arg;
+	uint64_t state = (uintptr_t)arg;
+	for (int i = 0; i < NB_BUFFERS; i++) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+
+		// Mostly small packets, sometimes a big one
+		Buffer* buffer = malloc(sizeof(Buffer));
+		buffer->size   = (state >> 33) % 16 == 0 ? 8192 + (state >> 40) % 32768 : 64 + (state >> 40) % 1024;
+		buffer->data   = malloc(buffer->size);
+		memset(buffer->data, i, buffer->size);
+		queue_push(queue, buffer);
+	}
+	queue_push(queue, NULL);
+	return NULL;
+}
+
+void* worker(void* arg) {
+	Queue* queue	  = arg;
+	uint64_t checksum = 0;
+	Buffer* buffer;
+	while ((buffer = queue_pop(queue)) != NULL) {
+		// Decode into a temporary object which only lives while the buffer is processed
+		uint8_t* decoded = malloc(buffer->size / 2 + 1);
+		for (size_t i = 0; i < buffer->size / 2; i++) {
+			decoded[i] = buffer->data[2 * i] ^ buffer->data[2 * i + 1];
+		}
+		checksum += decoded[0] + buffer->size;
+		free(decoded);
+		free(buffer->data);
+		free(buffer);
+	}
+	return (void*)(uintptr_t)checksum;
+}
+
+int main() {
+	pthread_t receivers[NB_PAIRS];
+	pthread_t workers[NB_PAIRS];
+	for (int i = 0; i < NB_PAIRS; i++) {
+		pthread_mutex_init(&queues[i].mutex, NULL);
+		pthread_cond_init(&queues[i].not_empty, NULL);
+		pthread_cond_init(&queues[i].not_full, NULL);
+		pthread_create(&receivers[i], NULL, receiver, &queues[i]);
+		pthread_create(&workers[i], NULL, worker, &queues[i]);
+	}
+
+	uint64_t checksum = 0;
+	for (int i = 0; i < NB_PAIRS; i++) {
+		void* res;
+		pthread_join(receivers[i], NULL);
+		pthread_join(workers[i], &res);
+		checksum += (uintptr_t)res;
+	}
+	return checksum == 0;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file benchmarks/programs/threads/server_requests.c
+ * @brief A program that simulates a server: worker threads build per-request objects which die at the end of the request,
+ * and a few of them are kept as long-lived entries of a shared cache
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NB_WORKERS	     8
+#define NB_REQUESTS	     20000 // Per worker
+#define NB_CACHE_ENTRIES     1024
+#define CACHE_ONE_REQUEST_IN 16
+
+// A header of a request, parsed into its own allocation
+typedef struct Header {
+	char* name;
+	char* value;
+	struct Header* next;
+} Header;
+
+// A request, with its headers and body
+typedef struct {
+	char* path;
+	Header* headers;
+	uint8_t* body;
+	size_t body_size;
+} Request;
+
+// An entry of the shared cache, which outlives the request which created it
+typedef struct {
+	uint64_t key;
+	char* response;
+	size_t response_size;
+} CacheEntry;
+
+CacheEntry cache[NB_CACHE_ENTRIES];
+pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Generate a pseudo-random number
+uint64_t next_random(uint64_t* state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+// Copy a string of a given length into a new allocation
+char* copy_string(const char* src, size_t len) {
+	char* str = malloc(len + 1);
+	memcpy(str, src, len);
+	str[len] = '\0';
+	return str;
+}
+
+// Build a request with a random number of headers and a random body size
+Request* parse_request(uint64_t* state) {
+	static const char TEXT[] = "GET /index.html HTTP/1.1 Host: example.com Accept: text/html Cookie: session=0123456789abcdef";
+	Request* request	 = malloc(sizeof(Request));
+	request->path		 = copy_string(TEXT + 4, 8 + next_random(state) % 24);
+	request->headers	 = NULL;
+	size_t nb_headers	 = 4 + next_random(state) % 12;
+	for (size_t i = 0; i < nb_headers; i++) {
+		Header* header	 = malloc(sizeof(Header));
+		header->name	 = copy_string(TEXT + 25, 4 + next_random(state) % 12);
+		header->value	 = copy_string(TEXT + 40, 8 + next_random(state) % 48);
+		header->next	 = request->headers;
+		request->headers = header;
+	}
+
+	// Most bodies are small, some are uploads
+	request->body_size = next_random(state) % 8 == 0 ? 4096 + next_random(state) % 60000 : next_random(state) % 512;
+	request->body	   = malloc(request->body_size + 1);
+	memset(request->body, 'x', request->body_size);
+	return request;
+}
+
+// Free a request and everything it owns
+void free_request(Request* request) {
+	while (request->headers != NULL) {
+		Header* next = request->headers->next;
+		free(request->headers->name);
+		free(request->headers->value);
+		free(request->headers);
+		request->headers = next;
+	}
+	free(request->body);
+	free(request->path);
+	free(request);
+}
+
+// Handle a request, building a response and sometimes keeping it in the cache
+uint64_t handle_request(Request* request, uint64_t* state) {
+	size_t response_size = 256 + request->body_size / 2;
+	char* response	     = malloc(response_size);
+	memset(response, 'y', response_size);
+	uint64_t checksum = (uint8_t)request->path[0] + response_size;
+
+	if (next_random(state) % CACHE_ONE_REQUEST_IN == 0) {
+		// Replace an entry of the cache, the old response was allocated by any worker
+		size_t slot = next_random(state) % NB_CACHE_ENTRIES;
+		pthread_mutex_lock(&cache_mutex);
+		char* old_response	  = cache[slot].response;
+		cache[slot].key		  = checksum;
+		cache[slot].response	  = response;
+		cache[slot].response_size = response_size;
+		pthread_mutex_unlock(&cache_mutex);
+		free(old_response);
+	}
+	else {
+		free(response);
+	}
+	return checksum;
+}
+
+void* worker(void* arg) {
+	uint64_t state	  = (uintptr_t)arg * 0x9E3779B97F4A7C15ULL + 1;
+	uint64_t checksum = 0;
+	for (int i = 0; i < NB_REQUESTS; i++) {
+		Request* request = parse_request(&state);
+		checksum += handle_request(request, &state);
+		free_request(request);
+	}
+	return (void*)(uintptr_t)checksum;
+}
+
+int main() {
+	pthread_t workers[NB_WORKERS];
+	for (uintptr_t i = 0; i < NB_WORKERS; i++) {
+		pthread_create(&workers[i], NULL, worker, (void*)i);
+	}
+	uint64_t checksum = 0;
+	for (int i = 0; i < NB_WORKERS; i++) {
+		void* res;
+		pthread_join(workers[i], &res);
+		checksum += (uintptr_t)res;
+	}
+
+	for (int i = 0; i < NB_CACHE_ENTRIES; i++) {
+		free(cache[i].response);
+	}
+	return checksum == 0;
+}
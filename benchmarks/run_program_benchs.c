@@ -312,7 +312,7 @@ int main(int argc, char** argv) {
 		char output[MAX_PATH];
 		char* without_ext = clone_and_remove_extension(files[i]);
 		snprintf(output, sizeof(output), "target/c_bins/%s", basename(without_ext));
-		compile_benchmark(files[i], output, "-O3");
+		compile_benchmark(files[i], output, "-O3 -pthread");
 
 		char command[MAX_COMMAND];
 		snprintf(command, sizeof(command), "./%s", output);
@@ -0,0 +1,249 @@
+/**
+ * @file benchmarks/run_thread_benchs.c
+ * @brief Compare how challoc and libc scale with the number of threads
+ */
+
+/** \addtogroup Challoc_thread_benchmarks Challoc Thread Scaling Benchmarks
+ *  @{
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/challoc.h"
+
+#define BLUE  "\033[34m"
+#define RESET "\033[0m"
+#define BOLD  "\033[1m"
+
+#define MAX_THREADS_LOG2 6  // 2^6 = 64 threads at most, whatever the number of CPUs
+#define WORKING_SET	 256 // Number of live allocations kept by each thread
+#define NB_OPS		 200000
+
+/**
+ * @brief The allocator in use
+ */
+typedef struct {
+	const char* name;		 ///< Name of the allocator, used as a column of the csv
+	void* (*alloc)(size_t);		 ///< malloc
+	void* (*zalloc)(size_t, size_t); ///< calloc
+	void* (*resize)(void*, size_t);	 ///< realloc
+	void (*dealloc)(void*);		 ///< free
+} Allocator;
+
+/**
+ * @brief The operation each thread repeats
+ */
+typedef enum {
+	MALLOC_FREE,  ///< Free a random live allocation and malloc a new one in its place
+	CALLOC_FREE,  ///< Free a random live allocation and calloc a new one in its place
+	REALLOC,      ///< Realloc a random live allocation to a new size
+	NB_OPERATIONS ///< Number of operations
+} Operation;
+
+const char* OPERATION_NAMES[NB_OPERATIONS] = {"malloc_free", "calloc_free", "realloc"};
+
+/**
+ * @brief The range of sizes requested, chosen uniformly in [min, max]
+ */
+typedef struct {
+	const char* name; ///< Name of the size mix
+	size_t min;	  ///< Smallest size
+	size_t max;	  ///< Biggest size
+} SizeMix;
+
+const SizeMix SIZE_MIXES[] = {
+    {"small", 8, 256},
+    {"medium", 512, 8192},
+    {"large", 16384, 262144},
+    {"mixed", 8, 65536},
+};
+#define NB_SIZE_MIXES (sizeof(SIZE_MIXES) / sizeof(SIZE_MIXES[0]))
+
+/**
+ * @brief What each thread of a benchmark does
+ */
+typedef struct {
+	Allocator allocator;	    ///< The allocator to use
+	Operation operation;	    ///< The operation to repeat
+	SizeMix sizes;		    ///< The sizes to request
+	uint64_t seed;		    ///< Seed of the size and slot generator, different for each thread
+	pthread_barrier_t* barrier; ///< Makes all the threads start at the same time
+} ThreadArgs;
+
+/**
+ * @brief Generate a pseudo-random number
+ * @param state The state of the generator, updated
+ * @return The next number
+ */
+uint64_t xorshift(uint64_t* state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+/**
+ * @brief Pick a random size of a size mix
+ * @param sizes The size mix
+ * @param state The state of the generator
+ * @return The size
+ */
+size_t random_size(SizeMix sizes, uint64_t* state) {
+	return sizes.min + xorshift(state) % (sizes.max - sizes.min + 1);
+}
+
+/**
+ * @brief Fill a working set, then repeat an operation on random slots of it, and free everything
+ * @param arg The ThreadArgs of the thread
+ * @return NULL
+ */
+void* bench_thread(void* arg) {
+	ThreadArgs* args = arg;
+	Allocator a	 = args->allocator;
+	uint64_t state	 = args->seed;
+	void* slots[WORKING_SET];
+	for (int i = 0; i < WORKING_SET; i++) {
+		slots[i] = a.alloc(random_size(args->sizes, &state));
+	}
+
+	pthread_barrier_wait(args->barrier);
+	for (int n = 0; n < NB_OPS; n++) {
+		size_t slot = xorshift(&state) % WORKING_SET;
+		size_t size = random_size(args->sizes, &state);
+		switch (args->operation) {
+			case MALLOC_FREE:
+				a.dealloc(slots[slot]);
+				slots[slot] = a.alloc(size);
+				break;
+			case CALLOC_FREE:
+				a.dealloc(slots[slot]);
+				slots[slot] = a.zalloc(1, size);
+				break;
+			case REALLOC:
+				slots[slot] = a.resize(slots[slot], size);
+				break;
+			case NB_OPERATIONS:
+				break;
+		}
+		// Write to the allocation like a real program would
+		*(volatile uint8_t*)slots[slot] = (uint8_t)n;
+	}
+	pthread_barrier_wait(args->barrier);
+
+	for (int i = 0; i < WORKING_SET; i++) {
+		a.dealloc(slots[i]);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Run an operation with a number of threads
+ * @param allocator The allocator to use
+ * @param operation The operation to repeat
+ * @param sizes The sizes to request
+ * @param nb_threads The number of threads
+ * @return The number of operations done per second by all the threads together
+ */
+double bench_ops_per_sec(Allocator allocator, Operation operation, SizeMix sizes, int nb_threads) {
+	pthread_t threads[1 << MAX_THREADS_LOG2];
+	ThreadArgs args[1 << MAX_THREADS_LOG2];
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, nb_threads + 1);
+	for (int t = 0; t < nb_threads; t++) {
+		args[t] = (ThreadArgs){allocator, operation, sizes, 0x9E3779B97F4A7C15ULL * (t + 1), &barrier};
+		pthread_create(&threads[t], NULL, bench_thread, &args[t]);
+	}
+
+	// Only time the operations, not the filling and the emptying of the working sets
+	struct timespec bench_start, bench_end;
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &bench_start);
+	pthread_barrier_wait(&barrier);
+	clock_gettime(CLOCK_MONOTONIC, &bench_end);
+	for (int t = 0; t < nb_threads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	pthread_barrier_destroy(&barrier);
+
+	double elapsed = (double)(bench_end.tv_sec - bench_start.tv_sec) + (double)(bench_end.tv_nsec - bench_start.tv_nsec) / 1e9;
+	return (double)nb_threads * NB_OPS / elapsed;
+}
+
+/**
+ * @brief Benchmark an operation and a size mix with 1, 2, 4, ... threads for each allocator, and write the results to a csv
+ * @param allocators The allocators to compare
+ * @param nb_allocators The number of allocators
+ * @param operation The operation to repeat
+ * @param sizes The sizes to request
+ * @param max_threads_log2 The log2 of the maximum number of threads
+ * @param output_dir The output directory
+ */
+void bench_scaling(Allocator* allocators, size_t nb_allocators, Operation operation, SizeMix sizes, int max_threads_log2,
+		   char* output_dir) {
+	// Write it in csv (threads, then the operations per second of each allocator)
+	char full_path[200];
+	snprintf(full_path, 200, "benchmarks/results/%s/%s_%s.csv", output_dir, OPERATION_NAMES[operation], sizes.name);
+	FILE* file = fopen(full_path, "w");
+	if (!file) {
+		perror("fopen");
+		return;
+	}
+	fprintf(file, "threads");
+	for (size_t a = 0; a < nb_allocators; a++) {
+		fprintf(file, ",%s", allocators[a].name);
+	}
+	fprintf(file, "\n");
+
+	for (int i = 0; i <= max_threads_log2; i++) {
+		int nb_threads = 1 << i;
+		fprintf(file, "%d", nb_threads);
+		printf(BLUE "%s %s (%d threads):" RESET, OPERATION_NAMES[operation], sizes.name, nb_threads);
+		for (size_t a = 0; a < nb_allocators; a++) {
+			double ops_per_sec = bench_ops_per_sec(allocators[a], operation, sizes, nb_threads);
+			fprintf(file, ",%.0f", ops_per_sec);
+			printf(" %s: " BOLD "%.2f" RESET " Mops/s", allocators[a].name, ops_per_sec / 1e6);
+		}
+		fprintf(file, "\n");
+		printf("\n");
+	}
+	fclose(file);
+	printf("Wrote results to %s\n", full_path);
+}
+
+int main(int argc, char** argv) {
+	// Arguments: the directory to store the results in, and optionally the maximum number of threads
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s <output_dir> [max_threads]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	// Go up to twice the number of CPUs by default, to also see what happens when threads share them
+	long max_threads     = argc == 3 ? atol(argv[2]) : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads_log2 = 0;
+	while (max_threads_log2 < MAX_THREADS_LOG2 && (1L << (max_threads_log2 + 1)) <= max_threads) {
+		max_threads_log2++;
+	}
+	printf("Running with 1 to " BOLD "%d" RESET " threads\n", 1 << max_threads_log2);
+
+	Allocator allocators[] = {
+	    {"libc", malloc, calloc, realloc, free},
+	    {"challoc", chamalloc, chacalloc, charealloc, chafree},
+	};
+	for (Operation operation = 0; operation < NB_OPERATIONS; operation++) {
+		for (size_t s = 0; s < NB_SIZE_MIXES; s++) {
+			bench_scaling(allocators, sizeof(allocators) / sizeof(allocators[0]), operation, SIZE_MIXES[s], max_threads_log2, argv[1]);
+		}
+	}
+
+	return 0;
+}
+
+/** @} */
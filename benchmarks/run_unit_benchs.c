@@ -7,6 +7,8 @@
  *  @{
  */
 
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +30,16 @@
 
 uint64_t cpu_freq = 0;
 
+/**
+ * @brief Read the monotonic clock, to time a benchmark
+ * @return The time in nanoseconds
+ */
+uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
 /**
  * @brief Warm up the clock by doing a lot of nops
  */
@@ -90,6 +102,63 @@ void touch_memory(volatile uint8_t* ptr, size_t size_requested) {
 	ptr[last]	      = ~0;
 }
 
+/**
+ * @brief Column of the results of a benchmark, the first column of a file being what the benchmark is indexed by
+ */
+typedef struct {
+	char* name;		  ///< Header of the column
+	const uint64_t* integers; ///< Values of the column, or NULL if they are reals
+	const double* reals;	  ///< Values of the column if they aren't integers
+} CsvColumn;
+
+/**
+ * @brief Write the results of a benchmark to a csv file
+ * @param output_dir The output directory
+ * @param file_name The name of the file, without its extension
+ * @param nb_rows The number of values of each column
+ * @param nb_columns The number of columns
+ * @param columns The columns
+ */
+void write_csv(char* output_dir, char* file_name, size_t nb_rows, size_t nb_columns, const CsvColumn* columns) {
+	char full_path[200];
+	snprintf(full_path, 200, "benchmarks/results/%s/%s.csv", output_dir, file_name);
+	printf("Writing results to %s\n", full_path);
+	FILE* file = fopen(full_path, "w");
+	if (!file) {
+		perror("fopen");
+		return;
+	}
+
+	for (size_t c = 0; c < nb_columns; c++) {
+		fprintf(file, c == 0 ? "%s" : ",%s", columns[c].name);
+	}
+	fprintf(file, "\n");
+	for (size_t r = 0; r < nb_rows; r++) {
+		for (size_t c = 0; c < nb_columns; c++) {
+			if (columns[c].integers != NULL) {
+				fprintf(file, c == 0 ? "%lu" : ",%lu", columns[c].integers[r]);
+			}
+			else {
+				fprintf(file, c == 0 ? "%f" : ",%f", columns[c].reals[r]);
+			}
+		}
+		fprintf(file, "\n");
+	}
+	fclose(file);
+}
+
+/**
+ * @brief Fill the first column of the results of a benchmark indexed by powers of two
+ * @param keys The column to fill
+ * @param first The first power of two
+ * @param nb_keys The number of powers of two
+ */
+void powers_of_two(uint64_t* keys, uint64_t first, size_t nb_keys) {
+	for (size_t i = 0; i < nb_keys; i++) {
+		keys[i] = first << i;
+	}
+}
+
 /**
  * @brief Benchmark the malloc function
  * @param allocator_result The result of the benchmark
@@ -127,16 +196,14 @@ void bench_malloc(BenchResult* allocator_result, void* (*alloc)(size_t), void (*
 		nb_iters	    = nb_iters < MIN_ITERS ? MIN_ITERS : nb_iters;
 		printf("Will do" BOLD " %d " RESET "iterations\n", nb_iters);
 
-		struct timespec bench_start, bench_end;
-		clock_gettime(CLOCK_MONOTONIC, &bench_start);
+		uint64_t bench_start = now_ns();
 		for (int n = 0; n < nb_iters; n++) {
 			volatile uint8_t* ptr = alloc(size_requested);
 			touch_memory(ptr, size_requested);
 			dealloc((void*)ptr);
 		}
-		clock_gettime(CLOCK_MONOTONIC, &bench_end);
+		uint64_t elapsed_ns = now_ns() - bench_start;
 
-		uint64_t elapsed_ns	  = (bench_end.tv_sec - bench_start.tv_sec) * 1e9 + (bench_end.tv_nsec - bench_start.tv_nsec);
 		allocator_result->time[i] = elapsed_ns / nb_iters;
 		// Go back to line
 		printf("\033[A");
@@ -145,6 +212,222 @@ void bench_malloc(BenchResult* allocator_result, void* (*alloc)(size_t), void (*
 	}
 }
 
+#define SWEEP_MAX_SIZE 1024 // Sizes from 8 to 1024 bytes, every 8 bytes
+#define SWEEP_STEP     8
+
+/**
+ * @brief Benchmark malloc and free pairs for every multiple of 8 bytes up to SWEEP_MAX_SIZE, most of which are not powers of two
+ * @param time The time taken by a malloc and free pair, for each size
+ * @param alloc The allocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_malloc_sweep(uint64_t* time, void* (*alloc)(size_t), void (*dealloc)(void*), char* fn_name) {
+	// Keep some allocations alive so that the sizes don't all reuse the same freed pointer
+	const int NB_LIVE  = 64;
+	const int NB_ITERS = 2000;
+	volatile uint8_t* live[64];
+	for (size_t size = SWEEP_STEP; size <= SWEEP_MAX_SIZE; size += SWEEP_STEP) {
+		uint64_t bench_start = now_ns();
+		for (int n = 0; n < NB_ITERS; n++) {
+			for (int i = 0; i < NB_LIVE; i++) {
+				live[i] = alloc(size);
+				touch_memory(live[i], size);
+			}
+			for (int i = 0; i < NB_LIVE; i++) {
+				dealloc((void*)live[i]);
+			}
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+
+		time[size / SWEEP_STEP - 1] = elapsed_ns / ((uint64_t)NB_ITERS * NB_LIVE);
+	}
+	printf("%s: swept sizes from %d to %d bytes\n", fn_name, SWEEP_STEP, SWEEP_MAX_SIZE);
+}
+
+#define OCCUPANCY_SIZE	     24			     // Not close to a power of two, so challoc serves it from its slab pages
+#define OCCUPANCY_NB_OBJECTS (16384 / OCCUPANCY_SIZE) // About one slab page
+#define OCCUPANCY_NB_ITERS   200000
+
+/// Percentage of the slab page kept in use while measuring
+const uint64_t OCCUPANCIES[] = {0, 25, 50, 75, 90, 95, 99};
+#define NB_OCCUPANCIES (sizeof(OCCUPANCIES) / sizeof(OCCUPANCIES[0]))
+
+/**
+ * @brief Benchmark malloc and free pairs when the first free chunk of the slab page is behind a given share of chunks in use
+ * @param time The time taken by a malloc and free pair, for each occupancy
+ * @param alloc The allocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_slab_occupancy(uint64_t* time, void* (*alloc)(size_t), void (*dealloc)(void*), char* fn_name) {
+	void* objects[OCCUPANCY_NB_OBJECTS];
+	for (size_t o = 0; o < NB_OCCUPANCIES; o++) {
+		// Fill the page in order, then free its end so that only the first objects stay in use
+		size_t nb_kept = OCCUPANCY_NB_OBJECTS * OCCUPANCIES[o] / 100;
+		for (size_t i = 0; i < OCCUPANCY_NB_OBJECTS; i++) {
+			objects[i] = alloc(OCCUPANCY_SIZE);
+		}
+		for (size_t i = OCCUPANCY_NB_OBJECTS; i > nb_kept; i--) {
+			dealloc(objects[i - 1]);
+		}
+
+		uint64_t bench_start = now_ns();
+		for (int n = 0; n < OCCUPANCY_NB_ITERS; n++) {
+			volatile uint8_t* ptr = alloc(OCCUPANCY_SIZE);
+			touch_memory(ptr, OCCUPANCY_SIZE);
+			dealloc((void*)ptr);
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+		time[o]		    = elapsed_ns / OCCUPANCY_NB_ITERS;
+
+		for (size_t i = 0; i < nb_kept; i++) {
+			dealloc(objects[i]);
+		}
+		printf("%s: " BOLD "%lu" RESET " ns per pair with %lu%% of the page in use\n", fn_name, time[o], OCCUPANCIES[o]);
+	}
+}
+
+#define STREAMING_NB_BUFFERS  8	       // Buffers read or written together
+#define STREAMING_MIN_SIZE    (16 * 1024)   // From 16 KiB buffers, which fit in L1 together ...
+#define STREAMING_MAX_SIZE    (4096 * 1024) // ... to 4 MiB ones, which only fit in the last level cache or in memory
+#define STREAMING_TOTAL_BYTES (256 << 20)   // Number of bytes summed for each size, so that small buffers are walked many times
+
+/**
+ * @brief Benchmark walking several big buffers at once, which all get the same offset in a page when the allocator doesn't color them
+ * @param time The time taken by each float summed, for each size of buffers
+ * @param alloc The allocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_streaming(uint64_t* time, void* (*alloc)(size_t), void (*dealloc)(void*), char* fn_name) {
+	size_t i = 0;
+	for (size_t size = STREAMING_MIN_SIZE; size <= STREAMING_MAX_SIZE; size *= 2, i++) {
+		float* buffers[STREAMING_NB_BUFFERS];
+		for (int b = 0; b < STREAMING_NB_BUFFERS; b++) {
+			buffers[b] = alloc(size);
+			for (size_t j = 0; j < size / sizeof(float); j++) {
+				buffers[b][j] = (float)(j + b);
+			}
+		}
+
+		// Add the first buffers into the last one, like a stencil or a matrix operation going through rows
+		size_t nb_floats     = size / sizeof(float);
+		size_t nb_passes     = STREAMING_TOTAL_BYTES / (size * (STREAMING_NB_BUFFERS - 1));
+		float* dst	     = buffers[STREAMING_NB_BUFFERS - 1];
+		uint64_t bench_start = now_ns();
+		for (size_t pass = 0; pass < nb_passes; pass++) {
+			for (size_t j = 0; j < nb_floats; j++) {
+				dst[j] = buffers[0][j] + buffers[1][j] + buffers[2][j] + buffers[3][j] + buffers[4][j] + buffers[5][j] +
+					 buffers[6][j];
+			}
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+		// In picoseconds per float, as a pass is only a few nanoseconds per float
+		time[i] = elapsed_ns * 1000 / (nb_passes * nb_floats);
+
+		for (int b = 0; b < STREAMING_NB_BUFFERS; b++) {
+			dealloc(buffers[b]);
+		}
+		printf("%s: " BOLD "%lu" RESET " ps per float with buffers of %zu bytes\n", fn_name, time[i], size);
+	}
+}
+
+#define BATCH_SIZE	 100 // Not close to a power of two, so challoc serves it from its slab pages
+#define BATCH_TOTAL_PTRS 1048576 // Number of pointers allocated and freed for each batch size
+
+/// Number of pointers allocated and freed together
+const uint64_t BATCHES[] = {16, 64, 256, 1024};
+#define NB_BATCHES (sizeof(BATCHES) / sizeof(BATCHES[0]))
+
+/**
+ * @brief Benchmark allocating a batch of pointers, then freeing it, with individual calls
+ * @param time The time taken by a malloc and free pair, for each batch size
+ * @param alloc The allocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_batch(uint64_t* time, void* (*alloc)(size_t), void (*dealloc)(void*), char* fn_name) {
+	void* ptrs[1024];
+	for (size_t b = 0; b < NB_BATCHES; b++) {
+		uint64_t bench_start = now_ns();
+		for (size_t n = 0; n < BATCH_TOTAL_PTRS / BATCHES[b]; n++) {
+			for (size_t i = 0; i < BATCHES[b]; i++) {
+				ptrs[i] = alloc(BATCH_SIZE);
+			}
+			for (size_t i = 0; i < BATCHES[b]; i++) {
+				dealloc(ptrs[i]);
+			}
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+		time[b]		    = elapsed_ns / BATCH_TOTAL_PTRS;
+		printf("%s: " BOLD "%lu" RESET " ns per pair with batches of %lu\n", fn_name, time[b], BATCHES[b]);
+	}
+}
+
+/**
+ * @brief Benchmark allocating a batch of pointers, then freeing it, with chamalloc_batch and chafree_batch
+ * @param time The time taken by a malloc and free pair, for each batch size
+ */
+void bench_batch_api(uint64_t* time) {
+	void* ptrs[1024];
+	for (size_t b = 0; b < NB_BATCHES; b++) {
+		uint64_t bench_start = now_ns();
+		for (size_t n = 0; n < BATCH_TOTAL_PTRS / BATCHES[b]; n++) {
+			chamalloc_batch(BATCH_SIZE, BATCHES[b], ptrs);
+			chafree_batch(ptrs, BATCHES[b]);
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+		time[b]		    = elapsed_ns / BATCH_TOTAL_PTRS;
+		printf("chamalloc_batch: " BOLD "%lu" RESET " ns per pair with batches of %lu\n", time[b], BATCHES[b]);
+	}
+}
+
+/// Sizes whose overhead is measured, around the limit of the slab and in the blocks, 40 being a short string of count_occurences
+const uint64_t OVERHEAD_SIZES[] = {16, 40, 100, 256, 500, 513, 600, 1000, 1500, 2000, 3000, 4000};
+#define NB_OVERHEAD_SIZES (sizeof(OVERHEAD_SIZES) / sizeof(OVERHEAD_SIZES[0]))
+#define OVERHEAD_NB_PTRS  4096 // Number of allocations of each size, so that most of them are next to each other
+
+/**
+ * @brief Compare two addresses, for qsort
+ * @param a The first address
+ * @param b The second address
+ * @return The sign of a - b
+ */
+int compare_addresses(const void* a, const void* b) {
+	uintptr_t x = *(const uintptr_t*)a;
+	uintptr_t y = *(const uintptr_t*)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Measure how many bytes an allocation costs on top of its size, as the median distance between consecutive allocations
+ * of the same size minus that size, so that both the metadata and the rounding of the size are counted
+ * @param overhead The overhead in bytes, for each size
+ * @param alloc The allocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_overhead(uint64_t* overhead, void* (*alloc)(size_t), void (*dealloc)(void*), char* fn_name) {
+	static uintptr_t ptrs[OVERHEAD_NB_PTRS];
+	static size_t gaps[OVERHEAD_NB_PTRS - 1];
+	for (size_t s = 0; s < NB_OVERHEAD_SIZES; s++) {
+		for (size_t i = 0; i < OVERHEAD_NB_PTRS; i++) {
+			ptrs[i] = (uintptr_t)alloc(OVERHEAD_SIZES[s]);
+		}
+		qsort(ptrs, OVERHEAD_NB_PTRS, sizeof(uintptr_t), compare_addresses);
+		for (size_t i = 0; i + 1 < OVERHEAD_NB_PTRS; i++) {
+			gaps[i] = ptrs[i + 1] - ptrs[i];
+		}
+		qsort(gaps, OVERHEAD_NB_PTRS - 1, sizeof(size_t), compare_addresses);
+		overhead[s] = gaps[OVERHEAD_NB_PTRS / 2] - OVERHEAD_SIZES[s];
+		for (size_t i = 0; i < OVERHEAD_NB_PTRS; i++) {
+			dealloc((void*)ptrs[i]);
+		}
+		printf("%s: " BOLD "%lu" RESET " bytes of overhead for %lu bytes\n", fn_name, overhead[s], OVERHEAD_SIZES[s]);
+	}
+}
+
 /**
  * @brief Benchmark the realloc function
  * @param allocator_result The result of the benchmark
@@ -185,17 +468,15 @@ void bench_realloc(BenchResult* allocator_result, void* (*alloc)(size_t), void*
 		nb_iters	    = nb_iters < MIN_ITERS ? MIN_ITERS : nb_iters;
 		printf("Will do" BOLD " %d " RESET "iterations\n", nb_iters);
 
-		struct timespec bench_start, bench_end;
-		clock_gettime(CLOCK_MONOTONIC, &bench_start);
+		uint64_t bench_start = now_ns();
 		for (int n = 0; n < nb_iters; n++) {
 			volatile uint8_t* ptr = alloc(size_requested);
 			touch_memory(ptr, size_requested);
 			void* new_ptr = realloc((void*)ptr, size_requested * 2);
 			dealloc(new_ptr);
 		}
-		clock_gettime(CLOCK_MONOTONIC, &bench_end);
+		uint64_t elapsed_ns = now_ns() - bench_start;
 
-		uint64_t elapsed_ns	  = (bench_end.tv_sec - bench_start.tv_sec) * 1e9 + (bench_end.tv_nsec - bench_start.tv_nsec);
 		allocator_result->time[i] = elapsed_ns / nb_iters;
 		// Go back to line
 		printf("\033[A");
@@ -241,16 +522,14 @@ void bench_calloc(BenchResult* allocator_result, void* (*calloc)(size_t, size_t)
 		nb_iters	    = nb_iters < MIN_ITERS ? MIN_ITERS : nb_iters;
 		printf("Will do" BOLD " %d " RESET "iterations\n", nb_iters);
 
-		struct timespec bench_start, bench_end;
-		clock_gettime(CLOCK_MONOTONIC, &bench_start);
+		uint64_t bench_start = now_ns();
 		for (int n = 0; n < nb_iters; n++) {
 			volatile uint8_t* ptr = calloc(size_requested, 1);
 			touch_memory(ptr, size_requested);
 			dealloc((void*)ptr);
 		}
-		clock_gettime(CLOCK_MONOTONIC, &bench_end);
+		uint64_t elapsed_ns = now_ns() - bench_start;
 
-		uint64_t elapsed_ns	  = (bench_end.tv_sec - bench_start.tv_sec) * 1e9 + (bench_end.tv_nsec - bench_start.tv_nsec);
 		allocator_result->time[i] = elapsed_ns / nb_iters;
 		// Go back to line
 		printf("\033[A");
@@ -259,6 +538,258 @@ void bench_calloc(BenchResult* allocator_result, void* (*calloc)(size_t, size_t)
 	}
 }
 
+#define MAX_THREADS_LOG2 5 // 2^5 = 32 threads
+
+/**
+ * @brief What each thread of the multi-threaded benchmark does
+ */
+typedef struct {
+	void* (*alloc)(size_t); ///< The allocator to use
+	void (*dealloc)(void*); ///< The deallocator to use
+	int nb_iters;		///< The number of iterations to do
+} ThreadBenchArgs;
+
+/**
+ * @brief Allocate a handful of small objects of mixed sizes then free them, nb_iters times
+ * @param arg The ThreadBenchArgs of the thread
+ * @return NULL
+ */
+void* malloc_free_thread(void* arg) {
+	ThreadBenchArgs* args	    = arg;
+	static const size_t SIZES[] = {16, 8, 32, 64, 24, 128, 16, 512};
+	const int NB_SIZES	    = sizeof(SIZES) / sizeof(SIZES[0]);
+	volatile uint8_t* ptrs[sizeof(SIZES) / sizeof(SIZES[0])];
+	for (int n = 0; n < args->nb_iters; n++) {
+		for (int i = 0; i < NB_SIZES; i++) {
+			ptrs[i] = args->alloc(SIZES[i]);
+			touch_memory(ptrs[i], SIZES[i]);
+		}
+		for (int i = 0; i < NB_SIZES; i++) {
+			args->dealloc((void*)ptrs[i]);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Benchmark small mallocs and frees done concurrently by 1, 2, 4, ... threads
+ * @param time The time taken by a malloc and free pair, for each number of threads
+ * @param hit_rate The thread cache hit rate for each number of threads, NULL for allocators which aren't challoc
+ * @param alloc The allocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_malloc_threads(uint64_t* time, double* hit_rate, void* (*alloc)(size_t), void (*dealloc)(void*), char* fn_name) {
+	const int NB_ITERS	   = 100000;
+	const int NB_PTRS_PER_ITER = 8;
+	for (int i = 0; i <= MAX_THREADS_LOG2; i++) {
+		int nb_threads = 1 << i;
+		printf(BLUE "%s(%d threads):	" RESET "\n", fn_name, nb_threads);
+
+		ChallocStats stats_before = hit_rate != NULL ? chastats() : (ChallocStats){0};
+		pthread_t threads[1 << MAX_THREADS_LOG2];
+		ThreadBenchArgs args = {alloc, dealloc, NB_ITERS};
+
+		uint64_t bench_start = now_ns();
+		for (int t = 0; t < nb_threads; t++) {
+			pthread_create(&threads[t], NULL, malloc_free_thread, &args);
+		}
+		for (int t = 0; t < nb_threads; t++) {
+			pthread_join(threads[t], NULL);
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+		uint64_t nb_pairs   = (uint64_t)nb_threads * NB_ITERS * NB_PTRS_PER_ITER;
+		time[i]		    = elapsed_ns / (nb_pairs / nb_threads);
+		// Go back to line
+		printf("\033[A");
+		printf("\033[K");
+		printf("%s(%d threads): average_time: %.9f seconds", fn_name, nb_threads, (double)time[i] / 1e9);
+
+		// The threads published their thread cache counters when they exited, which only challoc has
+		if (hit_rate != NULL) {
+			ChallocStats stats_after = chastats();
+			size_t hits		 = stats_after.tcache_hits - stats_before.tcache_hits;
+			size_t misses		 = stats_after.tcache_misses - stats_before.tcache_misses;
+			hit_rate[i]		 = hits + misses == 0 ? 0.0 : (double)hits / (double)(hits + misses);
+			printf(", thread cache hit rate: %.2f%%", hit_rate[i] * 100);
+		}
+		printf("\n");
+	}
+}
+
+#define MAX_PAIRS_LOG2 2 // 2^2 = 4 producer/consumer pairs
+#define RING_SIZE	1024
+
+/**
+ * @brief Ring buffer through which a producer thread hands its buffers to a consumer thread
+ */
+typedef struct {
+	void* slots[RING_SIZE]; ///< Buffers in flight
+	size_t head;		///< Number of buffers pushed by the producer
+	size_t tail;		///< Number of buffers popped by the consumer
+} Ring;
+
+/**
+ * @brief What each thread of a producer/consumer pair does
+ */
+typedef struct {
+	void* (*alloc)(size_t); ///< The allocator to use
+	void (*dealloc)(void*); ///< The deallocator to use
+	int nb_items;		///< The number of buffers going through the ring
+	Ring* ring;		///< The ring shared by the pair
+} PairBenchArgs;
+
+/**
+ * @brief Allocate buffers of mixed sizes, fill them and hand them to the consumer
+ * @param arg The PairBenchArgs of the pair
+ * @return NULL
+ */
+void* producer_thread(void* arg) {
+	PairBenchArgs* args	    = arg;
+	static const size_t SIZES[] = {1000, 4096, 600, 70000, 2000, 16384, 3000, 100000};
+	const int NB_SIZES	    = sizeof(SIZES) / sizeof(SIZES[0]);
+	for (int n = 0; n < args->nb_items; n++) {
+		volatile uint8_t* ptr = args->alloc(SIZES[n % NB_SIZES]);
+		touch_memory(ptr, SIZES[n % NB_SIZES]);
+		while (args->ring->head - __atomic_load_n(&args->ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+			sched_yield();
+		}
+		args->ring->slots[args->ring->head % RING_SIZE] = (void*)ptr;
+		__atomic_store_n(&args->ring->head, args->ring->head + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Take the buffers of the producer out of the ring and free them
+ * @param arg The PairBenchArgs of the pair
+ * @return NULL
+ */
+void* consumer_thread(void* arg) {
+	PairBenchArgs* args = arg;
+	for (int n = 0; n < args->nb_items; n++) {
+		while (__atomic_load_n(&args->ring->head, __ATOMIC_ACQUIRE) == args->ring->tail) {
+			sched_yield();
+		}
+		void* ptr = args->ring->slots[args->ring->tail % RING_SIZE];
+		__atomic_store_n(&args->ring->tail, args->ring->tail + 1, __ATOMIC_RELEASE);
+		args->dealloc(ptr);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Benchmark buffers allocated by one thread and freed by another, with 1, 2, 4, ... producer/consumer pairs
+ * @param time The time taken by a buffer to be allocated and freed, for each number of pairs
+ * @param alloc The allocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_producer_consumer(uint64_t* time, void* (*alloc)(size_t), void (*dealloc)(void*), char* fn_name) {
+	const int NB_ITEMS = 50000;
+	for (int i = 0; i <= MAX_PAIRS_LOG2; i++) {
+		int nb_pairs = 1 << i;
+		printf(BLUE "%s(%d pairs):	" RESET "\n", fn_name, nb_pairs);
+
+		// Each pair has its own ring
+		pthread_t producers[1 << MAX_PAIRS_LOG2];
+		pthread_t consumers[1 << MAX_PAIRS_LOG2];
+		PairBenchArgs args[1 << MAX_PAIRS_LOG2];
+		for (int p = 0; p < nb_pairs; p++) {
+			Ring* ring = alloc(sizeof(Ring));
+			ring->head = 0;
+			ring->tail = 0;
+			args[p]	   = (PairBenchArgs){alloc, dealloc, NB_ITEMS, ring};
+		}
+
+		uint64_t bench_start = now_ns();
+		for (int p = 0; p < nb_pairs; p++) {
+			pthread_create(&producers[p], NULL, producer_thread, &args[p]);
+			pthread_create(&consumers[p], NULL, consumer_thread, &args[p]);
+		}
+		for (int p = 0; p < nb_pairs; p++) {
+			pthread_join(producers[p], NULL);
+			pthread_join(consumers[p], NULL);
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+		for (int p = 0; p < nb_pairs; p++) {
+			dealloc(args[p].ring);
+		}
+
+		time[i]		    = elapsed_ns / NB_ITEMS;
+		// Go back to line
+		printf("\033[A");
+		printf("\033[K");
+		printf("%s(%d pairs): average_time: %.9f seconds\n", fn_name, nb_pairs, (double)time[i] / 1e9);
+	}
+}
+
+#define MAX_CONTENDERS_LOG2 3 // 2^3 = 8 threads fighting for the same lock
+
+/**
+ * @brief Allocate and free objects too big for the minislab, nb_iters times, so that each call takes the lock of an arena
+ * @param arg The ThreadBenchArgs of the thread
+ * @return NULL
+ */
+void* malloc_free_blocks_thread(void* arg) {
+	ThreadBenchArgs* args	    = arg;
+	static const size_t SIZES[] = {1024, 4096, 768, 2048};
+	const int NB_SIZES	    = sizeof(SIZES) / sizeof(SIZES[0]);
+	for (int n = 0; n < args->nb_iters; n++) {
+		volatile uint8_t* ptr = args->alloc(SIZES[n % NB_SIZES]);
+		touch_memory(ptr, 8);
+		args->dealloc((void*)ptr);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Benchmark 1, 2, 4, ... threads allocating and freeing blocks in the same arena, to measure the lock under contention
+ * @param time The time taken by a malloc and free pair, for each number of threads
+ * @param spins The number of pause instructions spent waiting for a lock per pair, for each number of threads, NULL for allocators
+ * which aren't challoc
+ * @param futex_waits The number of times a thread was parked, for each number of threads, NULL for allocators which aren't challoc
+ * @param alloc The allocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_lock_contention(uint64_t* time, double* spins, uint64_t* futex_waits, void* (*alloc)(size_t), void (*dealloc)(void*),
+			   char* fn_name) {
+	const int NB_ITERS = 200000;
+	for (int i = 0; i <= MAX_CONTENDERS_LOG2; i++) {
+		int nb_threads = 1 << i;
+		printf(BLUE "%s(%d threads):	" RESET "\n", fn_name, nb_threads);
+
+		ChallocStats stats_before = spins != NULL ? chastats() : (ChallocStats){0};
+		pthread_t threads[1 << MAX_CONTENDERS_LOG2];
+		ThreadBenchArgs args = {alloc, dealloc, NB_ITERS};
+
+		uint64_t bench_start = now_ns();
+		for (int t = 0; t < nb_threads; t++) {
+			pthread_create(&threads[t], NULL, malloc_free_blocks_thread, &args);
+		}
+		for (int t = 0; t < nb_threads; t++) {
+			pthread_join(threads[t], NULL);
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+		uint64_t nb_pairs   = (uint64_t)nb_threads * NB_ITERS;
+		time[i]		    = elapsed_ns / (nb_pairs / nb_threads);
+		// Go back to line
+		printf("\033[A");
+		printf("\033[K");
+		printf("%s(%d threads): average_time: %.9f seconds", fn_name, nb_threads, (double)time[i] / 1e9);
+
+		// Only challoc counts how long its threads waited for its locks
+		if (spins != NULL) {
+			ChallocStats stats_after = chastats();
+			spins[i]		 = (double)(stats_after.lock_spins - stats_before.lock_spins) / (double)nb_pairs;
+			futex_waits[i]		 = stats_after.lock_futex_waits - stats_before.lock_futex_waits;
+			printf(", spins per pair: %.2f, futex waits: %lu", spins[i], futex_waits[i]);
+		}
+		printf("\n");
+	}
+}
+
 /**
  * @brief Write the results of a benchmark to a file
  * @param libc The result of the libc benchmark
@@ -266,21 +797,102 @@ void bench_calloc(BenchResult* allocator_result, void* (*calloc)(size_t, size_t)
  * @param output_dir The output directory
  */
 void write_results(BenchResult libc, BenchResult challoc, char* output_dir) {
-	// Write it in csv (size, libc, challoc)
-	char full_path[200];
-	snprintf(full_path, 200, "benchmarks/results/%s/%s.csv", output_dir, libc.fn_name);
-	printf("Writing results to %s\n", full_path);
-	FILE* file = fopen(full_path, "w");
-	if (!file) {
-		perror("fopen");
+	uint64_t sizes[MAX_SIZE + 1];
+	powers_of_two(sizes, 1, MAX_SIZE + 1);
+	write_csv(output_dir, libc.fn_name, MAX_SIZE + 1, 3, (CsvColumn[]){{"size", sizes}, {"libc", libc.time}, {"challoc", challoc.time}});
+}
+
+#define HUGE_BUFFER_SIZE (32 << 20) // Size of each live huge buffer, above the default threshold of challoc
+#define HUGE_MEDIUM_SIZE 40000	     // Size of the allocations timed, too big for the thread caches so they go to the blocks
+#define HUGE_NB_PAIRS	 200000	     // Number of malloc and free pairs timed for each number of live huge buffers
+#define HUGE_CHURN_EVERY 1000	     // A huge buffer is replaced every this many pairs, like a program resizing its big arrays
+
+/// Number of huge buffers kept alive while medium allocations are timed
+const uint64_t HUGE_LIVE[] = {0, 4, 16, 64};
+#define NB_HUGE_LIVE (sizeof(HUGE_LIVE) / sizeof(HUGE_LIVE[0]))
+
+/**
+ * @brief Benchmark medium allocations while huge buffers are alive and sometimes replaced, which shouldn't slow them down
+ * @param time The time taken by a malloc and free pair, for each number of live huge buffers
+ * @param alloc The allocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_huge_live(uint64_t* time, void* (*alloc)(size_t), void (*dealloc)(void*), char* fn_name) {
+	static volatile uint8_t* huge[64];
+	for (size_t l = 0; l < NB_HUGE_LIVE; l++) {
+		for (size_t i = 0; i < HUGE_LIVE[l]; i++) {
+			huge[i]	   = alloc(HUGE_BUFFER_SIZE);
+			huge[i][0] = 1;
+		}
+
+		uint64_t bench_start = now_ns();
+		for (size_t n = 0; n < HUGE_NB_PAIRS; n++) {
+			volatile uint8_t* ptr = alloc(HUGE_MEDIUM_SIZE);
+			ptr[0]		      = (uint8_t)n;
+			dealloc((void*)ptr);
+			if (HUGE_LIVE[l] > 0 && n % HUGE_CHURN_EVERY == 0) {
+				size_t i = (n / HUGE_CHURN_EVERY) % HUGE_LIVE[l];
+				dealloc((void*)huge[i]);
+				huge[i]	   = alloc(HUGE_BUFFER_SIZE);
+				huge[i][0] = 1;
+			}
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+		time[l]		    = elapsed_ns / HUGE_NB_PAIRS;
+		printf("%s: " BOLD "%lu" RESET " ns per pair with %lu live huge buffers\n", fn_name, time[l], HUGE_LIVE[l]);
+
+		for (size_t i = 0; i < HUGE_LIVE[l]; i++) {
+			dealloc((void*)huge[i]);
+		}
 	}
+}
 
-	fprintf(file, "size,libc,challoc\n");
-	for (int i = 0; i <= MAX_SIZE; i++) {
-		size_t size_requested = 1ULL << i;
-		fprintf(file, "%zu,%lu,%lu\n", size_requested, libc.time[i], challoc.time[i]);
+#define GROWTH_FINAL_SIZE (1 << 20) // Size a buffer grows to, like a log buffer or a vector being filled
+#define GROWTH_NB_BUFFERS 64	    // Number of buffers grown one after the other for each step
+
+/// Number of bytes appended to the buffer before each realloc
+const uint64_t GROWTH_STEPS[] = {16, 256, 4096, 65536};
+#define NB_GROWTH_STEPS (sizeof(GROWTH_STEPS) / sizeof(GROWTH_STEPS[0]))
+
+/**
+ * @brief Benchmark growing buffers with realloc a few bytes at a time, counting the bytes copied when they move
+ * @param time The time taken by a realloc, for each step
+ * @param copied The bytes copied for each byte of the final buffer, for each step
+ * @param alloc The allocator to use
+ * @param resize The reallocator to use
+ * @param dealloc The deallocator to use
+ * @param fn_name The name of the function being benchmarked
+ */
+void bench_realloc_growth(uint64_t* time, double* copied, void* (*alloc)(size_t), void* (*resize)(void*, size_t),
+			  void (*dealloc)(void*), char* fn_name) {
+	for (size_t g = 0; g < NB_GROWTH_STEPS; g++) {
+		size_t nb_reallocs   = 0;
+		size_t bytes_moved   = 0;
+		uint64_t bench_start = now_ns();
+		for (int b = 0; b < GROWTH_NB_BUFFERS; b++) {
+			size_t size		 = GROWTH_STEPS[g];
+			volatile uint8_t* buffer = alloc(size);
+			buffer[size - 1]	 = (uint8_t)size;
+			while (size < GROWTH_FINAL_SIZE) {
+				volatile uint8_t* grown = resize((void*)buffer, size + GROWTH_STEPS[g]);
+				// A buffer which moves had all its content copied, unless the kernel remapped its pages
+				if (grown != buffer) {
+					bytes_moved += size;
+				}
+				buffer = grown;
+				size += GROWTH_STEPS[g];
+				buffer[size - 1] = (uint8_t)size;
+				nb_reallocs++;
+			}
+			dealloc((void*)buffer);
+		}
+		uint64_t elapsed_ns = now_ns() - bench_start;
+		time[g]		    = elapsed_ns / nb_reallocs;
+		copied[g]	    = (double)bytes_moved / ((double)GROWTH_NB_BUFFERS * GROWTH_FINAL_SIZE);
+		printf("%s: " BOLD "%lu" RESET " ns per realloc and %.3f bytes copied per byte with steps of %lu bytes\n", fn_name, time[g],
+		       copied[g], GROWTH_STEPS[g]);
 	}
-	fclose(file);
 }
 
 int main(int argc, char** argv) {
@@ -305,18 +917,126 @@ int main(int argc, char** argv) {
 	bench_malloc(&challoc, chamalloc, chafree, "chamalloc");
 	write_results(libc, challoc, argv[1]);
 
+	uint64_t libc_sweep[SWEEP_MAX_SIZE / SWEEP_STEP];
+	uint64_t challoc_sweep[SWEEP_MAX_SIZE / SWEEP_STEP];
+	bench_malloc_sweep(libc_sweep, malloc, free, "malloc");
+	bench_malloc_sweep(challoc_sweep, chamalloc, chafree, "chamalloc");
+	uint64_t sweep_sizes[SWEEP_MAX_SIZE / SWEEP_STEP];
+	for (size_t i = 0; i < SWEEP_MAX_SIZE / SWEEP_STEP; i++) {
+		sweep_sizes[i] = (i + 1) * SWEEP_STEP;
+	}
+	write_csv(argv[1], "malloc_size_sweep", SWEEP_MAX_SIZE / SWEEP_STEP, 3,
+		  (CsvColumn[]){{"size", sweep_sizes}, {"libc", libc_sweep}, {"challoc", challoc_sweep}});
+
+	uint64_t libc_occupancy[NB_OCCUPANCIES];
+	uint64_t challoc_occupancy[NB_OCCUPANCIES];
+	bench_slab_occupancy(libc_occupancy, malloc, free, "malloc");
+	bench_slab_occupancy(challoc_occupancy, chamalloc, chafree, "chamalloc");
+	write_csv(argv[1], "slab_occupancy", NB_OCCUPANCIES, 3,
+		  (CsvColumn[]){{"occupancy", OCCUPANCIES}, {"libc", libc_occupancy}, {"challoc", challoc_occupancy}});
+
+	uint64_t libc_streaming[32];
+	uint64_t challoc_streaming[32];
+	bench_streaming(libc_streaming, malloc, free, "malloc");
+	bench_streaming(challoc_streaming, chamalloc, chafree, "chamalloc");
+	uint64_t streaming_sizes[32];
+	size_t nb_streaming_sizes = 0;
+	for (size_t size = STREAMING_MIN_SIZE; size <= STREAMING_MAX_SIZE; size *= 2) {
+		streaming_sizes[nb_streaming_sizes++] = size;
+	}
+	write_csv(argv[1], "streaming_buffers", nb_streaming_sizes, 3,
+		  (CsvColumn[]){{"size", streaming_sizes}, {"libc", libc_streaming}, {"challoc", challoc_streaming}});
+
+	uint64_t libc_batch[NB_BATCHES];
+	uint64_t challoc_batch[NB_BATCHES];
+	uint64_t challoc_batch_api[NB_BATCHES];
+	bench_batch(libc_batch, malloc, free, "malloc");
+	bench_batch(challoc_batch, chamalloc, chafree, "chamalloc");
+	bench_batch_api(challoc_batch_api);
+	write_csv(argv[1], "batch_alloc", NB_BATCHES, 4,
+		  (CsvColumn[]){{"batch", BATCHES}, {"libc", libc_batch}, {"challoc", challoc_batch}, {"challoc_batch", challoc_batch_api}});
+
+	uint64_t libc_overhead[NB_OVERHEAD_SIZES];
+	uint64_t challoc_overhead[NB_OVERHEAD_SIZES];
+	bench_overhead(libc_overhead, malloc, free, "malloc");
+	bench_overhead(challoc_overhead, chamalloc, chafree, "chamalloc");
+	write_csv(argv[1], "metadata_overhead", NB_OVERHEAD_SIZES, 3,
+		  (CsvColumn[]){{"request", OVERHEAD_SIZES}, {"libc", libc_overhead}, {"challoc", challoc_overhead}});
+
+	uint64_t libc_huge[NB_HUGE_LIVE];
+	uint64_t challoc_huge[NB_HUGE_LIVE];
+	bench_huge_live(libc_huge, malloc, free, "malloc");
+	bench_huge_live(challoc_huge, chamalloc, chafree, "chamalloc");
+	write_csv(argv[1], "huge_buffers_live", NB_HUGE_LIVE, 3, (CsvColumn[]){{"live", HUGE_LIVE}, {"libc", libc_huge}, {"challoc", challoc_huge}});
+
 	libc.fn_name	= "realloc";
 	challoc.fn_name = "charealloc";
 	bench_realloc(&libc, malloc, realloc, free, "realloc");
 	bench_realloc(&challoc, chamalloc, charealloc, chafree, "charealloc");
 	write_results(libc, challoc, argv[1]);
 
+	uint64_t libc_growth[NB_GROWTH_STEPS];
+	uint64_t challoc_growth[NB_GROWTH_STEPS];
+	double libc_copied[NB_GROWTH_STEPS];
+	double challoc_copied[NB_GROWTH_STEPS];
+	bench_realloc_growth(libc_growth, libc_copied, malloc, realloc, free, "realloc");
+	bench_realloc_growth(challoc_growth, challoc_copied, chamalloc, charealloc, chafree, "charealloc");
+	write_csv(argv[1], "realloc_growth", NB_GROWTH_STEPS, 5,
+		  (CsvColumn[]){{"step", GROWTH_STEPS},
+				{"libc", libc_growth},
+				{"challoc", challoc_growth},
+				{"libc_copied", NULL, libc_copied},
+				{"challoc_copied", NULL, challoc_copied}});
+
 	libc.fn_name	= "calloc";
 	challoc.fn_name = "chacalloc";
 	bench_calloc(&libc, calloc, free, "calloc");
 	bench_calloc(&challoc, chacalloc, chafree, "chacalloc");
 	write_results(libc, challoc, argv[1]);
 
+	uint64_t threads[MAX_THREADS_LOG2 + 1];
+	uint64_t libc_threads[MAX_THREADS_LOG2 + 1];
+	uint64_t challoc_threads[MAX_THREADS_LOG2 + 1];
+	double challoc_hit_rate[MAX_THREADS_LOG2 + 1];
+	bench_malloc_threads(libc_threads, NULL, malloc, free, "malloc");
+	bench_malloc_threads(challoc_threads, challoc_hit_rate, chamalloc, chafree, "chamalloc");
+	powers_of_two(threads, 1, MAX_THREADS_LOG2 + 1);
+	write_csv(argv[1], "malloc_threads", MAX_THREADS_LOG2 + 1, 4,
+		  (CsvColumn[]){{"threads", threads}, {"libc", libc_threads}, {"challoc", challoc_threads}, {"challoc_hit_rate", NULL, challoc_hit_rate}});
+
+	// Give each thread its own arena, like on a machine with enough cores, so that every free is a cross-arena one
+	uint64_t libc_pairs[MAX_PAIRS_LOG2 + 1];
+	uint64_t challoc_mutex_pairs[MAX_PAIRS_LOG2 + 1];
+	uint64_t challoc_remote_pairs[MAX_PAIRS_LOG2 + 1];
+	chamallopt(CHALLOC_OPT_ARENAS, 2 << MAX_PAIRS_LOG2);
+	bench_producer_consumer(libc_pairs, malloc, free, "malloc");
+	chamallopt(CHALLOC_OPT_REMOTE_FREE, 0);
+	bench_producer_consumer(challoc_mutex_pairs, chamalloc, chafree, "chamalloc (mutex)");
+	chamallopt(CHALLOC_OPT_REMOTE_FREE, 1);
+	bench_producer_consumer(challoc_remote_pairs, chamalloc, chafree, "chamalloc (remote free)");
+	uint64_t pairs[MAX_PAIRS_LOG2 + 1];
+	powers_of_two(pairs, 1, MAX_PAIRS_LOG2 + 1);
+	write_csv(argv[1], "producer_consumer", MAX_PAIRS_LOG2 + 1, 4,
+		  (CsvColumn[]){{"pairs", pairs}, {"libc", libc_pairs}, {"challoc_mutex", challoc_mutex_pairs}, {"challoc_remote", challoc_remote_pairs}});
+
+	// Every thread shares a single arena and the thread cache is bypassed, so each call goes through the same lock
+	uint64_t libc_contention[MAX_CONTENDERS_LOG2 + 1];
+	uint64_t challoc_contention[MAX_CONTENDERS_LOG2 + 1];
+	double challoc_spins[MAX_CONTENDERS_LOG2 + 1];
+	uint64_t challoc_futex_waits[MAX_CONTENDERS_LOG2 + 1];
+	chamallopt(CHALLOC_OPT_ARENAS, 1);
+	chamallopt(CHALLOC_OPT_TCACHE, 0);
+	bench_lock_contention(libc_contention, NULL, NULL, malloc, free, "malloc");
+	bench_lock_contention(challoc_contention, challoc_spins, challoc_futex_waits, chamalloc, chafree, "chamalloc");
+	uint64_t contenders[MAX_CONTENDERS_LOG2 + 1];
+	powers_of_two(contenders, 1, MAX_CONTENDERS_LOG2 + 1);
+	write_csv(argv[1], "lock_contention", MAX_CONTENDERS_LOG2 + 1, 5,
+		  (CsvColumn[]){{"threads", contenders},
+				{"libc", libc_contention},
+				{"challoc", challoc_contention},
+				{"challoc_spins", NULL, challoc_spins},
+				{"challoc_futex_waits", challoc_futex_waits}});
+
 	return 0;
 }
 
@@ -3,59 +3,355 @@
  * @brief Implementation of the challoc library
  */
 
+#ifndef _GNU_SOURCE
+#	define _GNU_SOURCE // For sched_getcpu
+#endif
 #include "challoc.h"
 #include "sys/types.h"
 #include <assert.h>
+#include <errno.h>
 #include <execinfo.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+// Restartable sequences are used to update the per-CPU minislabs when glibc registered them for each thread
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#	define CHALLOC_RSEQ
+#	include <sys/rseq.h>
+#endif
+
+// glibc tells whether the process ever created a thread, locks are skipped until it did
+#if __has_include(<sys/single_threaded.h>)
+#	define CHALLOC_SINGLE_THREADED
+#	include <sys/single_threaded.h>
+#endif
+
 /// ------------------------------------------------
 /// Multithreading
 /// ------------------------------------------------
 
 /** \addtogroup Challoc_multithreading Multithreading support
  *  @{
+ *
+ * Each subsystem has its own lock, so that small and big allocations don't wait for each other:
+ * - challoc_leakcheck_lock protects the leak tracker
+ * - challoc_arena_bind_lock protects the binding of threads to arenas
+ * - the lock of each arena protects its blocks in use and their free chunks
+ * - the freed blocks lock of each arena protects its retained freed blocks and the descriptors of its unmapped blocks
+ * - the lock of each slab size class protects its pages
+ * - challoc_slab_released_lock protects the slab pages given back to the OS, and is taken while holding the lock of a size class
+ * The minislabs don't need any, their usage bitmasks are updated with restartable sequences or atomic instructions.
+ *
+ * A path holding two of them must take them in the order above.
+ */
+
+/// Number of pause instructions a lock spins for at least before parking, unless the machine has a single CPU
+#define LOCK_MIN_SPINS 16
+/// Number of pause instructions a lock spins for at most before parking
+#define LOCK_MAX_SPINS 2048
+/// Maximum number of pause instructions between two attempts to take a lock
+#define LOCK_MAX_BACKOFF 64
+
+/**
+ * @brief Lock which spins briefly with an exponential backoff, then parks the thread on a futex.
+ * The spin limit adapts to how long the lock was needed to wait for the last time, so short critical sections never sleep.
+ * The counters are only written while holding the lock.
+ */
+typedef struct {
+	uint32_t state;	     ///< 0 if unlocked, 1 if locked, 2 if locked and some threads may be parked on the futex
+	uint32_t spin_limit; ///< Number of pause instructions to spin for before parking, adapted at each contended acquisition
+	size_t acquisitions; ///< Number of times the lock was taken
+	size_t contended;    ///< Number of times the lock was already taken when a thread wanted it
+	size_t spins;	     ///< Number of pause instructions executed while waiting for the lock
+	size_t futex_waits;  ///< Number of times a thread parked on the futex
+} ChallocLock;
+
+/// Spin limit cap, set to 0 when the library is loaded on a single CPU machine where spinning can't help
+uint32_t challoc_lock_max_spins = LOCK_MAX_SPINS;
+
+/**
+ * @brief Check if the process never created a second thread, in which case nothing can race with the current thread.
+ * glibc clears the flag in pthread_create before the new thread starts, and never sets it back, so a lock skipped while the
+ * process was single-threaded can't be held by the creating thread at that point.
+ * @return True if locks can be skipped
+ */
+bool process_is_single_threaded() {
+#ifdef CHALLOC_SINGLE_THREADED
+	return __libc_single_threaded;
+#else
+	return false;
+#endif
+}
+
+/**
+ * @brief Tell the CPU the thread is spinning
+ */
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+/**
+ * @brief Add to a counter of a lock, which must be held
+ * @param counter The counter
+ * @param value The value to add
  */
+void lock_count(size_t* counter, size_t value) {
+	// Only one thread writes at a time, but chastats reads them concurrently
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Take a lock, unless the process is single-threaded
+ * @param lock The lock
+ */
+void challoc_lock(ChallocLock* lock) {
+	if (process_is_single_threaded()) {
+		return;
+	}
+
+	uint32_t state = 0;
+	if (__atomic_compare_exchange_n(&lock->state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		lock_count(&lock->acquisitions, 1);
+		return;
+	}
+
+	// Spin with an exponential backoff, as long as the previous contended acquisitions needed
+	uint32_t limit = __atomic_load_n(&lock->spin_limit, __ATOMIC_RELAXED);
+	limit	       = limit < LOCK_MIN_SPINS ? LOCK_MIN_SPINS : limit;
+	limit	       = limit > challoc_lock_max_spins ? challoc_lock_max_spins : limit;
+	size_t spins   = 0;
+	size_t backoff = 1;
+	while (spins < limit) {
+		for (size_t i = 0; i < backoff; i++) {
+			cpu_relax();
+		}
+		spins += backoff;
+		backoff = backoff * 2 > LOCK_MAX_BACKOFF ? LOCK_MAX_BACKOFF : backoff * 2;
+
+		state = 0;
+		if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0 &&
+		    __atomic_compare_exchange_n(&lock->state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			// Spinning worked, allow a bit more than what was needed next time
+			__atomic_store_n(&lock->spin_limit, spins * 2 > LOCK_MAX_SPINS ? LOCK_MAX_SPINS : spins * 2, __ATOMIC_RELAXED);
+			lock_count(&lock->acquisitions, 1);
+			lock_count(&lock->contended, 1);
+			lock_count(&lock->spins, spins);
+			return;
+		}
+	}
+
+	// Park until the holder wakes us up, marking the lock as having waiters
+	size_t futex_waits = 0;
+	while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0) {
+		syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+		futex_waits++;
+	}
 
-/// Mutex to protect the minislab allocator
-static pthread_mutex_t challoc_mutex;
+	// The lock is held for too long to be worth spinning that much
+	__atomic_store_n(&lock->spin_limit, limit / 2, __ATOMIC_RELAXED);
+	lock_count(&lock->acquisitions, 1);
+	lock_count(&lock->contended, 1);
+	lock_count(&lock->spins, spins);
+	lock_count(&lock->futex_waits, futex_waits);
+}
+
+/**
+ * @brief Release a lock, waking up a parked thread if there may be one
+ * @param lock The lock
+ */
+void challoc_unlock(ChallocLock* lock) {
+	// Only the holder can set the state back to 0, so it is still 0 if the lock was skipped
+	if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2) {
+		syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
 
-/// Execute code while holding the challoc mutex
-#define CHALLOC_MUTEX(code)                                                                                                                \
-	pthread_mutex_lock(&challoc_mutex);                                                                                                \
+/// Execute code while holding a lock
+#define CHALLOC_MUTEX(lock, code)                                                                                                          \
+	challoc_lock(lock);                                                                                                                \
 	code;                                                                                                                              \
-	pthread_mutex_unlock(&challoc_mutex);
+	challoc_unlock(lock);
 /** @} */
 
 /// ------------------------------------------------
-/// Slab allocator
+/// Options and statistics
 /// ------------------------------------------------
 
-/** \defgroup Challoc_minislab Minislab Allocator
+/** \defgroup Challoc_options Options and statistics
  *  @{
  */
 
 /**
- * @brief Compact representation of the usage of the 512, 256 and 128 bytes slabs
+ * @brief Tunable parameters of challoc, read from the environment when the library is loaded and changeable with chamallopt
  */
 typedef struct {
-	uint8_t slab512_usage : 1;
-	uint8_t slab256_usage : 2;
-	uint8_t slab128_usage : 4;
-} Slab512x256x128Usage;
+	bool tcache;		///< Serve small allocations from per-thread caches (CHALLOC_TCACHE)
+	size_t nb_arenas;	///< Number of arenas new threads are spread over (CHALLOC_ARENAS), the number of CPUs by default
+	bool remote_free;	///< Push frees of blocks owned by another arena to its remote-free queue (CHALLOC_REMOTE_FREE)
+	bool rseq;		///< Update the per-CPU minislabs with restartable sequences if possible (CHALLOC_RSEQ), only read at load time
+	bool numa;		///< Bind threads to arenas of their NUMA node and place the blocks of arenas on it (CHALLOC_NUMA)
+	long numa_node;		///< NUMA node every thread is considered to run on (CHALLOC_NUMA_NODE), -1 to ask the kernel
+	size_t numa_interleave; ///< Size from which blocks are interleaved over all the NUMA nodes (CHALLOC_NUMA_INTERLEAVE), 0 to never
+	size_t slab_reserve;	///< Number of empty pages each slab size class keeps in memory (CHALLOC_SLAB_RESERVE)
+	size_t slab_idle_ms;	///< Milliseconds an empty slab page waits before being given back to the OS (CHALLOC_SLAB_IDLE_MS)
+	size_t huge_threshold;	///< Size from which allocations get a mapping of their own (CHALLOC_HUGE_THRESHOLD), 0 to never
+} ChallocOptions;
+
+/// Current options of challoc, nb_arenas is only set to the number of CPUs when the library is loaded
+ChallocOptions challoc_options = {
+    .tcache	     = true,
+    .nb_arenas	     = 1,
+    .remote_free     = true,
+    .rseq	     = true,
+    .numa	     = true,
+    .numa_node	     = -1,
+    .numa_interleave = 0,
+    .slab_reserve    = 4,
+    .slab_idle_ms    = 0,
+    .huge_threshold  = 16 << 20,
+};
+
+/// Statistics of challoc, only updated with atomic additions
+ChallocStats challoc_stats = {0};
+
+/**
+ * @brief Read an integer option from the environment. Doesn't allocate, so it is safe to call before the allocator is ready.
+ * @param name The name of the environment variable
+ * @param default_value The value to use if the variable is not set or is not a number
+ * @return The value of the option
+ */
+long option_from_env(const char* name, long default_value) {
+	const char* value = getenv(name);
+	if (value == NULL || *value == '\0') {
+		return default_value;
+	}
+	char* end;
+	long parsed = strtol(value, &end, 10);
+	if (*end != '\0') {
+		return default_value;
+	}
+	return parsed;
+}
+/** @} */
+
+/// ------------------------------------------------
+/// NUMA placement
+/// ------------------------------------------------
+
+/** \defgroup Challoc_numa NUMA placement
+ *  @{
+ */
+
+/// Maximum number of NUMA nodes challoc knows about, nodes above it are ignored
+#define MAX_NUMA_NODES 64
+
+/// NUMA nodes the process may allocate memory on, only node 0 until the library is loaded or if the kernel doesn't tell
+uint32_t challoc_numa_node_ids[MAX_NUMA_NODES] = {0};
+
+/// Number of NUMA nodes in challoc_numa_node_ids
+size_t challoc_numa_nb_nodes = 1;
+
+/**
+ * @brief Find the NUMA nodes the process may allocate memory on, with a raw get_mempolicy so that libnuma isn't needed
+ */
+void numa_init() {
+	unsigned long allowed = 0;
+	if (syscall(SYS_get_mempolicy, NULL, &allowed, MAX_NUMA_NODES + 1, NULL, MPOL_F_MEMS_ALLOWED) != 0 || allowed == 0) {
+		return; // Keep a single node
+	}
+	size_t nb_nodes = 0;
+	for (uint32_t node = 0; node < MAX_NUMA_NODES; node++) {
+		if (allowed & (1UL << node)) {
+			challoc_numa_node_ids[nb_nodes++] = node;
+		}
+	}
+	challoc_numa_nb_nodes = nb_nodes;
+}
+
+/**
+ * @brief Check if memory has to be placed on NUMA nodes
+ * @return True if the machine has several nodes, or if a node is forced
+ */
+bool numa_enabled() {
+	return challoc_options.numa && (challoc_numa_nb_nodes > 1 || challoc_options.numa_node >= 0);
+}
+
+/**
+ * @brief Get the NUMA node of the current thread
+ * @return The node forced with CHALLOC_NUMA_NODE, or the node of the CPU the thread runs on
+ */
+uint32_t numa_current_node() {
+	if (challoc_options.numa_node >= 0) {
+		return challoc_options.numa_node;
+	}
+	unsigned int cpu, node;
+	if (getcpu(&cpu, &node) != 0) {
+		return challoc_numa_node_ids[0];
+	}
+	return node;
+}
+
+/**
+ * @brief Set the NUMA policy of fresh memory before it is first touched, with a raw mbind.
+ * Fails silently, for example if the node doesn't exist, in which case the kernel places the memory as usual.
+ * @param ptr The start of the memory, aligned on a page
+ * @param size The size of the memory
+ * @param node The node to prefer, unless the memory is big enough to be interleaved over all the nodes
+ */
+void numa_place(void* ptr, size_t size, uint32_t node) {
+	if (!numa_enabled()) {
+		return;
+	}
+	if (challoc_options.numa_interleave > 0 && size >= challoc_options.numa_interleave && challoc_numa_nb_nodes > 1) {
+		unsigned long nodes = 0;
+		for (size_t i = 0; i < challoc_numa_nb_nodes; i++) {
+			nodes |= 1UL << challoc_numa_node_ids[i];
+		}
+		syscall(SYS_mbind, ptr, size, MPOL_INTERLEAVE, &nodes, MAX_NUMA_NODES + 1, 0);
+		return;
+	}
+	if (node < MAX_NUMA_NODES) {
+		unsigned long nodes = 1UL << node;
+		syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &nodes, MAX_NUMA_NODES + 1, 0);
+	}
+}
+/** @} */
+
+/// ------------------------------------------------
+/// Slab allocator
+/// ------------------------------------------------
+
+/** \defgroup Challoc_minislab Minislab Allocator
+ *  @{
+ */
+
+/// Number of layers of a minislab, from the 512 bytes chunks (layer 0) down to the 4 bytes chunks (layer 7)
+#define MINISLAB_NB_LAYERS 8
 
 /**
  * @brief Minislab to allocate small memory regions
- * It contains 512, 256, 128, 64, 32, 16, 8 and 4 bytes layers and keeps track of the usage of each layer using bitmasks
+ * It contains 512, 256, 128, 64, 32, 16, 8 and 4 bytes layers and keeps track of the usage of each layer using bitmasks.
+ * Each CPU has its own minislab, whose usage bitmasks are only modified by the threads running on that CPU.
  */
-__attribute__((aligned(4096))) typedef struct {
+typedef struct __attribute__((aligned(4096))) {
 	/// Chunks of memory
 	uint8_t slab512[1][512];   ///< 1 chunk of 512 bytes
 	uint8_t slab256[2][256];   ///< 2 chunks of 256 bytes
@@ -66,29 +362,32 @@ __attribute__((aligned(4096))) typedef struct {
 	uint8_t slab8[64][8];	   ///< 64 chunks of 8 bytes
 	uint8_t slab_small[64][4]; ///< 64 chunks of 4 bytes
 
-	/// Bitmasks to keep track of the usage of each layer
-	uint64_t slab_small_usage;		    ///< Usage bitmask of 4 bytes chunks
-	uint64_t slab8_usage;			    ///< Usage bitmask of 8 bytes chunks
-	uint32_t slab16_usage;			    ///< Usage bitmask of 16 bytes chunks
-	uint16_t slab32_usage;			    ///< Usage bitmask of 32 bytes chunks
-	uint8_t slab64_usage;			    ///< Usage bitmask of 64 bytes chunks
-	Slab512x256x128Usage slab512x256x128_usage; ///< Usage bitmask of 512, 256 and 128 bytes chunks combined for compactness
+	/// Bitmasks to keep track of the usage of each layer, one word per layer so that they can be updated in a restartable sequence
+	uint64_t usage[MINISLAB_NB_LAYERS];	   ///< Usage bitmask of each layer, only modified from the CPU owning the minislab
+	uint64_t remote_frees[MINISLAB_NB_LAYERS]; ///< Chunks freed from other CPUs, which are still set in usage until the owner collects them
 } MiniSlab;
 
-/// Global minislab allocator
-MiniSlab challoc_minislab = {0};
+/// Minislabs of all the CPUs, contiguous so that a pointer can be checked with a single range, NULL until the library is loaded
+MiniSlab* challoc_minislabs = NULL;
+
+/// Number of minislabs, one per configured CPU
+size_t challoc_nb_minislabs = 0;
+
+/// True if the usage bitmasks are updated with restartable sequences, false if they are updated with atomic instructions
+bool challoc_minislab_rseq = false;
 
 /**
- * @brief Print the usage of the minislab allocator
- * @param slab The minislab allocator
+ * @brief Print the usage of a minislab
+ * @param slab The minislab, or NULL
  */
-void minislab_print_usage(MiniSlab slab) {
-	printf("slab_small_usage: %lx\n", slab.slab_small_usage);
-	printf("slab8_usage: %lx\n", slab.slab8_usage);
-	printf("slab16_usage: %x\n", slab.slab16_usage);
-	printf("slab32_usage: %x\n", slab.slab32_usage);
-	printf("slab64_usage: %x\n", slab.slab64_usage);
-	printf("slab512x256x128_usage: %x\n", (uint8_t)slab.slab512x256x128_usage.slab512_usage);
+void minislab_print_usage(MiniSlab* slab) {
+	if (slab == NULL) {
+		printf("no minislab\n");
+		return;
+	}
+	for (size_t layer = 0; layer < MINISLAB_NB_LAYERS; layer++) {
+		printf("slab%zu_usage: %lx (remote frees: %lx)\n", (size_t)512 >> layer, slab->usage[layer], slab->remote_frees[layer]);
+	}
 }
 
 /**
@@ -125,16 +424,11 @@ ClosePowerOfTwo is_close_to_power_of_two(size_t size) {
 	}
 
 	// Compute the smallest power of two that is greater than the size
-	size_t ceil_pow2 = 2 * 2;
-	size_t pow2	 = 2;
-	while (ceil_pow2 < size) {
-		ceil_pow2 *= 2;
-		pow2++;
-	}
+	size_t pow2	 = 64 - __builtin_clzll(size - 1);
+	size_t ceil_pow2 = (size_t)1 << pow2;
 
-	// If the size is close to the power of two, we accept it
-	const double threshold = 1.2;
-	if ((double)ceil_pow2 / (double)size <= threshold) {
+	// If the size is close to the power of two (ratio of 1.2 at most), we accept it
+	if (ceil_pow2 * 5 <= size * 6) {
 		return (ClosePowerOfTwo){
 		    .is_close  = true,
 		    .ceil_pow2 = pow2,
@@ -147,115 +441,254 @@ ClosePowerOfTwo is_close_to_power_of_two(size_t size) {
 
 /**
  * @brief Find the first bit set to 0 in a 64-bit value from left to right
- * @param value The value to check
+ * @param value The value to check, which must have at least one bit set to 0
  * @return The index of the first bit set to 0
  */
 size_t find_first_bit_at_0(uint64_t value) {
-	for (size_t i = 0; i < 64; i++) {
-		if ((value & (1ULL << i)) == 0) { // Found a bit set to 0
-			return i;
-		}
-	}
-	return 0;
+	assert(~value != 0);
+	return __builtin_ctzll(~value);
 }
 
 /// Helper macro to set all bits to 1 in a value
 #define ALL_ONES(type) (type) ~(type)0
 
 /**
- * @brief Allocate memory from the minislab allocator
- * @param size The size to allocate
- * @return A pointer to the allocated memory
+ * @brief Get the number of chunks of a layer
+ * @param layer The layer
+ * @return The number of chunks of the layer
  */
-void* minislab_alloc(ClosePowerOfTwo size) {
-	// If we are here, we have accepted to allocate in the minislab
-	// And therefore the size is between 4 and 512
-	assert(size.is_close);
-	assert(size.ceil_pow2 >= 2 && size.ceil_pow2 <= 9);
+size_t minislab_layer_nb_chunks(size_t layer) {
+	return layer < 6 ? (size_t)1 << layer : 64;
+}
 
-	switch (size.ceil_pow2) {
-		case 2: { // 4 bytes
-			if (challoc_minislab.slab_small_usage == ALL_ONES(uint64_t)) {
-				break;
-			}
-			size_t index = find_first_bit_at_0(challoc_minislab.slab_small_usage);
-			challoc_minislab.slab_small_usage |= (uint64_t)1ULL << index;
-			return challoc_minislab.slab_small[index];
-		}
-		case 3: { // 8 bytes
-			if (challoc_minislab.slab8_usage == ALL_ONES(uint64_t)) {
-				break;
-			}
-			size_t index = find_first_bit_at_0(challoc_minislab.slab8_usage);
-			challoc_minislab.slab8_usage |= 1ULL << index;
-			return challoc_minislab.slab8[index];
-		}
-		case 4: { // 16 bytes
-			if (challoc_minislab.slab16_usage == ALL_ONES(uint32_t)) {
-				break;
-			}
-			size_t index = find_first_bit_at_0(challoc_minislab.slab16_usage);
-			challoc_minislab.slab16_usage |= 1ULL << index;
-			return challoc_minislab.slab16[index];
+/**
+ * @brief Get the bitmask of a layer whose chunks are all used
+ * @param layer The layer
+ * @return The usage of the layer when it is full
+ */
+uint64_t minislab_layer_full_usage(size_t layer) {
+	size_t nb_chunks = minislab_layer_nb_chunks(layer);
+	return nb_chunks == 64 ? ALL_ONES(uint64_t) : (1ULL << nb_chunks) - 1;
+}
+
+#ifdef CHALLOC_RSEQ
+/**
+ * @brief Get the rseq area glibc registered for the current thread
+ * @return The rseq area of the thread
+ */
+struct rseq* rseq_area() {
+	return (struct rseq*)((uintptr_t)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// The abort handler below is preceded by this signature, which is the one glibc registers with
+_Static_assert(RSEQ_SIG == 0x53053053, "unexpected rseq signature");
+
+/**
+ * @brief Store a value in a word of the minislab of a CPU if it still holds the expected one, as a restartable sequence.
+ * The kernel aborts the sequence if the thread is preempted, migrated or signaled before the store,
+ * so no other thread can modify the word in between, without any lock or atomic instruction.
+ * @param word The word to update
+ * @param expected The value the word must still hold
+ * @param new_value The value to store
+ * @param cpu The CPU owning the word
+ * @return 0 if the value was stored, 1 if the word didn't hold the expected value, -1 if the sequence was aborted
+ */
+int rseq_compare_and_store(uint64_t* word, uint64_t expected, uint64_t new_value, uint32_t cpu) {
+	struct rseq* rseq = rseq_area();
+	__asm__ __volatile__ goto(
+	    // Descriptor of the critical section, from label 1 to label 2, aborting to label 4
+	    ".pushsection __rseq_cs, \"aw\"\n\t"
+	    ".balign 32\n\t"
+	    "3:\n\t"
+	    ".long 0x0, 0x0\n\t"
+	    ".quad 1f, (2f - 1f), 4f\n\t"
+	    ".popsection\n\t"
+	    "leaq 3b(%%rip), %%rax\n\t"
+	    "movq %%rax, %[rseq_cs]\n\t"
+	    "1:\n\t"
+	    "cmpl %[cpu], %[current_cpu]\n\t"
+	    "jnz 4f\n\t"
+	    "cmpq %[word], %[expected]\n\t"
+	    "jnz %l[mismatch]\n\t"
+	    "movq %[new_value], %[word]\n\t"
+	    "2:\n\t"
+	    ".pushsection __rseq_failure, \"ax\"\n\t"
+	    ".byte 0x0f, 0xb9, 0x3d\n\t"
+	    ".long 0x53053053\n\t"
+	    "4:\n\t"
+	    "jmp %l[aborted]\n\t"
+	    ".popsection\n\t"
+	    :
+	    : [cpu] "r"(cpu),
+	      [current_cpu] "m"(rseq->cpu_id),
+	      [rseq_cs] "m"(rseq->rseq_cs),
+	      [word] "m"(*word),
+	      [expected] "r"(expected),
+	      [new_value] "r"(new_value)
+	    : "memory", "cc", "rax"
+	    : mismatch, aborted);
+	return 0;
+mismatch:
+	return 1;
+aborted:
+	return -1;
+}
+#endif
+
+/**
+ * @brief Get the CPU the current thread is running on, from its rseq area if it has one or from sched_getcpu otherwise
+ * @return The CPU, which may be out of the range of the minislabs if it is unknown
+ */
+uint32_t minislab_current_cpu() {
+#ifdef CHALLOC_RSEQ
+	if (challoc_minislab_rseq) {
+		return __atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED);
+	}
+#endif
+	return (uint32_t)sched_getcpu();
+}
+
+/**
+ * @brief Get the minislab of the CPU the current thread is running on
+ * @return The minislab, or NULL if there is none for this CPU
+ */
+MiniSlab* minislab_of_current_cpu() {
+	uint32_t cpu = minislab_current_cpu();
+	if (challoc_minislabs == NULL || cpu >= challoc_nb_minislabs) {
+		return NULL;
+	}
+	return &challoc_minislabs[cpu];
+}
+
+/**
+ * @brief Create the minislabs of all the CPUs and choose how their bitmasks are updated
+ */
+void minislab_init() {
+	long nb_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (nb_cpus < 1) {
+		nb_cpus = 1;
+	}
+	MiniSlab* slabs = mmap(NULL, nb_cpus * sizeof(MiniSlab), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (slabs == MAP_FAILED) { // Small allocations will go to the blocks
+		perror("mmap");
+		return;
+	}
+#ifdef CHALLOC_RSEQ
+	challoc_minislab_rseq = challoc_options.rseq && __rseq_size > 0 && rseq_area()->cpu_id < (uint32_t)nb_cpus;
+#endif
+	challoc_nb_minislabs = nb_cpus;
+	challoc_minislabs    = slabs;
+}
+
+/**
+ * @brief Clear the chunks freed from other CPUs from the usage of a layer
+ * @param slab The minislab, which must be the one of the current CPU
+ * @param layer The layer
+ * @return True if some chunks were collected, or if the thread migrated and should look at its new CPU
+ */
+bool minislab_collect_remote_frees(MiniSlab* slab, size_t layer) {
+	uint64_t freed = __atomic_exchange_n(&slab->remote_frees[layer], 0, __ATOMIC_ACQUIRE);
+	if (freed == 0) {
+		return false;
+	}
+	if (!challoc_minislab_rseq) {
+		__atomic_fetch_and(&slab->usage[layer], ~freed, __ATOMIC_RELEASE);
+		return true;
+	}
+
+#ifdef CHALLOC_RSEQ
+	uint32_t cpu = slab - challoc_minislabs;
+	while (minislab_current_cpu() == cpu) {
+		uint64_t usage = slab->usage[layer];
+		if (rseq_compare_and_store(&slab->usage[layer], usage, usage & ~freed, cpu) == 0) {
+			return true;
 		}
-		case 5: { // 32 bytes
-			if (challoc_minislab.slab32_usage == ALL_ONES(uint16_t)) {
-				break;
+	}
+#endif
+
+	// Migrated, leave them to the threads of the owning CPU
+	__atomic_fetch_or(&slab->remote_frees[layer], freed, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ * @brief Claim a free chunk in a layer of a minislab
+ * @param slab The minislab, which must be the one of the current CPU if restartable sequences are used
+ * @param layer The layer
+ * @return A pointer to the chunk, NULL if the layer is full or if the thread migrated
+ */
+void* minislab_claim_chunk(MiniSlab* slab, size_t layer) {
+	while (true) {
+		uint64_t usage = __atomic_load_n(&slab->usage[layer], __ATOMIC_RELAXED);
+		if (usage == minislab_layer_full_usage(layer)) {
+			if (!minislab_collect_remote_frees(slab, layer)) {
+				return NULL;
 			}
-			size_t index = find_first_bit_at_0(challoc_minislab.slab32_usage);
-			challoc_minislab.slab32_usage |= 1ULL << index;
-			return challoc_minislab.slab32[index];
+			continue;
 		}
-		case 6: { // 64 bytes
-			if (challoc_minislab.slab64_usage == ALL_ONES(uint8_t)) {
-				break;
+
+		size_t index	 = find_first_bit_at_0(usage);
+		uint8_t* chunk	 = (uint8_t*)slab + 512 * layer + index * (512 >> layer);
+		uint64_t claimed = usage | (1ULL << index);
+		if (!challoc_minislab_rseq) {
+			// Another thread may have claimed or freed a chunk of the layer in the meantime
+			if (__atomic_compare_exchange_n(&slab->usage[layer], &usage, claimed, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				return chunk;
 			}
-			size_t index = find_first_bit_at_0(challoc_minislab.slab64_usage);
-			challoc_minislab.slab64_usage |= 1ULL << index;
-			return challoc_minislab.slab64[index];
+			continue;
 		}
-		case 7: { // 128 bytes
-			if (challoc_minislab.slab512x256x128_usage.slab128_usage == 0b1111) {
-				break;
-			}
-			size_t index = find_first_bit_at_0(challoc_minislab.slab512x256x128_usage.slab128_usage);
-			challoc_minislab.slab512x256x128_usage.slab128_usage |= 1ULL << index;
-			return challoc_minislab.slab128[index];
+#ifdef CHALLOC_RSEQ
+		uint32_t cpu = slab - challoc_minislabs;
+		if (rseq_compare_and_store(&slab->usage[layer], usage, claimed, cpu) == 0) {
+			return chunk;
 		}
-		case 8: { // 256 bytes
-			if (challoc_minislab.slab512x256x128_usage.slab256_usage == 0b11) {
-				break;
-			}
-			size_t index = find_first_bit_at_0(challoc_minislab.slab512x256x128_usage.slab256_usage);
-			challoc_minislab.slab512x256x128_usage.slab256_usage |= 1ULL << index;
-			return challoc_minislab.slab256[index];
+		// Preempted or raced with another thread of the same CPU, try again unless the thread migrated
+		if (minislab_current_cpu() != cpu) {
+			return NULL;
 		}
-		case 9: { // 512 bytes
-			if (challoc_minislab.slab512x256x128_usage.slab512_usage == 0b1) {
-				break;
-			}
-			size_t index = find_first_bit_at_0(challoc_minislab.slab512x256x128_usage.slab512_usage);
-			challoc_minislab.slab512x256x128_usage.slab512_usage |= 1ULL << index;
-			return challoc_minislab.slab512[index];
+#endif
+	}
+}
+
+/**
+ * @brief Allocate memory from the minislab of the current CPU
+ * @param size The size to allocate
+ * @return A pointer to the allocated memory
+ */
+void* minislab_alloc(ClosePowerOfTwo size) {
+	// If we are here, we have accepted to allocate in the minislab
+	// And therefore the size is between 4 and 512
+	assert(size.is_close);
+	assert(size.ceil_pow2 >= 2 && size.ceil_pow2 <= 9);
+	size_t layer = 9 - size.ceil_pow2;
+
+	if (!challoc_minislab_rseq) {
+		MiniSlab* slab = minislab_of_current_cpu();
+		return slab != NULL ? minislab_claim_chunk(slab, layer) : NULL;
+	}
+
+	// Retry on the new CPU if the thread migrated in the middle of the claim
+	while (true) {
+		MiniSlab* slab = minislab_of_current_cpu();
+		if (slab == NULL) {
+			return NULL;
 		}
-		default: { // Should not reach here
-			assert(false);
+		void* ptr = minislab_claim_chunk(slab, layer);
+		if (ptr != NULL || minislab_of_current_cpu() == slab) {
+			return ptr;
 		}
 	}
-
-	// The minislab is full, we cannot allocate from it
-	return NULL;
 }
 
 /**
  * @brief Check if a pointer comes from the minislab allocator
  * @param ptr The pointer to check
- * @return True if the pointer comes from the minislab allocator, false otherwise
+ * @return True if the pointer comes from the minislab of any CPU, false otherwise
  */
 bool ptr_comes_from_minislab(void* ptr) {
-	// Check if the pointer is in the minislab memory region
-	size_t minislab_begin = (size_t)&challoc_minislab;
-	size_t minislab_end   = minislab_begin + sizeof(MiniSlab);
+	// Check if the pointer is in the memory region of the minislabs
+	size_t minislab_begin = (size_t)challoc_minislabs;
+	size_t minislab_end   = minislab_begin + challoc_nb_minislabs * sizeof(MiniSlab);
 	size_t ptr_addr	      = (size_t)ptr;
 	return ptr_addr >= minislab_begin && ptr_addr < minislab_end;
 }
@@ -267,23 +700,24 @@ bool ptr_comes_from_minislab(void* ptr) {
  */
 size_t minislab_ptr_size(void* ptr) {
 	assert(ptr_comes_from_minislab(ptr));
-	ssize_t offset = (ssize_t)ptr - (ssize_t)&challoc_minislab;
+	size_t offset = ((size_t)ptr - (size_t)challoc_minislabs) % sizeof(MiniSlab);
 	assert(offset < 4096);
 
-	static const int sizes[]	 = {512, 256, 128, 64, 32, 16, 8, 4};		    // Sizes of the layers
-	static const int layer_offsets[] = {512, 1024, 1536, 2048, 2560, 3072, 3584, 4096}; // Offsets of the layers
-
-	// Find the layer of the pointer
-	if (offset >= 0 && offset < layer_offsets[0]) {
-		return 512;
-	}
-	for (int i = 1; i < 8; i++) {
-		if (offset >= layer_offsets[i - 1] && offset < layer_offsets[i]) {
-			return sizes[i];
-		}
-	}
+	// Each layer takes 512 bytes, and the chunks of layer n are 512 >> n bytes long
+	return (size_t)512 >> (offset / 512);
+}
 
-	return SIZE_MAX; // Should not reach here
+/**
+ * @brief Give a chunk back to the minislab of another CPU, which clears it from its usage when its layer gets full
+ * @param ptr The pointer to free, from the minislab of any CPU
+ */
+void minislab_remote_free(void* ptr) {
+	assert(ptr_comes_from_minislab(ptr));
+	MiniSlab* slab = &challoc_minislabs[((size_t)ptr - (size_t)challoc_minislabs) / sizeof(MiniSlab)];
+	size_t offset  = (uint8_t*)ptr - (uint8_t*)slab;
+	size_t layer   = offset / 512;
+	size_t index   = (offset - 512 * layer) / (512 >> layer);
+	__atomic_fetch_or(&slab->remote_frees[layer], 1ULL << index, __ATOMIC_RELEASE);
 }
 
 /**
@@ -292,118 +726,748 @@ size_t minislab_ptr_size(void* ptr) {
  */
 void minislab_free(void* ptr) {
 	assert(ptr_comes_from_minislab(ptr));
-	ssize_t offset = (ssize_t)ptr - (ssize_t)&challoc_minislab;
-	assert(offset < 4096);
+	MiniSlab* slab = &challoc_minislabs[((size_t)ptr - (size_t)challoc_minislabs) / sizeof(MiniSlab)];
+	size_t offset  = (uint8_t*)ptr - (uint8_t*)slab;
 
-	// Set the appropriate bitmask to 0 to signify it can be used again
+	// Set the appropriate bit to 0 to signify it can be used again
+	// Each layer takes 512 bytes, and the chunks of layer n are 512 >> n bytes long
 	size_t layer = offset / 512;
-	switch (layer) {
-		case 0:
-			challoc_minislab.slab512x256x128_usage.slab512_usage &= ~((1U << offset) - (512 * 0));
-			break;
-		case 1:
-			challoc_minislab.slab512x256x128_usage.slab256_usage &= ~((1U << offset) - (512 * 1));
-			break;
-		case 2:
-			challoc_minislab.slab512x256x128_usage.slab128_usage &= ~((1U << offset) - (512 * 2));
-			break;
-		case 3:
-			challoc_minislab.slab64_usage &= ~((1U << offset) - (512 * 3));
-			break;
-		case 4:
-			challoc_minislab.slab32_usage &= ~((1U << offset) - (512 * 4));
-			break;
-		case 5:
-			challoc_minislab.slab16_usage &= ~((1U << offset) - (512 * 5));
-			break;
-		case 6:
-			challoc_minislab.slab8_usage &= ~((1U << offset) - (512 * 6));
-			break;
-		case 7:
-			challoc_minislab.slab_small_usage &= ~((1U << offset) - (512 * 7));
-			break;
-		default:
-			assert(false); // Should not reach here
+	size_t index = (offset - 512 * layer) / (512 >> layer);
+	if (!challoc_minislab_rseq) {
+		__atomic_fetch_and(&slab->usage[layer], ~(1ULL << index), __ATOMIC_RELEASE);
+		return;
+	}
+
+#ifdef CHALLOC_RSEQ
+	uint32_t cpu = slab - challoc_minislabs;
+	while (minislab_current_cpu() == cpu) {
+		uint64_t usage = slab->usage[layer];
+		if (rseq_compare_and_store(&slab->usage[layer], usage, usage & ~(1ULL << index), cpu) == 0) {
+			return;
+		}
 	}
+#endif
+	minislab_remote_free(ptr);
 }
 /** @} */
 
 /// ------------------------------------------------
-/// Fragmented Block Allocator
+/// Slab Allocator
 /// ------------------------------------------------
 
-/** \defgroup Challoc_block Fragmented Block Allocator
+/** \defgroup Challoc_slab Slab Allocator
  *  @{
  */
 
-/**
- * @brief Double linked list metadata for the fragmented block allocator
- */
-typedef struct AllocMetadata AllocMetadata;
-struct AllocMetadata {
-	size_t size;	     ///< Size of the allocated memory
-	AllocMetadata* next; ///< Next block in the linked list
-	AllocMetadata* prev; ///< Previous block in the linked list
-	size_t block_idx;    ///< In which block the memory is allocated
+/// Size of a cache line, the step by which the first slab chunk of a page and big allocations are shifted so that they don't alias
+#define CACHE_LINE_SIZE 64
+/// Size of a slab page, which is also its alignment so that the header of the page of a pointer is found by masking it
+#define SLAB_PAGE_SIZE 16384
+/// Biggest size served by the slab pages
+#define SLAB_MAX_SIZE 512
+/// Number of size classes of the slab pages
+#define SLAB_NB_CLASSES 18
+/// Maximum number of chunks in a slab page, for the 8 bytes class, if the page had no header
+#define SLAB_MAX_CHUNKS (SLAB_PAGE_SIZE / 8)
+/// Number of words of the summary of the usage bitmask of a slab page, which has one bit per word of the usage
+#define SLAB_SUMMARY_WORDS ((SLAB_MAX_CHUNKS / 64 + 63) / 64)
+/// Size of the virtual memory reserved for the slab pages, which are only backed by physical memory once used
+#define SLAB_REGION_SIZE ((size_t)4 << 30)
+
+/// Size of the chunks of each class, at most 25% apart from 64 bytes on so that internal fragmentation stays bounded
+const uint16_t SLAB_CLASS_SIZES[SLAB_NB_CLASSES] = {8, 16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512};
+
+/// Size class of each size rounded up to a multiple of 8, so that finding the class of a size is a single load
+const uint8_t SLAB_CLASS_OF_SIZE8[SLAB_MAX_SIZE / 8 + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 13,
+    14, 14, 14, 14, 14, 14, 14, 14, 15, 15, 15, 15, 15, 15, 15, 15, 16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17,
 };
 
 /**
- * @brief Print the metadata of an allocation
- * @param metadata The metadata to print
+ * @brief Header at the start of each slab page, so that no metadata is stored next to the chunks.
+ * A page belongs to its size class rather than to a thread: every thread allocates from and frees to it under the lock of the class,
+ * so there is no owner to route a free to, and the thread caches in front of the pages take that lock once per batch.
  */
-void allocmetadata_print(AllocMetadata* metadata) {
-	char prev[200];
-	char next[200];
-	if (metadata->prev == NULL) {
-		sprintf(prev, "NULL");
-	}
-	else {
-		sprintf(prev, "[%p | %zu]", metadata->prev, metadata->prev->size);
-	}
-	if (metadata->next == NULL) {
-		sprintf(next, "NULL");
-	}
-	else {
-		sprintf(next, "[%p | %zu]", metadata->next, metadata->next->size);
-	}
-
-	printf("[Block %zu] 	%s <-> [%p | %zu] <-> %s\n", metadata->block_idx, prev, metadata, metadata->size, next);
-}
+typedef struct SlabPage {
+	uint8_t class_idx;			 ///< Size class owning the page
+	uint16_t nb_used;			 ///< Number of chunks in use
+	uint16_t color;				 ///< Offset of the first chunk after the header, which differs between the pages of a class
+	uint64_t empty_since;			 ///< When the page became empty, in milliseconds, to know how long it has been idle
+	struct SlabPage* prev;			 ///< Previous page in the list of the page
+	struct SlabPage* next;			 ///< Next page in the list of the page
+	uint64_t full_words[SLAB_SUMMARY_WORDS]; ///< Summary of the usage, with a bit set for each word of usage whose chunks are all in use
+	uint64_t usage[SLAB_MAX_CHUNKS / 64];	 ///< Usage bitmask of the chunks, only the first nb_chunks bits are used
+} SlabPage;
+
+/// Size of the header of a slab page, rounded up to a cache line so that the chunks are aligned
+#define SLAB_HEADER_SIZE ((sizeof(SlabPage) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1))
 
 /**
- * @brief Get the metadata of an allocation from the pointer
- * @param ptr The pointer to the allocated memory
- * @return The metadata of the allocation
+ * @brief Slab pages of a size class, sorted by how full they are
  */
-AllocMetadata* challoc_get_metadata(void* ptr) {
-	return (AllocMetadata*)(ptr - sizeof(AllocMetadata));
-}
+typedef struct {
+	ChallocLock lock;  ///< Protects the lists and the pages in them
+	SlabPage* partial; ///< Pages with some chunks in use, allocations are taken from there first
+	SlabPage* full;	   ///< Pages without any free chunk
+	SlabPage* empty;   ///< Pages without any chunk in use, still in memory, the most recently emptied first
+	size_t nb_empty;   ///< Number of pages in the empty list
+	size_t nb_pages;   ///< Number of pages owned by the class
+	size_t next_color; ///< Color of the next page the class gets, in cache lines
+} SlabClass;
 
-void* last_block_alloc		       = NULL; ///< Last allocation made in a block
-AllocMetadata* prev_of_last_block_free = NULL; ///< Previous of last free made in a block
+/// Region the slab pages are carved from, contiguous so that a pointer can be checked with a single range and aligned on SLAB_PAGE_SIZE,
+/// NULL if it couldn't be reserved
+uint8_t* challoc_slab_region = NULL;
 
-/**
- * @brief Structure to represent a block of memory allocated with mmap
- */
-typedef struct {
-	size_t size;		///< Size of the mmap block
+/// Number of pages of the region already given to a size class
+size_t challoc_slab_next_page = 0;
+
+/// Size classes of the slab allocator
+SlabClass challoc_slab_classes[SLAB_NB_CLASSES] = {0};
+
+/// Indices of the slab pages given back to the OS, which any size class reuses before carving new pages from the region
+uint32_t* challoc_slab_released = NULL;
+
+/// Number of pages in challoc_slab_released
+size_t challoc_slab_nb_released = 0;
+
+/// Lock of the released slab pages
+ChallocLock challoc_slab_released_lock = {0};
+
+/**
+ * @brief Find the first word of a bitmap which has a bit set to 0
+ * @param words The words of the bitmap
+ * @param nb_words The number of words
+ * @return The index of the first word which isn't full, or nb_words if they all are
+ */
+size_t bitmap_first_non_full_word(const uint64_t* words, size_t nb_words) {
+	for (size_t i = 0; i < nb_words; i++) {
+		if (words[i] != ALL_ONES(uint64_t)) {
+			return i;
+		}
+	}
+	return nb_words;
+}
+
+/**
+ * @brief Find the first bit set to 0 of a bitmap with a summary, which has a bit set for each full word of the bitmap
+ * @param summary The summary, which must have a bit set to 0 for a word which isn't full
+ * @param nb_summary_words The number of words of the summary
+ * @param words The words of the bitmap
+ * @return The index of the first bit set to 0 of the bitmap
+ */
+size_t bitmap_first_bit_at_0(const uint64_t* summary, size_t nb_summary_words, const uint64_t* words) {
+	size_t summary_word = bitmap_first_non_full_word(summary, nb_summary_words);
+	assert(summary_word < nb_summary_words);
+	size_t word = summary_word * 64 + find_first_bit_at_0(summary[summary_word]);
+	return word * 64 + find_first_bit_at_0(words[word]);
+}
+
+/**
+ * @brief Reserve the region of the slab pages, without backing it with physical memory yet
+ */
+void slab_init() {
+	// mmap only guarantees the alignment of a system page, so reserve one more slab page and trim the ends
+	size_t reserved	   = SLAB_REGION_SIZE + SLAB_PAGE_SIZE;
+	size_t nb_pages	   = SLAB_REGION_SIZE / SLAB_PAGE_SIZE;
+	uint8_t* region	   = mmap(NULL, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	uint32_t* released = mmap(NULL, nb_pages * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (region == MAP_FAILED || released == MAP_FAILED) { // Small allocations will go to the blocks
+		if (region != MAP_FAILED) {
+			munmap(region, reserved);
+		}
+		if (released != MAP_FAILED) {
+			munmap(released, nb_pages * sizeof(uint32_t));
+		}
+		return;
+	}
+	challoc_slab_released = released;
+	uint8_t* aligned      = (uint8_t*)(((uintptr_t)region + SLAB_PAGE_SIZE - 1) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+	if (aligned > region) {
+		munmap(region, aligned - region);
+	}
+	if (aligned + SLAB_REGION_SIZE < region + reserved) {
+		munmap(aligned + SLAB_REGION_SIZE, region + reserved - (aligned + SLAB_REGION_SIZE));
+	}
+	challoc_slab_region = aligned;
+}
+
+/**
+ * @brief Get the size of the chunks of a size class
+ * @param class_idx The size class
+ * @return The size of its chunks
+ */
+size_t slab_class_size(size_t class_idx) {
+	return SLAB_CLASS_SIZES[class_idx];
+}
+
+/**
+ * @brief Get the size class of a size
+ * @param size The size, at most SLAB_MAX_SIZE
+ * @return The smallest class whose chunks can hold the size
+ */
+size_t slab_class_of_size(size_t size) {
+	assert(size <= SLAB_MAX_SIZE);
+	return SLAB_CLASS_OF_SIZE8[(size + 7) / 8];
+}
+
+/**
+ * @brief Get the number of chunks in a page of a size class
+ * @param class_idx The size class
+ * @return The number of chunks
+ */
+size_t slab_class_nb_chunks(size_t class_idx) {
+	return (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / slab_class_size(class_idx);
+}
+
+/**
+ * @brief Check if a pointer comes from the slab allocator
+ * @param ptr The pointer to check
+ * @return True if the pointer is in a slab page
+ */
+bool ptr_comes_from_slab(void* ptr) {
+	return challoc_slab_region != NULL && (uint8_t*)ptr >= challoc_slab_region && (uint8_t*)ptr < challoc_slab_region + SLAB_REGION_SIZE;
+}
+
+/**
+ * @brief Get the header of the page of a pointer
+ * @param ptr The pointer, which must come from the slab allocator
+ * @return The header of its page
+ */
+SlabPage* slab_page_of_ptr(void* ptr) {
+	assert(ptr_comes_from_slab(ptr));
+	return (SlabPage*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+/**
+ * @brief Get the memory of a page
+ * @param page The header of the page
+ * @return The address of its first chunk, after the header and the color of the page
+ */
+uint8_t* slab_page_memory(SlabPage* page) {
+	return (uint8_t*)page + SLAB_HEADER_SIZE + page->color;
+}
+
+/**
+ * @brief Get the size of a pointer allocated from the slab allocator
+ * @param ptr The pointer
+ * @return The size of the chunks of its page
+ */
+size_t slab_ptr_size(void* ptr) {
+	return slab_class_size(slab_page_of_ptr(ptr)->class_idx);
+}
+
+/**
+ * @brief Insert a page at the head of a list
+ * @param list The list
+ * @param page The page
+ */
+void slab_list_push(SlabPage** list, SlabPage* page) {
+	page->prev = NULL;
+	page->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = page;
+	}
+	*list = page;
+}
+
+/**
+ * @brief Remove a page from a list
+ * @param list The list containing the page
+ * @param page The page
+ */
+void slab_list_remove(SlabPage** list, SlabPage* page) {
+	if (page->prev != NULL) {
+		page->prev->next = page->next;
+	}
+	else {
+		*list = page->next;
+	}
+	if (page->next != NULL) {
+		page->next->prev = page->prev;
+	}
+	page->prev = NULL;
+	page->next = NULL;
+}
+
+/**
+ * @brief Get the color of a new page of a size class, cycling through the cache lines left over after its chunks so that the same chunk
+ * of different pages doesn't always fall in the same cache sets. Must be called while holding the lock of the class.
+ * @param slab_class The size class
+ * @param class_idx The index of the size class
+ * @return The offset of the first chunk of the page after its header
+ */
+size_t slab_class_next_color(SlabClass* slab_class, size_t class_idx) {
+	size_t leftover	 = SLAB_PAGE_SIZE - SLAB_HEADER_SIZE - slab_class_nb_chunks(class_idx) * slab_class_size(class_idx);
+	size_t nb_colors = leftover / CACHE_LINE_SIZE + 1;
+	return (slab_class->next_color++ % nb_colors) * CACHE_LINE_SIZE;
+}
+
+/**
+ * @brief Get the time of a clock which only goes forward, with a precision of a few milliseconds
+ * @return The time in milliseconds
+ */
+uint64_t time_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Give the empty pages of a size class back to the OS once they have been idle long enough, keeping the most recently emptied
+ * ones in memory so that bursts of allocations don't fault them again. Must be called while holding the lock of the class.
+ * @param slab_class The size class
+ */
+void slab_class_release_idle_pages(SlabClass* slab_class) {
+	if (slab_class->nb_empty <= challoc_options.slab_reserve) {
+		return;
+	}
+
+	// The reserve is the head of the empty list, older pages are behind it
+	SlabPage* page = slab_class->empty;
+	for (size_t i = 0; i < challoc_options.slab_reserve; i++) {
+		page = page->next;
+	}
+	uint64_t now = time_ms();
+	while (page != NULL) {
+		SlabPage* next = page->next;
+		if (now - page->empty_since >= challoc_options.slab_idle_ms) {
+			// The whole page goes back to the OS, header included, so any class can take it afterwards
+			slab_list_remove(&slab_class->empty, page);
+			slab_class->nb_empty--;
+			slab_class->nb_pages--;
+			madvise(page, SLAB_PAGE_SIZE, MADV_DONTNEED);
+			uint32_t page_idx = ((uint8_t*)page - challoc_slab_region) / SLAB_PAGE_SIZE;
+			CHALLOC_MUTEX(&challoc_slab_released_lock, challoc_slab_released[challoc_slab_nb_released++] = page_idx)
+			__atomic_fetch_add(&challoc_stats.slab_pages_released, 1, __ATOMIC_RELAXED);
+		}
+		page = next;
+	}
+}
+
+/**
+ * @brief Find a page with a free chunk in a size class, creating one if needed. Must be called while holding the lock of the class.
+ * @param slab_class The size class
+ * @param class_idx The index of the size class
+ * @return A page of the partial list, or NULL if the region is exhausted
+ */
+SlabPage* slab_class_partial_page(SlabClass* slab_class, size_t class_idx) {
+	if (slab_class->partial != NULL) {
+		return slab_class->partial;
+	}
+
+	// Pages which have been empty long enough go back to the OS before the others are reused, so a class whose frees stopped still
+	// gives them back
+	slab_class_release_idle_pages(slab_class);
+
+	// Reuse the pages of the class which are still in memory first, then the released ones of any class, which the OS backs again
+	SlabPage* page = slab_class->empty;
+	if (page != NULL) {
+		slab_list_remove(&slab_class->empty, page);
+		slab_class->nb_empty--;
+	}
+	else {
+		if (challoc_slab_region == NULL) {
+			return NULL;
+		}
+		size_t page_idx;
+		CHALLOC_MUTEX(&challoc_slab_released_lock, {
+			page_idx = challoc_slab_nb_released > 0 ? challoc_slab_released[--challoc_slab_nb_released] : SIZE_MAX;
+		})
+		if (page_idx == SIZE_MAX) {
+			page_idx = __atomic_fetch_add(&challoc_slab_next_page, 1, __ATOMIC_RELAXED);
+		}
+		if (page_idx >= SLAB_REGION_SIZE / SLAB_PAGE_SIZE) {
+			return NULL;
+		}
+		// New and released pages read as zeros, so their header only lacks its class and its color
+		page		= (SlabPage*)(challoc_slab_region + page_idx * SLAB_PAGE_SIZE);
+		page->class_idx = class_idx;
+		page->color	= slab_class_next_color(slab_class, class_idx);
+		slab_class->nb_pages++;
+	}
+	slab_list_push(&slab_class->partial, page);
+	return page;
+}
+
+/**
+ * @brief Allocate a chunk of a size class. Must be called while holding the lock of the class.
+ * @param class_idx The size class
+ * @return A pointer to the chunk, or NULL if the region is exhausted
+ */
+void* slab_class_alloc(size_t class_idx) {
+	SlabClass* slab_class = &challoc_slab_classes[class_idx];
+	SlabPage* page	      = slab_class_partial_page(slab_class, class_idx);
+	if (page == NULL) {
+		return NULL;
+	}
+
+	// A partial page always has a free chunk, and the bits after the last chunk are never set
+	// The summary skips the full words, so the search doesn't get slower as the page fills up
+	size_t index = bitmap_first_bit_at_0(page->full_words, SLAB_SUMMARY_WORDS, page->usage);
+	size_t word  = index / 64;
+	assert(index < slab_class_nb_chunks(class_idx));
+	page->usage[word] |= 1ULL << (index % 64);
+	if (page->usage[word] == ALL_ONES(uint64_t)) {
+		page->full_words[word / 64] |= 1ULL << (word % 64);
+	}
+	page->nb_used++;
+	if (page->nb_used == slab_class_nb_chunks(class_idx)) {
+		slab_list_remove(&slab_class->partial, page);
+		slab_list_push(&slab_class->full, page);
+	}
+	return slab_page_memory(page) + index * slab_class_size(class_idx);
+}
+
+/**
+ * @brief Allocate many chunks of a size class, claiming all the free chunks of a word of the usage bitmask at once.
+ * Must be called while holding the lock of the class.
+ * @param class_idx The size class
+ * @param nb_ptrs The number of chunks to allocate
+ * @param ptrs Where to store the pointers to the chunks
+ * @return The number of chunks allocated, less than nb_ptrs only if the region is exhausted
+ */
+size_t slab_class_alloc_batch(size_t class_idx, size_t nb_ptrs, void** ptrs) {
+	SlabClass* slab_class = &challoc_slab_classes[class_idx];
+	size_t chunk_size     = slab_class_size(class_idx);
+	size_t nb_chunks      = slab_class_nb_chunks(class_idx);
+	size_t nb_allocated   = 0;
+	while (nb_allocated < nb_ptrs) {
+		SlabPage* page = slab_class_partial_page(slab_class, class_idx);
+		if (page == NULL) {
+			break;
+		}
+
+		// The bits after the last chunk are never set, so they are masked out of the free chunks of the last word
+		size_t word	     = bitmap_first_bit_at_0(page->full_words, SLAB_SUMMARY_WORDS, page->usage) / 64;
+		uint64_t free_chunks = ~page->usage[word];
+		if (word == nb_chunks / 64) {
+			free_chunks &= (1ULL << (nb_chunks % 64)) - 1;
+		}
+		uint8_t* memory = slab_page_memory(page) + word * 64 * chunk_size;
+		while (free_chunks != 0 && nb_allocated < nb_ptrs) {
+			size_t bit = __builtin_ctzll(free_chunks);
+			free_chunks &= free_chunks - 1;
+			page->usage[word] |= 1ULL << bit;
+			page->nb_used++;
+			ptrs[nb_allocated++] = memory + bit * chunk_size;
+		}
+		if (page->usage[word] == ALL_ONES(uint64_t)) {
+			page->full_words[word / 64] |= 1ULL << (word % 64);
+		}
+		if (page->nb_used == nb_chunks) {
+			slab_list_remove(&slab_class->partial, page);
+			slab_list_push(&slab_class->full, page);
+		}
+	}
+	return nb_allocated;
+}
+
+/**
+ * @brief Free a chunk. Must be called while holding the lock of its size class.
+ * @param ptr The pointer to free, from the slab allocator
+ */
+void slab_class_free(void* ptr) {
+	SlabPage* page	      = slab_page_of_ptr(ptr);
+	SlabClass* slab_class = &challoc_slab_classes[page->class_idx];
+	size_t index	      = ((uint8_t*)ptr - slab_page_memory(page)) / slab_class_size(page->class_idx);
+	assert(page->usage[index / 64] & (1ULL << (index % 64)));
+	page->usage[index / 64] &= ~(1ULL << (index % 64));
+	page->full_words[index / 4096] &= ~(1ULL << (index / 64 % 64));
+
+	if (page->nb_used == slab_class_nb_chunks(page->class_idx)) {
+		slab_list_remove(&slab_class->full, page);
+		slab_list_push(&slab_class->partial, page);
+	}
+	page->nb_used--;
+	if (page->nb_used == 0) {
+		slab_list_remove(&slab_class->partial, page);
+		slab_list_push(&slab_class->empty, page);
+		slab_class->nb_empty++;
+		page->empty_since = time_ms();
+		slab_class_release_idle_pages(slab_class);
+	}
+}
+
+/**
+ * @brief Get the lock of the size class of a pointer
+ * @param ptr The pointer, which must come from the slab allocator
+ * @return The lock
+ */
+ChallocLock* slab_lock_of_ptr(void* ptr) {
+	return &challoc_slab_classes[slab_page_of_ptr(ptr)->class_idx].lock;
+}
+
+/**
+ * @brief Allocate memory from the slab pages, for small sizes the minislab of the current CPU can't serve
+ * @param size The size to allocate, at most SLAB_MAX_SIZE
+ * @return A pointer to the allocated memory, or NULL if the region is exhausted
+ */
+void* slab_alloc(size_t size) {
+	size_t class_idx = slab_class_of_size(size);
+	void* ptr;
+	CHALLOC_MUTEX(&challoc_slab_classes[class_idx].lock, ptr = slab_class_alloc(class_idx))
+	return ptr;
+}
+
+/**
+ * @brief Free a pointer allocated from the slab pages
+ * @param ptr The pointer to free
+ */
+void slab_free(void* ptr) {
+	// Freeing the chunk may give its page back to the OS, header included, so the lock is looked up before
+	ChallocLock* lock = slab_lock_of_ptr(ptr);
+	CHALLOC_MUTEX(lock, slab_class_free(ptr))
+}
+/** @} */
+
+/// ------------------------------------------------
+/// Fragmented Block Allocator
+/// ------------------------------------------------
+
+/** \defgroup Challoc_block Fragmented Block Allocator
+ *  @{
+ */
+
+/**
+ * @brief Boundary tag starting every chunk of a block, allocated or free, so that its neighbours are found from its address.
+ * The size of the previous chunk is only needed when it is free, so it is kept in the last bytes of free chunks, which are the
+ * 8 bytes right before the metadata of the next chunk. The block and the arena of a chunk are found from its address through the
+ * page map, so a chunk in use only costs these 8 bytes.
+ */
+typedef struct {
+	size_t size; ///< Size of the chunk with its metadata, a multiple of CHUNK_ALIGNMENT, or-ed with the CHUNK_* flags
+} AllocMetadata;
+
+/// Alignment of the memory given by the chunks of blocks, and of their sizes
+#define CHUNK_ALIGNMENT 16
+/// Offset of the chunks from the CHUNK_ALIGNMENT boundaries, so that the memory right after their metadata is aligned
+#define CHUNK_OFFSET (CHUNK_ALIGNMENT - sizeof(AllocMetadata))
+/// Flag of the size of a chunk given to the user
+#define CHUNK_IN_USE 1
+/// Flag of the size of a chunk whose previous chunk is given to the user, or which starts its block
+#define CHUNK_PREV_IN_USE 2
+/// Flag of the size of a huge allocation, which has a mapping of its own instead of a chunk of a block
+#define CHUNK_HUGE 4
+
+/**
+ * @brief Get the size of a chunk
+ * @param chunk The metadata of the chunk
+ * @return The size of the chunk with its metadata
+ */
+size_t chunk_size(AllocMetadata* chunk) {
+	return chunk->size & ~(size_t)(CHUNK_ALIGNMENT - 1);
+}
+
+/**
+ * @brief Get the chunk right after another one
+ * @param chunk The metadata of the chunk
+ * @return The metadata of the next chunk, or the end of the block if the chunk is the last one
+ */
+AllocMetadata* chunk_next(AllocMetadata* chunk) {
+	return (AllocMetadata*)((uint8_t*)chunk + chunk_size(chunk));
+}
+
+/**
+ * @brief Get the size of the chunk right before another one, which must be free
+ * @param chunk The metadata of the chunk
+ * @return The size of the previous chunk, read from its last bytes
+ */
+size_t chunk_prev_size(AllocMetadata* chunk) {
+	assert(!(chunk->size & CHUNK_PREV_IN_USE));
+	return ((size_t*)chunk)[-1];
+}
+
+/**
+ * @brief Small free chunk of a block, in the bin of its size. Its size is repeated in its last bytes for the chunk after it.
+ */
+typedef struct FreeChunk FreeChunk;
+struct FreeChunk {
+	AllocMetadata metadata; ///< Boundary tag of the chunk, without CHUNK_IN_USE
+	FreeChunk* next;	///< Next free chunk of the same bin
+	FreeChunk* prev;	///< Previous free chunk of the same bin
+};
+
+/**
+ * @brief Big free chunk of a block, in the tree of the free extents of its arena ordered by size then by address.
+ * The tree is a treap whose priorities are a hash of the addresses, so it stays balanced without storing anything else.
+ */
+typedef struct FreeExtent FreeExtent;
+struct FreeExtent {
+	AllocMetadata metadata; ///< Boundary tag of the extent, without CHUNK_IN_USE
+	FreeExtent* left;	///< Smaller extents, or extents of the same size at lower addresses
+	FreeExtent* right;	///< Bigger extents, or extents of the same size at higher addresses
+};
+
+/// Smallest chunk, which can hold a free chunk and its trailing size
+#define CHUNK_MIN_SIZE ((sizeof(FreeChunk) + sizeof(size_t) + CHUNK_ALIGNMENT - 1) & ~(CHUNK_ALIGNMENT - 1))
+/// Log2 of the size from which free chunks are extents in the tree instead of being in a bin
+#define FREE_EXTENT_MIN_SIZE_LOG2 12
+/// Log2 of the smallest block mapped
+#define BLOCK_MIN_SIZE_LOG2 20
+/// Smallest block mapped, so that medium allocations share their mappings and leave extents for the next ones
+#define BLOCK_MIN_SIZE (1 << BLOCK_MIN_SIZE_LOG2)
+/// Size from which free chunks are extents in the tree instead of being in a bin
+#define FREE_EXTENT_MIN_SIZE (1 << FREE_EXTENT_MIN_SIZE_LOG2)
+/// Log2 of the number of bins each power of two is split into
+#define FREE_BIN_SUBDIVISIONS_LOG2 2
+/// Number of bins of free chunks, covering every size below FREE_EXTENT_MIN_SIZE
+#define FREE_NB_BINS (FREE_EXTENT_MIN_SIZE_LOG2 << FREE_BIN_SUBDIVISIONS_LOG2)
+
+/**
+ * @brief Get the size of the chunk holding an allocation
+ * @param size The size requested
+ * @return The size of the chunk with its metadata
+ */
+size_t chunk_size_for(size_t size) {
+	size_t chunk_size = (size + sizeof(AllocMetadata) + CHUNK_ALIGNMENT - 1) & ~(size_t)(CHUNK_ALIGNMENT - 1);
+	return chunk_size < CHUNK_MIN_SIZE ? CHUNK_MIN_SIZE : chunk_size;
+}
+
+/**
+ * @brief Print the metadata of an allocation
+ * @param metadata The metadata to print
+ */
+void allocmetadata_print(AllocMetadata* metadata) {
+	printf("[%p | %zu%s%s]\n",
+	       metadata,
+	       chunk_size(metadata),
+	       metadata->size & CHUNK_IN_USE ? " | in use" : "",
+	       metadata->size & CHUNK_PREV_IN_USE ? "" : " | prev free");
+}
+
+/**
+ * @brief Get the metadata of an allocation from the pointer
+ * @param ptr The pointer to the allocated memory
+ * @return The metadata of the allocation
+ */
+AllocMetadata* challoc_get_metadata(void* ptr) {
+	return (AllocMetadata*)(ptr - sizeof(AllocMetadata));
+}
+
+/**
+ * @brief Structure to represent a block of memory allocated with mmap.
+ * Its descriptor never moves while the block is mapped, the page map and the block lists point to it.
+ */
+typedef struct Block Block;
+struct Block {
+	size_t size;		///< Size of the mmap block
 	size_t free_space;	///< Space left in the mmap block
-	AllocMetadata* head;	///< Head of the linked list
-	AllocMetadata* tail;	///< Tail of the linked list
 	void* mmap_ptr;		///< Pointer to the mmap block
+	Block* next_unused;	///< Next unused descriptor of its arena, while the block isn't mapped
+	uint32_t arena_idx;	///< Arena which owns the block
+	uint32_t list_idx;	///< Index of the block in the block list it is in
 	uint8_t time_to_live;	///< Number of mallocs in which this block wasn't reused before it is truly unmapped
 	bool freshly_allocated; ///< True if the block was just allocated (and therefore full of 0)
-} Block;
+};
 
 /**
  * @brief List of blocks as a dynamic array
  */
 typedef struct {
-	Block* blocks;	 ///< Array of blocks
+	Block** blocks;	 ///< Array of blocks
 	size_t size;	 ///< Number of blocks in the array
 	size_t capacity; ///< Capacity of the array
 } BlockList;
 
+/// Number of bits of the addresses given by mmap, the user half of the address space on x86-64 and AArch64
+#define PAGEMAP_ADDRESS_BITS 48
+/// Log2 of the size of the segments the page map is indexed by, no block is smaller so at most two blocks share a segment
+#define PAGEMAP_SEGMENT_BITS BLOCK_MIN_SIZE_LOG2
+/// Number of bits of a segment number resolved by a leaf of the page map
+#define PAGEMAP_LEAF_BITS 14
+/// Number of bits of a segment number resolved by the root of the page map
+#define PAGEMAP_ROOT_BITS (PAGEMAP_ADDRESS_BITS - PAGEMAP_SEGMENT_BITS - PAGEMAP_LEAF_BITS)
+
+/**
+ * @brief Entry of the page map for a segment of the address space
+ */
+typedef struct {
+	Block* block;	   ///< Block which covers the start of the segment, NULL if none does
+	size_t next_start; ///< Offset in the segment of the start of a block which begins inside it, 0 if none does
+} PageMapEntry;
+
+/**
+ * @brief Two-level radix tree giving the block which covers the start of each segment of the address space, so that a chunk finds
+ * its block from its address alone. An address either is in the block of its segment, or in the block starting later in the segment,
+ * which then covers the start of the next one. Indexing segments rather than pages keeps the map small next to huge blocks.
+ * The leaves are mapped on demand and never given back, the kernel only backs the parts of the map covering blocks.
+ * The entries are written by the arena of their blocks and read by any thread, so they are published with release stores. A lookup
+ * never reads a descriptor, which another arena may be recycling, and only returns the block of its segment or of the next one, which
+ * is the block of the address and can't be unmapped while the address is in use.
+ */
+PageMapEntry* challoc_pagemap[1 << PAGEMAP_ROOT_BITS] = {0};
+
+/**
+ * @brief Get the entry of the page map of a segment, creating its leaf if needed
+ * @param segment The segment number
+ * @return The entry of the segment
+ */
+PageMapEntry* pagemap_entry(uintptr_t segment) {
+	assert(segment < (1ULL << (PAGEMAP_ADDRESS_BITS - PAGEMAP_SEGMENT_BITS)));
+	PageMapEntry** root_entry = &challoc_pagemap[segment >> PAGEMAP_LEAF_BITS];
+	PageMapEntry* leaf	  = __atomic_load_n(root_entry, __ATOMIC_ACQUIRE);
+	if (leaf == NULL) {
+		// Arenas map blocks concurrently, the first one to install a leaf wins and the others give theirs back
+		PageMapEntry* new_leaf = mmap(NULL, sizeof(PageMapEntry) << PAGEMAP_LEAF_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (new_leaf == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		if (__atomic_compare_exchange_n(root_entry, &leaf, new_leaf, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			leaf = new_leaf;
+		}
+		else {
+			munmap(new_leaf, sizeof(PageMapEntry) << PAGEMAP_LEAF_BITS);
+		}
+	}
+	return &leaf[segment & ((1 << PAGEMAP_LEAF_BITS) - 1)];
+}
+
+/**
+ * @brief Make the segments whose start is in a block point to it in the page map, or to nothing once it is unmapped
+ * @param block The block, with its mmap_ptr and size set
+ * @param owner The block, or NULL when it is unmapped
+ */
+void pagemap_set(Block* block, Block* owner) {
+	assert(block->size >= BLOCK_MIN_SIZE);
+	uintptr_t start = (uintptr_t)block->mmap_ptr;
+	uintptr_t first = (start + BLOCK_MIN_SIZE - 1) >> PAGEMAP_SEGMENT_BITS;
+	uintptr_t end	= (start + block->size - 1) >> PAGEMAP_SEGMENT_BITS;
+	for (uintptr_t segment = first; segment <= end; segment++) {
+		__atomic_store_n(&pagemap_entry(segment)->block, owner, __ATOMIC_RELEASE);
+	}
+
+	// The addresses of the segment the block starts in from where it starts belong to the block, which covers the start of the next one
+	size_t offset = start & (BLOCK_MIN_SIZE - 1);
+	if (offset != 0) {
+		__atomic_store_n(&pagemap_entry(start >> PAGEMAP_SEGMENT_BITS)->next_start, owner != NULL ? offset : 0, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * @brief Get the block an address belongs to
+ * @param ptr An address inside a block which is mapped
+ * @return The block
+ */
+Block* block_of_ptr(void* ptr) {
+	uintptr_t segment   = (uintptr_t)ptr >> PAGEMAP_SEGMENT_BITS;
+	PageMapEntry* leaf  = __atomic_load_n(&challoc_pagemap[segment >> PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+	PageMapEntry* entry = &leaf[segment & ((1 << PAGEMAP_LEAF_BITS) - 1)];
+
+	// A block starting inside the segment before the address is its block, otherwise its block covers the start of the segment.
+	// The block covering the start may end before a block which is being mapped or unmapped, whose start is after the address either way.
+	size_t next_start = __atomic_load_n(&entry->next_start, __ATOMIC_ACQUIRE);
+	if (next_start != 0 && ((uintptr_t)ptr & (BLOCK_MIN_SIZE - 1)) >= next_start) {
+		segment++;
+		leaf  = __atomic_load_n(&challoc_pagemap[segment >> PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+		entry = &leaf[segment & ((1 << PAGEMAP_LEAF_BITS) - 1)];
+	}
+	Block* block = __atomic_load_n(&entry->block, __ATOMIC_ACQUIRE);
+	assert(block != NULL);
+	return block;
+}
+
 /**
  * @brief Get the time to live of a block based on its size
  * @param size The size of the block
@@ -446,7 +1510,7 @@ size_t time_to_live_with_size(size_t size) {
  */
 BlockList blocklist_with_capacity(size_t capacity) {
 	return (BlockList){
-	    .blocks   = mmap(NULL, capacity * sizeof(Block), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+	    .blocks   = mmap(NULL, capacity * sizeof(Block*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
 	    .size     = 0,
 	    .capacity = capacity,
 	};
@@ -457,59 +1521,48 @@ BlockList blocklist_with_capacity(size_t capacity) {
  * @param list The block list to destroy
  */
 void blocklist_destroy(BlockList* list) {
-	munmap(list->blocks, list->capacity * sizeof(Block));
+	munmap(list->blocks, list->capacity * sizeof(Block*));
 }
 
 /**
- * @brief Allocate a new block in the block list
- * @param list The block list
- * @param size_requested The size requested for the block
+ * @brief Independent heap of blocks with its own mutex, so that threads bound to different arenas don't wait on each other
  */
-void blocklist_allocate_new_block(BlockList* list, size_t size_requested) {
-	size_requested = ceil_to_4096multiple(size_requested);
-
-	// Allocate the memory
-	void* ptr = mmap(NULL, size_requested, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (ptr == MAP_FAILED) {
-		perror("mmap");
-		exit(1);
-	}
-
-	// Add the block to the list
-	if (list->size == list->capacity) {
-		list->capacity *= 2;
-		Block* new_blocks = mmap(NULL, list->capacity * sizeof(Block), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		memcpy(new_blocks, list->blocks, list->size * sizeof(Block));
-		munmap(list->blocks, list->size * sizeof(Block));
-		list->blocks = new_blocks;
-	}
-
-	// Initialize the block
-	list->blocks[list->size] = (Block){
-	    .size	       = size_requested,
-	    .free_space	       = size_requested,
-	    .head	       = NULL,
-	    .tail	       = NULL,
-	    .freshly_allocated = true,
-	    .mmap_ptr	       = ptr,
-	};
-
-	// Increment the size of the list
-	list->size++;
-}
-
-BlockList challoc_blocks_in_use = {0}; ///< List of blocks in use
-BlockList challoc_freed_blocks	= {0}; ///< List of freed blocks
+typedef struct {
+	ChallocLock mutex;		    ///< Protects the blocks in use and their free chunks
+	ChallocLock freed_lock;		    ///< Protects the freed blocks and the unused descriptors
+	BlockList blocks_in_use;	    ///< List of blocks in use
+	BlockList freed_blocks;		    ///< List of freed blocks
+	FreeChunk* free_bins[FREE_NB_BINS]; ///< Small free chunks of the blocks in use, segregated by size
+	uint64_t free_bins_used;	    ///< Bit set for each bin which isn't empty
+	FreeExtent* free_extents;	    ///< Root of the tree of the big free chunks of the blocks in use
+	Block* unused_blocks;		    ///< Descriptors of blocks which aren't mapped anymore, to be reused
+	void* remote_frees;		    ///< Lock-free stack of pointers freed by other threads, linked through their own memory
+	size_t nb_threads;		    ///< Number of live threads bound to the arena, 0 if it is orphaned
+	uint32_t idx;			    ///< Index of the arena in challoc_arenas
+	uint32_t numa_node;		    ///< NUMA node the blocks of the arena are placed on
+	uint32_t next_color;		    ///< Color of the next big allocation, in cache lines
+	bool initialized;		    ///< True once the block lists have been allocated
+} Arena;
+
+/// Maximum number of arenas
+#define MAX_ARENAS 64
+
+/// All the arenas, only the first challoc_options.nb_arenas ones get new threads
+Arena challoc_arenas[MAX_ARENAS] = {0};
 
 /**
  * @brief Print a block
+ * @param list The block list the block is in
  * @param block The block to print
  */
-void block_print(Block* block) {
-	printf("Block n°%zu (%zu / %zu bytes) : ", block - challoc_blocks_in_use.blocks, block->free_space, block->size);
-	for (AllocMetadata* current = block->head; current != NULL; current = current->next) {
-		assert(current->block_idx == (size_t)(block - challoc_blocks_in_use.blocks));
-		printf("[[%zu] %p | %zu] -> ", current->block_idx, current, current->size);
+void block_print(BlockList* list, Block* block) {
+	assert(list->blocks[block->list_idx] == block);
+	printf("Block n°%u of %zu (%zu / %zu bytes) : ", block->list_idx, list->size, block->free_space, block->size);
+	// The chunks of an empty block aren't written anymore
+	AllocMetadata* end = (AllocMetadata*)((uint8_t*)block->mmap_ptr + block->size - CHUNK_OFFSET);
+	for (AllocMetadata* current = (AllocMetadata*)((uint8_t*)block->mmap_ptr + CHUNK_OFFSET); block->free_space != block->size && current < end; current = chunk_next(current)) {
+		assert(block_of_ptr(current) == block);
+		printf("[%p | %zu%s] -> ", current, chunk_size(current), current->size & CHUNK_IN_USE ? "" : " | free");
 	}
 	printf("x\n");
 }
@@ -521,7 +1574,7 @@ void block_print(Block* block) {
 void blocklist_print(BlockList* list) {
 	printf("BlockList (%zu / %zu) : \n", list->size, list->capacity);
 	for (size_t i = 0; i < list->size; i++) {
-		block_print(&list->blocks[i]);
+		block_print(list, list->blocks[i]);
 	}
 }
 
@@ -530,34 +1583,119 @@ void blocklist_print(BlockList* list) {
  * @param list The block list
  * @param block The block to push
  */
-void blocklist_push(BlockList* list, Block block) {
+void blocklist_push(BlockList* list, Block* block) {
 	if (list->size == list->capacity) {
 		list->capacity *= 2;
-		size_t size	  = list->capacity * sizeof(Block);
-		size		  = ceil_to_4096multiple(size);
-		Block* new_blocks = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		memcpy(new_blocks, list->blocks, list->size * sizeof(Block));
-		if (munmap(list->blocks, list->size * sizeof(Block)) == -1) {
+		size_t size	   = list->capacity * sizeof(Block*);
+		size		   = ceil_to_4096multiple(size);
+		Block** new_blocks = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		memcpy(new_blocks, list->blocks, list->size * sizeof(Block*));
+		if (munmap(list->blocks, list->size * sizeof(Block*)) == -1) {
 			perror("munmap");
 		}
 		list->blocks = new_blocks;
 	}
+	block->list_idx		 = list->size;
 	list->blocks[list->size] = block;
 	list->size++;
 }
 
 /**
- * @brief Remove a block from the block list
+ * @brief Remove a block from the block list, moving the last block in its place
  * @param list The block list
- * @param block_idx The index of the block to remove
+ * @param block The block to remove
  */
-void blocklist_push_or_remove(BlockList* list, Block block) {
-	if (list->size == list->capacity) {
-		if (munmap(block.mmap_ptr, block.size) == -1) {
-			perror("munmap");
+void blocklist_remove(BlockList* list, Block* block) {
+	assert(list->blocks[block->list_idx] == block);
+	Block* last_block	      = list->blocks[list->size - 1];
+	last_block->list_idx	      = block->list_idx;
+	list->blocks[block->list_idx] = last_block;
+	list->size--;
+}
+
+/**
+ * @brief Give a block back to the OS, its descriptor is kept by its arena for the next block mapped.
+ * Must be called while holding the freed blocks lock of the arena.
+ * @param arena The arena of the block
+ * @param block The block to unmap
+ */
+void block_unmap(Arena* arena, Block* block) {
+	pagemap_set(block, NULL);
+	if (munmap(block->mmap_ptr, block->size) == -1) {
+		perror("munmap");
+	}
+	block->next_unused   = arena->unused_blocks;
+	arena->unused_blocks = block;
+}
+
+/**
+ * @brief Take a descriptor for a new block, which won't move while the block is mapped. Must be called while holding the freed blocks
+ * lock of the arena.
+ * @param arena The arena
+ * @return The descriptor, to be initialized
+ */
+Block* block_descriptor_take(Arena* arena) {
+	// Descriptors are mapped a page of them at a time
+	if (arena->unused_blocks == NULL) {
+		Block* descriptors = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (descriptors == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
 		}
+		for (size_t i = 0; i < 4096 / sizeof(Block); i++) {
+			descriptors[i].next_unused = arena->unused_blocks;
+			arena->unused_blocks	   = &descriptors[i];
+		}
+	}
+	Block* block	     = arena->unused_blocks;
+	arena->unused_blocks = block->next_unused;
+	return block;
+}
+
+/**
+ * @brief Map a new block and push it to the blocks in use of an arena
+ * @param arena The arena
+ * @param size_requested The size requested for the block
+ * @return The new block
+ */
+Block* block_map(Arena* arena, size_t size_requested) {
+	size_requested = ceil_to_4096multiple(size_requested);
+
+	// Allocate the memory
+	void* ptr = mmap(NULL, size_requested, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	Block* block;
+	CHALLOC_MUTEX(&arena->freed_lock, block = block_descriptor_take(arena))
+
+	// Initialize the block
+	*block = (Block){
+	    .size	       = size_requested,
+	    .free_space	       = size_requested,
+	    .freshly_allocated = true,
+	    .mmap_ptr	       = ptr,
+	    .arena_idx	       = arena->idx,
+	};
+	pagemap_set(block, block);
+	blocklist_push(&arena->blocks_in_use, block);
+	return block;
+}
+
+/**
+ * @brief Push a block to the list of freed blocks, or unmap it if the list is full. Must be called while holding the freed blocks lock
+ * of the arena.
+ * @param arena The arena of the block
+ * @param block The empty block
+ */
+void blocklist_push_or_unmap(Arena* arena, Block* block) {
+	BlockList* list = &arena->freed_blocks;
+	if (list->size == list->capacity) {
+		block_unmap(arena, block);
 		return;
 	}
+	block->list_idx		 = list->size;
 	list->blocks[list->size] = block;
 	list->size++;
 }
@@ -565,11 +1703,12 @@ void blocklist_push_or_remove(BlockList* list, Block block) {
 /**
  * @brief Checks if a block has potentially enough free space to allocate a given size
  * @param block The block to check
- * @param size_requested The size requested
+ * @param size_needed The size of the chunk needed
  * @return True if the block has potentially enough free space, false otherwise
  */
-bool block_has_enough_space(Block* block, size_t size_requested) {
-	return block->free_space >= size_requested + sizeof(AllocMetadata);
+bool block_has_enough_space(Block* block, size_t size_needed) {
+	// The edges of a block, before its first chunk and after its last one, are never used
+	return block->free_space >= size_needed + 2 * CHUNK_OFFSET;
 }
 
 /**
@@ -580,401 +1719,1631 @@ bool block_has_enough_space(Block* block, size_t size_requested) {
  */
 Block* blocklist_peek(BlockList* list, size_t block_idx) {
 	assert(block_idx <= list->size);
-	return &list->blocks[block_idx];
+	return list->blocks[block_idx];
+}
+
+/**
+ * @brief Get the start of the first chunk of a block
+ * @param block The block
+ * @return The metadata of its first chunk
+ */
+uint8_t* block_start(Block* block) {
+	return (uint8_t*)block->mmap_ptr + CHUNK_OFFSET;
+}
+
+/**
+ * @brief Get the end of the last chunk of a block
+ * @param block The block
+ * @return The first byte after its last chunk
+ */
+uint8_t* block_end(Block* block) {
+	return (uint8_t*)block->mmap_ptr + block->size - CHUNK_OFFSET;
+}
+
+/**
+ * @brief Get the bin of the free chunks of a size. Each power of two is split into 2^FREE_BIN_SUBDIVISIONS_LOG2 bins of the same width.
+ * @param size The size, at least CHUNK_MIN_SIZE
+ * @return The index of the bin
+ */
+size_t free_bin_of_size(size_t size) {
+	size_t log2 = 63 - __builtin_clzll(size);
+	size_t sub  = (size >> (log2 - FREE_BIN_SUBDIVISIONS_LOG2)) & ((1 << FREE_BIN_SUBDIVISIONS_LOG2) - 1);
+	return (log2 << FREE_BIN_SUBDIVISIONS_LOG2) + sub;
+}
+
+/**
+ * @brief Get the priority of a free extent in the treap, a hash of its address so that the tree doesn't depend on the order of frees
+ * @param extent The free extent
+ * @return The priority, parents having a higher one than their children
+ */
+uint64_t free_extent_priority(FreeExtent* extent) {
+	return ((uintptr_t)extent >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+ * @brief Check if a free extent comes before another one in the tree, ordered by size then by address
+ * @param a The first extent
+ * @param b The second extent
+ * @return True if a comes before b
+ */
+bool free_extent_before(FreeExtent* a, FreeExtent* b) {
+	size_t size_a = chunk_size(&a->metadata);
+	size_t size_b = chunk_size(&b->metadata);
+	return size_a < size_b || (size_a == size_b && a < b);
+}
+
+/**
+ * @brief Insert a free extent in a tree
+ * @param root The root of the tree
+ * @param extent The extent to insert
+ * @return The new root of the tree
+ */
+FreeExtent* free_extent_insert(FreeExtent* root, FreeExtent* extent) {
+	if (root == NULL) {
+		extent->left  = NULL;
+		extent->right = NULL;
+		return extent;
+	}
+	if (free_extent_before(extent, root)) {
+		root->left = free_extent_insert(root->left, extent);
+		if (free_extent_priority(root->left) > free_extent_priority(root)) {
+			FreeExtent* left = root->left;
+			root->left	 = left->right;
+			left->right	 = root;
+			return left;
+		}
+	}
+	else {
+		root->right = free_extent_insert(root->right, extent);
+		if (free_extent_priority(root->right) > free_extent_priority(root)) {
+			FreeExtent* right = root->right;
+			root->right	  = right->left;
+			right->left	  = root;
+			return right;
+		}
+	}
+	return root;
+}
+
+/**
+ * @brief Merge two trees, every extent of the first one coming before every extent of the second one
+ * @param left The first tree
+ * @param right The second tree
+ * @return The root of the merged tree
+ */
+FreeExtent* free_extent_merge(FreeExtent* left, FreeExtent* right) {
+	if (left == NULL) {
+		return right;
+	}
+	if (right == NULL) {
+		return left;
+	}
+	if (free_extent_priority(left) > free_extent_priority(right)) {
+		left->right = free_extent_merge(left->right, right);
+		return left;
+	}
+	right->left = free_extent_merge(left, right->left);
+	return right;
+}
+
+/**
+ * @brief Remove a free extent from a tree
+ * @param root The root of the tree, which must contain the extent
+ * @param extent The extent to remove
+ * @return The new root of the tree
+ */
+FreeExtent* free_extent_remove(FreeExtent* root, FreeExtent* extent) {
+	assert(root != NULL);
+	if (root == extent) {
+		return free_extent_merge(root->left, root->right);
+	}
+	if (free_extent_before(extent, root)) {
+		root->left = free_extent_remove(root->left, extent);
+	}
+	else {
+		root->right = free_extent_remove(root->right, extent);
+	}
+	return root;
 }
 
 /**
- * @brief Tries to allocate after a given metadata
- * @param metadata The metadata to allocate after
- * @param size_requested The size requested
+ * @brief Find the smallest free extent big enough for a size, the one at the lowest address among those of the same size
+ * @param root The root of the tree
  * @param size_needed The size needed
- * @param block_idx The index of the block to allocate from
- */
-void* try_allocate_next_to(AllocMetadata* metadata, size_t size_requested, size_t size_needed, size_t block_idx) {
-	Block* block	    = &challoc_blocks_in_use.blocks[block_idx];
-	AllocMetadata* next = metadata->next;
-	if (next == NULL) { // We are at the end of the linked list
-		size_t space_between_last_and_end_of_block =
-		    ((size_t)block->mmap_ptr + block->size) - (size_t)metadata - sizeof(AllocMetadata) - metadata->size;
-		if (space_between_last_and_end_of_block >= size_needed) {
-			AllocMetadata* new_metadata = (AllocMetadata*)((size_t)metadata + sizeof(AllocMetadata) + metadata->size);
-			new_metadata->size	    = size_requested;
-			new_metadata->next	    = NULL;
-			new_metadata->prev	    = metadata;
-			new_metadata->block_idx	    = block_idx;
-
-			metadata->next = new_metadata;
-			block->tail    = new_metadata;
-			block->free_space -= size_needed;
-			assert(block->free_space <= block->size);
-			block->freshly_allocated = false;
-			return (uint8_t*)(new_metadata) + sizeof(AllocMetadata);
-		}
-	}
-	else { // We are in the middle of the linked list
-		ssize_t space_between_current_and_next = (ssize_t)next - (ssize_t)metadata - sizeof(AllocMetadata) - metadata->size;
-		if (space_between_current_and_next >= (ssize_t)size_needed) { // We can allocate in between
-			AllocMetadata* new_metadata = (AllocMetadata*)((size_t)metadata + sizeof(AllocMetadata) + metadata->size);
-			new_metadata->size	    = size_requested;
-			new_metadata->next	    = next;
-			new_metadata->prev	    = metadata;
-			new_metadata->block_idx	    = block_idx;
-
-			metadata->next = new_metadata;
-			next->prev     = new_metadata;
-			block->free_space -= size_needed;
-			assert(block->free_space <= block->size);
-			block->freshly_allocated = false;
-			return (uint8_t*)(new_metadata) + sizeof(AllocMetadata);
+ * @return The extent, or NULL if none is big enough
+ */
+FreeExtent* free_extent_best_fit(FreeExtent* root, size_t size_needed) {
+	FreeExtent* best = NULL;
+	while (root != NULL) {
+		if (chunk_size(&root->metadata) >= size_needed) {
+			best = root;
+			root = root->left;
+		}
+		else {
+			root = root->right;
 		}
 	}
-	return NULL;
+	return best;
 }
 
 /**
- * @brief Tries to allocate within a block
- * @param list The block list
- * @param block_idx The index of the block to allocate from
- * @param size_requested The size requested
- * @return A pointer to the allocated memory, or NULL if the block is full
+ * @brief Turn a free range of a block into a free chunk: write its boundary tags, tell the chunk after it, and put it in its bin,
+ * or in the tree of free extents if it is big. The chunk before the range must be in use, free chunks are always merged with their
+ * free neighbours.
+ * @param arena The arena of the block
+ * @param block The block
+ * @param start The start of the range
+ * @param size The size of the range, a multiple of CHUNK_ALIGNMENT of at least CHUNK_MIN_SIZE
  */
-void* block_try_allocate(BlockList* list, size_t block_idx, size_t size_requested) {
-	assert(block_idx <= list->size);
-	assert(list->blocks[block_idx].free_space <= list->blocks[block_idx].size);
-	size_t size_needed = size_requested + sizeof(AllocMetadata); // We need to store the metadata
+void free_chunk_make(Arena* arena, Block* block, uint8_t* start, size_t size) {
+	assert(size >= CHUNK_MIN_SIZE && size % CHUNK_ALIGNMENT == 0);
+	AllocMetadata* metadata = (AllocMetadata*)start;
+	metadata->size		= size | CHUNK_PREV_IN_USE;
+
+	// The last chunk of a block has nobody to tell its size to, and its end may be a page nobody touched yet
+	if (start + size < block_end(block)) {
+		((size_t*)(start + size))[-1] = size;
+		((AllocMetadata*)(start + size))->size &= ~(size_t)CHUNK_PREV_IN_USE;
+	}
 
-	// We will never be able to find a space
-	Block* block = &list->blocks[block_idx];
-	if (block->free_space < size_needed) {
-		return NULL;
+	if (size >= FREE_EXTENT_MIN_SIZE) {
+		arena->free_extents = free_extent_insert(arena->free_extents, (FreeExtent*)start);
+		return;
+	}
+	FreeChunk* chunk = (FreeChunk*)start;
+	size_t bin_idx	 = free_bin_of_size(size);
+	chunk->prev	 = NULL;
+	chunk->next	 = arena->free_bins[bin_idx];
+	if (chunk->next != NULL) {
+		chunk->next->prev = chunk;
 	}
+	arena->free_bins[bin_idx] = chunk;
+	arena->free_bins_used |= 1ULL << bin_idx;
+}
 
-	// First allocated block
-	AllocMetadata* last = block->tail;
-	if (last == NULL) {
-		block->head	       = (AllocMetadata*)(block->mmap_ptr);
-		block->head->size      = size_requested;
-		block->head->next      = NULL;
-		block->head->prev      = NULL;
-		block->head->block_idx = block_idx;
-		block->tail	       = block->head;
-		block->free_space -= size_needed;
-		assert(block->free_space <= block->size);
-		block->freshly_allocated = false;
-		return (uint8_t*)(block->head) + sizeof(AllocMetadata);
-	}
-
-	// Go through the linked list to find a space
-	for (AllocMetadata* current = block->head; current != NULL; current = current->next) {
-		void* ptr = try_allocate_next_to(current, size_requested, size_needed, block_idx);
-		if (ptr != NULL) {
-			return ptr;
+/**
+ * @brief Take a free chunk out of its bin, or out of the tree of free extents if it is big
+ * @param arena The arena of the block of the chunk
+ * @param metadata The metadata of the free chunk
+ */
+void free_chunk_remove(Arena* arena, AllocMetadata* metadata) {
+	if (chunk_size(metadata) >= FREE_EXTENT_MIN_SIZE) {
+		arena->free_extents = free_extent_remove(arena->free_extents, (FreeExtent*)metadata);
+		return;
+	}
+	FreeChunk* chunk = (FreeChunk*)metadata;
+	size_t bin_idx	 = free_bin_of_size(chunk_size(metadata));
+	if (chunk->prev != NULL) {
+		chunk->prev->next = chunk->next;
+	}
+	else {
+		arena->free_bins[bin_idx] = chunk->next;
+	}
+	if (chunk->next != NULL) {
+		chunk->next->prev = chunk->prev;
+	}
+	if (arena->free_bins[bin_idx] == NULL) {
+		arena->free_bins_used &= ~(1ULL << bin_idx);
+	}
+}
+
+/**
+ * @brief Find a free chunk big enough for an allocation: the first chunk of the smallest bin which has one for small sizes,
+ * then the best fitting extent of the tree, so that small allocations never split an extent a bigger one could have used
+ * @param arena The arena
+ * @param size_needed The size of the chunk needed
+ * @return The metadata of the free chunk, or NULL if no block in use has one big enough
+ */
+AllocMetadata* free_chunk_find(Arena* arena, size_t size_needed) {
+	if (size_needed < FREE_EXTENT_MIN_SIZE) {
+		// The chunks of the bin of the size may be too small, the ones of the next bins never are
+		size_t bin_idx	 = free_bin_of_size(size_needed);
+		FreeChunk* chunk = arena->free_bins[bin_idx];
+		if (chunk != NULL && chunk_size(&chunk->metadata) >= size_needed) {
+			return &chunk->metadata;
+		}
+		uint64_t used = arena->free_bins_used & (ALL_ONES(uint64_t) << (bin_idx + 1));
+		if (used != 0) {
+			return &arena->free_bins[__builtin_ctzll(used)]->metadata;
 		}
 	}
+	FreeExtent* extent = free_extent_best_fit(arena->free_extents, size_needed);
+	return extent != NULL ? &extent->metadata : NULL;
+}
 
-	// We did not find a space
-	return NULL;
+/**
+ * @brief Allocate at the start of a free range of a block which isn't in a bin, and make a free chunk of what is left.
+ * The allocation keeps a leftover smaller than itself if it starts in another page and is less than a page or the untouched end
+ * of its block: writing boundary tags there would make the kernel back a page which the program may never touch.
+ * @param arena The arena of the block
+ * @param block The block
+ * @param start The start of the range, after a chunk in use or at the start of the block
+ * @param range_size The size of the range
+ * @param size_needed The size of the chunk needed
+ * @return A pointer to the allocated memory
+ */
+void* chunk_allocate(Arena* arena, Block* block, uint8_t* start, size_t range_size, size_t size_needed) {
+	assert(range_size >= size_needed);
+	size_t leftover = range_size - size_needed;
+	bool other_page = (uintptr_t)(start + size_needed) / 4096 != (uintptr_t)start / 4096;
+	bool at_tail	= start + range_size == block_end(block);
+	if (leftover < CHUNK_MIN_SIZE || ((leftover < 4096 || at_tail) && leftover <= size_needed && other_page)) {
+		size_needed = range_size;
+		leftover    = 0;
+	}
+
+	AllocMetadata* metadata = (AllocMetadata*)start;
+	metadata->size		= size_needed | CHUNK_IN_USE | CHUNK_PREV_IN_USE;
+	if (leftover > 0) {
+		free_chunk_make(arena, block, start + size_needed, leftover);
+	}
+	else if (start + size_needed < block_end(block)) {
+		chunk_next(metadata)->size |= CHUNK_PREV_IN_USE;
+	}
+
+	block->free_space -= size_needed;
+	assert(block->free_space <= block->size);
+	block->freshly_allocated = false;
+	return start + sizeof(AllocMetadata);
+}
+
+/// Size from which an allocation is colored
+#define BLOCK_COLOR_MIN_SIZE 4096
+/// Number of colors of the big allocations, covering a page since that's the distance at which addresses alias for the CPU
+#define BLOCK_NB_COLORS (4096 / CACHE_LINE_SIZE)
+
+/**
+ * @brief Get how far into a free range a big allocation starts, so that its memory begins at the next color: a different cache line
+ * of a page each time, whatever the allocations before it, so that the buffers a program walks together don't alias in the caches.
+ * @param arena The arena of the range
+ * @param start The start of the free range
+ * @param range_size The size of the range
+ * @param size_needed The size of the allocation with its metadata
+ * @return The offset of the allocation from the start of the range, 0 if it isn't colored or the range has no room for it
+ */
+size_t chunk_color(Arena* arena, uint8_t* start, size_t range_size, size_t size_needed) {
+	if (size_needed < BLOCK_COLOR_MIN_SIZE + sizeof(AllocMetadata)) {
+		return 0;
+	}
+	size_t offset = ((uintptr_t)start + sizeof(AllocMetadata)) % 4096;
+	size_t color  = (arena->next_color++ % BLOCK_NB_COLORS) * CACHE_LINE_SIZE;
+	size_t shift  = (color + 4096 - offset) % 4096;
+
+	// The space skipped becomes a free chunk, too small a one means taking the color after
+	if (shift > 0 && shift < CHUNK_MIN_SIZE) {
+		shift += CACHE_LINE_SIZE;
+		arena->next_color++;
+	}
+	return shift <= range_size - size_needed ? shift : 0;
+}
+
+/**
+ * @brief Allocate in a free range of a block which isn't in a bin, shifted to its color if it is big, the space left on both sides
+ * of it becoming free chunks
+ * @param arena The arena of the block
+ * @param block The block
+ * @param start The start of the range, after a chunk in use or at the start of the block
+ * @param range_size The size of the range
+ * @param size_needed The size of the chunk needed
+ * @return A pointer to the allocated memory
+ */
+void* chunk_allocate_colored(Arena* arena, Block* block, uint8_t* start, size_t range_size, size_t size_needed) {
+	// The chunk before the color must be written last, it tells the allocation that its previous chunk is free
+	size_t color = chunk_color(arena, start, range_size, size_needed);
+	void* ptr    = chunk_allocate(arena, block, start + color, range_size - color, size_needed);
+	if (color > 0) {
+		free_chunk_make(arena, block, start, color);
+	}
+	return ptr;
+}
+
+/**
+ * @brief Make the first allocation of an empty block
+ * @param arena The arena of the block
+ * @param block The block to allocate from, in the blocks in use
+ * @param size_needed The size of the chunk needed
+ * @return A pointer to the allocated memory
+ */
+void* block_allocate_first(Arena* arena, Block* block, size_t size_needed) {
+	assert(arena->blocks_in_use.blocks[block->list_idx] == block);
+	assert(block->free_space == block->size && block_has_enough_space(block, size_needed));
+	return chunk_allocate_colored(arena, block, block_start(block), block_end(block) - block_start(block), size_needed);
 }
 
 /**
- * @brief Free an allocation from a block
+ * @brief Free an allocation from a block, merging it with its free neighbours into a single free chunk
+ * @param arena The arena of the block
  * @param block The block to free from
+ * @param metadata The metadata of the allocation
+ */
+void block_free(Arena* arena, Block* block, AllocMetadata* metadata) {
+	uint8_t* start = (uint8_t*)metadata;
+	size_t size    = chunk_size(metadata);
+	block->free_space += size;
+	assert(block->free_space <= block->size);
+
+	// Merge with the chunk after it, then with the one before it, if they are free
+	AllocMetadata* next = chunk_next(metadata);
+	if ((uint8_t*)next < block_end(block) && !(next->size & CHUNK_IN_USE)) {
+		free_chunk_remove(arena, next);
+		size += chunk_size(next);
+	}
+	if (!(metadata->size & CHUNK_PREV_IN_USE)) {
+		size_t prev_size = chunk_prev_size(metadata);
+		start -= prev_size;
+		size += prev_size;
+		free_chunk_remove(arena, (AllocMetadata*)start);
+	}
+
+	// An empty block leaves the blocks in use as a whole, its chunks aren't tracked anymore
+	if (block->free_space != block->size) {
+		free_chunk_make(arena, block, start, size);
+	}
+}
+
+/// Size from which the pages inside the free chunk left by shrinking an allocation are given back to the OS
+#define CHUNK_RELEASE_MIN_SIZE (16 * 4096)
+
+/**
+ * @brief Resize an allocation of a block without moving it, taking the free chunk after it to grow, and making a free chunk of its
+ * end to shrink, whose pages are given back to the OS if it is big. Must be called while holding the mutex of the arena of the block.
+ * @param arena The arena of the block
+ * @param block The block of the allocation
+ * @param metadata The metadata of the allocation
+ * @param min_needed The smallest size of chunk accepted when growing
+ * @param max_needed The size of chunk wanted
+ * @param release_pages Whether the pages of a big free chunk left by a shrink are given back, false if they were never touched
+ * @return The size of the chunk afterwards, smaller than min_needed if it couldn't grow enough and wasn't changed
+ */
+size_t block_resize(Arena* arena, Block* block, AllocMetadata* metadata, size_t min_needed, size_t max_needed, bool release_pages) {
+	size_t size	    = chunk_size(metadata);
+	size_t range_size   = size;
+	AllocMetadata* next = chunk_next(metadata);
+	bool next_free	    = (uint8_t*)next < block_end(block) && !(next->size & CHUNK_IN_USE);
+	if (next_free) {
+		range_size += chunk_size(next);
+	}
+	size_t size_needed = max_needed < range_size ? max_needed : range_size;
+	if (size_needed < min_needed || (size_needed <= size && size - size_needed < CHUNK_MIN_SIZE)) {
+		return size;
+	}
+
+	// Take the chunk back as a free range with its free neighbour, and allocate the start of the range again
+	if (next_free) {
+		free_chunk_remove(arena, next);
+	}
+	size_t prev_in_use = metadata->size & CHUNK_PREV_IN_USE;
+	block->free_space += size;
+	chunk_allocate(arena, block, (uint8_t*)metadata, range_size, size_needed);
+	metadata->size = (metadata->size & ~(size_t)CHUNK_PREV_IN_USE) | prev_in_use;
+
+	// The end of a big shrink isn't needed anymore, only the tags at the edges of its free chunk are kept in memory
+	next = chunk_next(metadata);
+	if (release_pages && size_needed < size && (uint8_t*)next < block_end(block) && !(next->size & CHUNK_IN_USE) && chunk_size(next) >= CHUNK_RELEASE_MIN_SIZE) {
+		uintptr_t first_page = ceil_to_4096multiple((uintptr_t)next + sizeof(FreeExtent));
+		uintptr_t end_page   = ((uintptr_t)next + chunk_size(next) - sizeof(size_t)) & ~(uintptr_t)4095;
+		if (end_page > first_page) {
+			madvise((void*)first_page, end_page - first_page, MADV_DONTNEED);
+		}
+	}
+	return chunk_size(metadata);
+}
+
+/**
+ * @brief Free an allocation from the block list of its arena
+ * @param arena The arena of the allocation
  * @param ptr The pointer to the allocated memory
  */
-void block_free(Block* block, AllocMetadata* ptr) {
-	AllocMetadata* current = block->head;
+void blocklist_free(Arena* arena, AllocMetadata* ptr) {
+	Block* block = block_of_ptr(ptr);
+	assert(block->arena_idx == arena->idx);
+	block_free(arena, block, ptr);
+
+	// An empty block moves to the freed list, its chunks don't have to know
+	if (block->free_space == block->size) {
+		blocklist_remove(&arena->blocks_in_use, block);
+		CHALLOC_MUTEX(&arena->freed_lock, blocklist_push_or_unmap(arena, block))
+	}
+}
+
+/**
+ * @brief Decrease the time to live of the freed blocks of an arena and unmap the ones which have reached 0.
+ * Must be called while holding the freed blocks lock of the arena.
+ * @param arena The arena
+ * @param nb_allocs The number of allocations made in the arena since the last call
+ */
+void decrease_ttl_and_unmap(Arena* arena, size_t nb_allocs) {
+	BlockList* freed_blocks = &arena->freed_blocks;
+	for (size_t i = 0; i < freed_blocks->size; i++) {
+		Block* block = freed_blocks->blocks[i];
+		assert(block->free_space == block->size);
+		if (block->time_to_live <= nb_allocs) {
+			// The last block takes its place
+			blocklist_remove(freed_blocks, block);
+			block_unmap(arena, block);
+			i--;
+		}
+		else {
+			block->time_to_live -= nb_allocs;
+		}
+	}
+}
 
-	// Check if the only block is the one we want to free
-	if (current == ptr) {
-		block->head = current->next;
-		if (block->head == NULL) {
-			block->tail = NULL;
+/**
+ * @brief Take a freed block with enough space out of the freed blocks of an arena. Must be called while holding the freed blocks lock
+ * of the arena.
+ * @param arena The arena
+ * @param size_needed The size of the chunk needed
+ * @return The block, or NULL if no freed block is big enough
+ */
+Block* freed_blocks_take(Arena* arena, size_t size_needed) {
+	BlockList* freed_blocks = &arena->freed_blocks;
+	for (size_t i = 0; i < freed_blocks->size; i++) {
+		Block* block = freed_blocks->blocks[i];
+		if (block_has_enough_space(block, size_needed)) {
+			blocklist_remove(freed_blocks, block);
+			return block;
 		}
-		block->free_space += current->size + sizeof(AllocMetadata);
-		assert(block->free_space <= block->size);
+	}
+	return NULL;
+}
+/** @} */
+
+/// ------------------------------------------------
+/// Arenas
+/// ------------------------------------------------
+
+/** \defgroup Challoc_arenas Arenas
+ *  @{
+ */
+
+/// Arena of the current thread, bound on its first allocation in a block
+__thread Arena* challoc_thread_arena __attribute__((tls_model("initial-exec"))) = NULL;
+
+/// Key used to unbind a thread from its arena when it exits
+pthread_key_t challoc_arena_key;
+
+/// True once the thread keys have been created, before that threads are never told when they exit
+bool challoc_thread_keys_created = false;
+
+/// Arena from which the search for the least loaded arena starts, so that ties are broken in a round-robin way
+size_t challoc_next_arena = 0;
+
+/// Lock to protect the binding of threads to arenas and the number of arenas to use
+ChallocLock challoc_arena_bind_lock = {0};
+
+/// Execute code while holding the mutex of an arena
+#define ARENA_MUTEX(arena, code) CHALLOC_MUTEX(&(arena)->mutex, code)
+
+/**
+ * @brief Allocate the block lists of an arena the first time a thread is bound to it. Must be called while holding the arena bind lock.
+ * @param arena The arena to initialize
+ * @param numa_node The NUMA node of the thread, which the arena keeps for its whole life
+ */
+void arena_init(Arena* arena, uint32_t numa_node) {
+	if (arena->initialized) {
 		return;
 	}
+	arena->blocks_in_use = blocklist_with_capacity(30);
+	arena->freed_blocks  = blocklist_with_capacity(10);
+	arena->idx	     = arena - challoc_arenas;
+	arena->numa_node     = numa_node;
+	arena->initialized   = true;
+}
+
+/**
+ * @brief Check if a thread of a NUMA node should be bound to an arena
+ * @param arena The arena
+ * @param numa_node The NUMA node of the thread
+ * @return True if the arena isn't placed yet or is placed on the node
+ */
+bool arena_fits_numa_node(Arena* arena, uint32_t numa_node) {
+	return !arena->initialized || arena->numa_node == numa_node;
+}
+
+/**
+ * @brief Choose the arena of a new thread. Must be called while holding the arena bind lock.
+ * An orphaned arena which still holds allocations of an exited thread is adopted first, so that its blocks get reused.
+ * Otherwise the arena with the fewest threads is chosen, then the least contended one.
+ * On NUMA machines, only the arenas of the node of the thread are considered, unless there are none left.
+ * @return The arena, already counting the new thread
+ */
+Arena* arena_bind() {
+	bool numa	   = numa_enabled();
+	uint32_t numa_node = numa ? numa_current_node() : 0;
+
+	// Adopt an orphaned arena, even if the number of arenas has been lowered since
+	for (size_t i = 0; i < MAX_ARENAS; i++) {
+		Arena* arena = &challoc_arenas[i];
+		if (arena->initialized && arena->nb_threads == 0 && arena->blocks_in_use.size > 0 && (!numa || arena->numa_node == numa_node)) {
+			__atomic_fetch_add(&arena->nb_threads, 1, __ATOMIC_RELAXED);
+			return arena;
+		}
+	}
+
+	size_t nb_arenas = challoc_options.nb_arenas;
+	Arena* best	 = NULL;
+	for (size_t i = 0; i < nb_arenas; i++) {
+		Arena* arena = &challoc_arenas[(challoc_next_arena + i) % nb_arenas];
+		if (numa && !arena_fits_numa_node(arena, numa_node)) {
+			continue;
+		}
+		if (best == NULL || arena->nb_threads < best->nb_threads ||
+		    (arena->nb_threads == best->nb_threads && arena->mutex.contended < best->mutex.contended)) {
+			best = arena;
+		}
+	}
+	if (best == NULL) { // Every arena is placed on another node, share one anyway
+		best = &challoc_arenas[challoc_next_arena % nb_arenas];
+		for (size_t i = 0; i < nb_arenas; i++) {
+			Arena* arena = &challoc_arenas[(challoc_next_arena + i) % nb_arenas];
+			if (arena->nb_threads < best->nb_threads) {
+				best = arena;
+			}
+		}
+	}
+	challoc_next_arena = (challoc_next_arena + 1) % nb_arenas;
+
+	arena_init(best, numa_node);
+	__atomic_fetch_add(&best->nb_threads, 1, __ATOMIC_RELAXED);
+	return best;
+}
+
+/**
+ * @brief Get the arena of the current thread, binding it to one if needed
+ * @return The arena of the thread
+ */
+Arena* arena_get() {
+	if (challoc_thread_arena != NULL) {
+		return challoc_thread_arena;
+	}
+	Arena* arena;
+	CHALLOC_MUTEX(&challoc_arena_bind_lock, arena = arena_bind())
+	challoc_thread_arena = arena;
+	if (challoc_thread_keys_created) {
+		pthread_setspecific(challoc_arena_key, arena);
+	}
+	return arena;
+}
+
+/**
+ * @brief Get the arena which owns an allocation made in a block
+ * @param ptr The pointer to the allocated memory, which must not come from the minislab
+ * @return The arena of the allocation
+ */
+Arena* arena_of_ptr(void* ptr) {
+	return &challoc_arenas[block_of_ptr(challoc_get_metadata(ptr))->arena_idx];
+}
 
-	// Remove the metadata from the linked list
-	if (ptr->prev != NULL) {
-		ptr->prev->next = ptr->next;
+/**
+ * @brief Free memory allocated in the blocks of an arena. Must be called while holding the mutex of the arena.
+ * @param arena The arena which owns the allocation
+ * @param ptr The pointer to the allocated memory
+ */
+void arena_free(Arena* arena, void* ptr) {
+	blocklist_free(arena, challoc_get_metadata(ptr));
+}
+
+/**
+ * @brief Read the next pointer of a remote-free queue, stored in the first bytes of a freed allocation which may be unaligned
+ * @param ptr The freed allocation
+ * @return The next freed allocation in the queue
+ */
+void* remote_free_next(void* ptr) {
+	void* next;
+	memcpy(&next, ptr, sizeof(void*));
+	return next;
+}
+
+/**
+ * @brief Write the next pointer of a remote-free queue in the first bytes of a freed allocation
+ * @param ptr The freed allocation
+ * @param next The next freed allocation in the queue
+ */
+void remote_free_set_next(void* ptr, void* next) {
+	memcpy(ptr, &next, sizeof(void*));
+}
+
+/**
+ * @brief Check if a free can skip the lock of the arena which owns the allocation and go through its remote-free queue.
+ * The allocation must belong to the arena of another thread, every chunk of a block being big enough to hold the link of the queue.
+ * Orphaned arenas are locked directly as nobody would drain their queue soon.
+ * @param arena The arena which owns the allocation
+ * @return True if the allocations of the arena can be pushed to its remote-free queue
+ */
+bool arena_can_free_remotely(Arena* arena) {
+	return challoc_options.remote_free && arena != challoc_thread_arena && __atomic_load_n(&arena->nb_threads, __ATOMIC_RELAXED) > 0;
+}
+
+/**
+ * @brief Push a chain of freed pointers to the remote-free queue of an arena without locking it
+ * @param arena The arena which owns the pointers
+ * @param first The first pointer of the chain
+ * @param last The last pointer of the chain, already linked to the first one through remote_free_set_next
+ * @param nb_ptrs The number of pointers in the chain
+ */
+void arena_push_remote_frees(Arena* arena, void* first, void* last, size_t nb_ptrs) {
+	void* head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+	do {
+		remote_free_set_next(last, head);
+	} while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&challoc_stats.remote_frees, nb_ptrs, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Free everything other threads pushed to the remote-free queue of an arena, in one batch.
+ * Must be called while holding the mutex of the arena.
+ * @param arena The arena
+ */
+void arena_drain_remote_frees(Arena* arena) {
+	if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL) {
+		return;
 	}
-	if (ptr->next != NULL) {
-		ptr->next->prev = ptr->prev;
+	void* ptr = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+	while (ptr != NULL) {
+		void* next = remote_free_next(ptr);
+		arena_free(arena, ptr);
+		ptr = next;
+	}
+}
+
+/**
+ * @brief Allocate memory in the blocks of an arena, after draining its remote-free queue.
+ * Must be called while holding the mutex of the arena, its freed blocks are aged with arena_age_freed_blocks once it is released.
+ * @param arena The arena
+ * @param size The size of the memory to allocate
+ * @return A pointer to the allocated memory
+ */
+void* arena_alloc(Arena* arena, size_t size) {
+	// Take back what other threads freed first, it may leave room for this allocation
+	arena_drain_remote_frees(arena);
+
+	// Take a free chunk of the blocks in use
+	size_t size_needed   = chunk_size_for(size);
+	AllocMetadata* chunk = free_chunk_find(arena, size_needed);
+	if (chunk != NULL) {
+		free_chunk_remove(arena, chunk);
+		return chunk_allocate_colored(arena, block_of_ptr(chunk), (uint8_t*)chunk, chunk_size(chunk), size_needed);
 	}
 
-	// Update the head and tail
-	if (ptr == block->head) {
-		block->head = ptr->next;
+	// Revive a freed block into a ready-to-use one
+	Block* block;
+	CHALLOC_MUTEX(&arena->freed_lock, block = freed_blocks_take(arena, size_needed))
+	if (block != NULL) {
+		block->time_to_live = time_to_live_with_size(block->size);
+		block->free_space   = block->size;
+		blocklist_push(&arena->blocks_in_use, block);
+		return block_allocate_first(arena, block, size_needed);
+	}
+
+	// No block had enough space, create a new one, big enough for the next allocations to share it
+	size_t block_size = size_needed + 2 * CHUNK_OFFSET;
+	Block* new_block  = block_map(arena, block_size < BLOCK_MIN_SIZE ? BLOCK_MIN_SIZE : block_size);
+
+	// Place it before its first touch, which is when its first metadata is written
+	numa_place(new_block->mmap_ptr, new_block->size, arena->numa_node);
+
+	return block_allocate_first(arena, new_block, size_needed);
+}
+
+/**
+ * @brief Age the freed blocks of an arena after allocations in it, unmapping the ones which weren't reused in time.
+ * Only takes the freed blocks lock, so that unmapping them doesn't hold back the allocations and frees of the arena.
+ * @param arena The arena
+ * @param nb_allocs The number of allocations made in the arena
+ */
+void arena_age_freed_blocks(Arena* arena, size_t nb_allocs) {
+	if (nb_allocs == 0 || __atomic_load_n(&arena->freed_blocks.size, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	CHALLOC_MUTEX(&arena->freed_lock, decrease_ttl_and_unmap(arena, nb_allocs))
+}
+
+/**
+ * @brief Unbind an exiting thread from its arena, which becomes orphaned if it was the last one using it
+ * @param arg The arena of the thread
+ */
+void arena_release(void* arg) {
+	Arena* arena = arg;
+	CHALLOC_MUTEX(&challoc_arena_bind_lock, __atomic_fetch_sub(&arena->nb_threads, 1, __ATOMIC_RELAXED))
+
+	// A free pushed after this drain stays in the queue until a thread adopts the arena
+	ARENA_MUTEX(arena, arena_drain_remote_frees(arena))
+	if (challoc_thread_arena == arena) {
+		challoc_thread_arena = NULL;
+	}
+}
+/** @} */
+
+/// ------------------------------------------------
+/// Huge allocations
+/// ------------------------------------------------
+
+/** \defgroup Challoc_huge Huge Allocations
+ *  @{
+ */
+
+/**
+ * @brief Header at the start of the mapping of a huge allocation, which never belongs to a block nor to an arena.
+ * It links the mapping in its bucket of the registry, so that a free unlinks it in O(1) before unmapping it.
+ */
+typedef struct HugeMapping HugeMapping;
+struct HugeMapping {
+	size_t size;		///< Size of the whole mapping
+	HugeMapping* prev;	///< Previous mapping of the same bucket of the registry
+	HugeMapping* next;	///< Next mapping of the same bucket of the registry
+	AllocMetadata metadata; ///< Usable size of the allocation, or-ed with CHUNK_IN_USE and CHUNK_HUGE
+};
+
+/// Log2 of the number of buckets of the registry of huge allocations
+#define HUGE_REGISTRY_BUCKETS_LOG2 6
+
+/**
+ * @brief Bucket of the registry of huge allocations, with its own lock so that threads mapping unrelated buffers don't wait for each other
+ */
+typedef struct {
+	ChallocLock lock;   ///< Lock of the bucket
+	HugeMapping* first; ///< First mapping of the bucket
+	size_t nb_mappings; ///< Number of mappings in the bucket
+} HugeBucket;
+
+/// Registry of the live huge allocations, hashed by the address of their mapping
+HugeBucket challoc_huge_registry[1 << HUGE_REGISTRY_BUCKETS_LOG2] = {0};
+
+/**
+ * @brief Check if a size is served by a mapping of its own
+ * @param size The size requested
+ * @return True if the size reaches the huge threshold, which is never the case when it is 0
+ */
+bool size_is_huge(size_t size) {
+	size_t threshold = challoc_options.huge_threshold;
+	return threshold != 0 && size >= threshold;
+}
+
+/**
+ * @brief Check if a pointer comes from a huge allocation. Must be called after ruling out the minislab and the slab pages,
+ * whose allocations have no metadata.
+ * @param ptr The pointer
+ * @return True if the metadata of the pointer is flagged as huge
+ */
+bool ptr_comes_from_huge(void* ptr) {
+	return (challoc_get_metadata(ptr)->size & CHUNK_HUGE) != 0;
+}
+
+/**
+ * @brief Get the mapping of a huge allocation
+ * @param ptr The pointer to the allocated memory
+ * @return The header of its mapping
+ */
+HugeMapping* huge_mapping_of_ptr(void* ptr) {
+	return (HugeMapping*)((uint8_t*)ptr - sizeof(HugeMapping));
+}
+
+/**
+ * @brief Get the bucket of the registry of a huge mapping
+ * @param mapping The mapping, aligned on a page
+ * @return Its bucket, picked with a Fibonacci hash of its page number
+ */
+HugeBucket* huge_bucket_of(HugeMapping* mapping) {
+	uint64_t hash = ((uintptr_t)mapping >> 12) * 0x9E3779B97F4A7C15ULL;
+	return &challoc_huge_registry[hash >> (64 - HUGE_REGISTRY_BUCKETS_LOG2)];
+}
+
+/**
+ * @brief Link a huge mapping in its bucket of the registry
+ * @param mapping The mapping
+ */
+void huge_register(HugeMapping* mapping) {
+	HugeBucket* bucket = huge_bucket_of(mapping);
+	CHALLOC_MUTEX(&bucket->lock, {
+		mapping->prev = NULL;
+		mapping->next = bucket->first;
+		if (bucket->first != NULL) {
+			bucket->first->prev = mapping;
+		}
+		bucket->first = mapping;
+		bucket->nb_mappings++;
+	})
+}
+
+/**
+ * @brief Unlink a huge mapping from its bucket of the registry
+ * @param mapping The mapping
+ */
+void huge_unregister(HugeMapping* mapping) {
+	HugeBucket* bucket = huge_bucket_of(mapping);
+	CHALLOC_MUTEX(&bucket->lock, {
+		if (mapping->prev != NULL) {
+			mapping->prev->next = mapping->next;
+		}
+		else {
+			assert(bucket->first == mapping);
+			bucket->first = mapping->next;
+		}
+		if (mapping->next != NULL) {
+			mapping->next->prev = mapping->prev;
+		}
+		bucket->nb_mappings--;
+	})
+}
+
+/**
+ * @brief Get the size of the mapping of a huge allocation
+ * @param size The size of the allocation
+ * @return The size of its mapping, or 0 if it can't be mapped
+ */
+size_t huge_mapping_size(size_t size) {
+	if (size > SIZE_MAX - sizeof(HugeMapping) - 4096) {
+		return 0;
+	}
+	return ceil_to_4096multiple(size + sizeof(HugeMapping));
+}
+
+/**
+ * @brief Allocate memory in a mapping of its own and register it
+ * @param size The size of the memory to allocate
+ * @return A pointer to the allocated memory, already zeroed, or NULL if the system ran out of memory
+ */
+void* huge_alloc(size_t size) {
+	size_t mapping_size = huge_mapping_size(size);
+	if (mapping_size == 0) {
+		return NULL;
+	}
+	HugeMapping* mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED) {
+		return NULL;
+	}
+
+	// Place it before the header is written, which is its first touch
+	if (numa_enabled()) {
+		numa_place(mapping, mapping_size, numa_current_node());
+	}
+	mapping->size	       = mapping_size;
+	mapping->metadata.size = (mapping_size - sizeof(HugeMapping)) | CHUNK_IN_USE | CHUNK_HUGE;
+	huge_register(mapping);
+	return (uint8_t*)mapping + sizeof(HugeMapping);
+}
+
+/**
+ * @brief Unregister a huge allocation and give its mapping back to the OS, without going through any arena
+ * @param ptr The pointer to the allocated memory
+ */
+void huge_free(void* ptr) {
+	HugeMapping* mapping = huge_mapping_of_ptr(ptr);
+	huge_unregister(mapping);
+	if (munmap(mapping, mapping->size) == -1) {
+		perror("munmap");
+	}
+}
+
+/**
+ * @brief Resize the mapping of a huge allocation without moving it. Shrinking unmaps its last pages, growing only works if the
+ * pages after it are free in the address space.
+ * @param ptr The pointer to the allocated memory
+ * @param min_size The smallest size accepted when growing
+ * @param max_size The size wanted
+ * @return The usable size of the allocation afterwards, smaller than min_size if it couldn't grow enough and wasn't changed
+ */
+size_t huge_resize(void* ptr, size_t min_size, size_t max_size) {
+	// Growing in place is only an attempt, its failure isn't an error for the caller
+	int saved_errno	     = errno;
+	HugeMapping* mapping = huge_mapping_of_ptr(ptr);
+	size_t wanted	     = huge_mapping_size(max_size);
+	if (wanted != 0 && wanted != mapping->size && mremap(mapping, mapping->size, wanted, 0) != MAP_FAILED) {
+		mapping->size = wanted;
+	}
+	else if (wanted != mapping->size && min_size < max_size) {
+		// The address space after the mapping is taken, or max_size is too big to be mapped, try the least wanted
+		size_t needed = huge_mapping_size(min_size);
+		if (needed > mapping->size && mremap(mapping, mapping->size, needed, 0) != MAP_FAILED) {
+			mapping->size = needed;
+		}
+	}
+	mapping->metadata.size = (mapping->size - sizeof(HugeMapping)) | CHUNK_IN_USE | CHUNK_HUGE;
+	errno		       = saved_errno;
+	return mapping->size - sizeof(HugeMapping);
+}
+
+/**
+ * @brief Resize a huge allocation, letting the kernel move its pages to another address instead of copying them
+ * @param ptr The pointer to the allocated memory
+ * @param size The new size, above the huge threshold
+ * @return A pointer to the resized memory, or NULL if the system ran out of memory, in which case ptr is untouched
+ */
+void* huge_remap(void* ptr, size_t size) {
+	HugeMapping* mapping = huge_mapping_of_ptr(ptr);
+	size_t mapping_size  = huge_mapping_size(size);
+	if (mapping_size == 0) {
+		return NULL;
+	}
+
+	// The bucket of a mapping depends on its address, so it is unregistered while it may move
+	huge_unregister(mapping);
+	HugeMapping* moved = mremap(mapping, mapping->size, mapping_size, MREMAP_MAYMOVE);
+	if (moved == MAP_FAILED) {
+		huge_register(mapping);
+		return NULL;
+	}
+	moved->size	     = mapping_size;
+	moved->metadata.size = (mapping_size - sizeof(HugeMapping)) | CHUNK_IN_USE | CHUNK_HUGE;
+	huge_register(moved);
+	return (uint8_t*)moved + sizeof(HugeMapping);
+}
+
+/**
+ * @brief Count the live huge allocations
+ * @return The number of mappings in the registry
+ */
+size_t huge_nb_mappings() {
+	size_t nb_mappings = 0;
+	for (size_t i = 0; i < (1 << HUGE_REGISTRY_BUCKETS_LOG2); i++) {
+		nb_mappings += __atomic_load_n(&challoc_huge_registry[i].nb_mappings, __ATOMIC_RELAXED);
+	}
+	return nb_mappings;
+}
+/** @} */
+
+/// ------------------------------------------------
+/// Challoc Internal API
+/// ------------------------------------------------
+
+/** \defgroup Challoc Challoc Internal API
+ *  @{
+ */
+
+/**
+ * @brief Allocates memory. Should never be called by the user directly.
+ * Uses the minislab of the current CPU, then the slab pages of the size, or takes the mutex of the arena of the thread for blocks.
+ * @param size The size of the memory to allocate
+ * @return A pointer to the allocated memory
+ */
+void* __chamalloc(size_t size) {
+	if (size == 0) {
+		return NULL;
+	}
+
+	// Try to allocate from the minislab if the size is close to one of its layers, then from the slab pages of the size
+	if (size <= SLAB_MAX_SIZE) {
+		void* ptr		   = NULL;
+		ClosePowerOfTwo close_pow2 = is_close_to_power_of_two(size);
+		if (close_pow2.is_close) {
+			ptr = minislab_alloc(close_pow2);
+		}
+		if (ptr == NULL) {
+			ptr = slab_alloc(size);
+		}
+		if (ptr != NULL) {
+			return ptr;
+		}
+	}
+
+	// Huge buffers get their own mapping, so they never slow down the searches of the blocks
+	if (size_is_huge(size)) {
+		return huge_alloc(size);
+	}
+
+	Arena* arena = arena_get();
+	void* ptr;
+	ARENA_MUTEX(arena, ptr = arena_alloc(arena, size))
+	arena_age_freed_blocks(arena, 1);
+	return ptr;
+}
+
+/**
+ * @brief Free memory. Should never be called by the user directly. Assumes the pointer comes from challoc.
+ * Blocks are given back to the arena which allocated them, through its remote-free queue if another thread owns it.
+ * @param ptr The pointer to the memory to free
+ */
+void __chafree(void* ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	// Check if the pointer comes from the minislab or a slab page before getting wrong metadata
+	if (ptr_comes_from_minislab(ptr)) {
+		minislab_free(ptr);
+		return;
+	}
+	if (ptr_comes_from_slab(ptr)) {
+		slab_free(ptr);
+		return;
+	}
+	if (ptr_comes_from_huge(ptr)) {
+		huge_free(ptr);
+		return;
+	}
+
+	Arena* arena = arena_of_ptr(ptr);
+	if (arena_can_free_remotely(arena)) {
+		arena_push_remote_frees(arena, ptr, ptr, 1);
+		return;
+	}
+	ARENA_MUTEX(arena, arena_free(arena, ptr))
+}
+
+/**
+ * @brief Allocate many pointers of the same size. Should never be called by the user directly.
+ * Takes the lock of the slab size class or of the arena once for all of them, and skips the minislab.
+ * @param size The size of each allocation
+ * @param nb_ptrs The number of allocations
+ * @param ptrs Where to store the pointers
+ * @return The number of pointers allocated, less than nb_ptrs only if memory ran out
+ */
+size_t __chamalloc_batch(size_t size, size_t nb_ptrs, void** ptrs) {
+	if (size == 0) {
+		return 0;
+	}
+
+	size_t nb_allocated = 0;
+	if (size <= SLAB_MAX_SIZE) {
+		size_t class_idx = slab_class_of_size(size);
+		CHALLOC_MUTEX(&challoc_slab_classes[class_idx].lock, nb_allocated = slab_class_alloc_batch(class_idx, nb_ptrs, ptrs))
+	}
+	if (size_is_huge(size)) {
+		for (; nb_allocated < nb_ptrs; nb_allocated++) {
+			ptrs[nb_allocated] = huge_alloc(size);
+			if (ptrs[nb_allocated] == NULL) {
+				break;
+			}
+		}
+	}
+	if (nb_allocated < nb_ptrs) {
+		Arena* arena	 = arena_get();
+		size_t nb_before = nb_allocated;
+		ARENA_MUTEX(arena, {
+			for (; nb_allocated < nb_ptrs; nb_allocated++) {
+				ptrs[nb_allocated] = arena_alloc(arena, size);
+				if (ptrs[nb_allocated] == NULL) {
+					break;
+				}
+			}
+		})
+		arena_age_freed_blocks(arena, nb_allocated - nb_before);
+	}
+	return nb_allocated;
+}
+
+/**
+ * @brief Free many pointers. Should never be called by the user directly. Assumes the pointers come from challoc.
+ * Takes a lock once for each run of pointers of the same slab size class or of the same arena.
+ * @param ptrs The pointers to free, NULL ones are skipped
+ * @param nb_ptrs The number of pointers
+ */
+void __chafree_batch(void** ptrs, size_t nb_ptrs) {
+	size_t begin = 0;
+	while (begin < nb_ptrs) {
+		size_t end = begin + 1;
+		if (ptrs[begin] == NULL) {
+			// Nothing to free
+		}
+		else if (ptr_comes_from_minislab(ptrs[begin])) {
+			while (end < nb_ptrs && ptr_comes_from_minislab(ptrs[end])) {
+				end++;
+			}
+			for (size_t i = begin; i < end; i++) {
+				minislab_free(ptrs[i]);
+			}
+		}
+		else if (ptr_comes_from_slab(ptrs[begin])) {
+			// The whole run is looked at before any free, as freeing a chunk may release the header of its page
+			size_t class_idx = slab_page_of_ptr(ptrs[begin])->class_idx;
+			while (end < nb_ptrs && ptr_comes_from_slab(ptrs[end]) && slab_page_of_ptr(ptrs[end])->class_idx == class_idx) {
+				end++;
+			}
+			CHALLOC_MUTEX(&challoc_slab_classes[class_idx].lock, {
+				for (size_t i = begin; i < end; i++) {
+					slab_class_free(ptrs[i]);
+				}
+			})
+		}
+		else if (ptr_comes_from_huge(ptrs[begin])) {
+			huge_free(ptrs[begin]);
+		}
+		else {
+			Arena* arena = arena_of_ptr(ptrs[begin]);
+			while (end < nb_ptrs && ptrs[end] != NULL && !ptr_comes_from_minislab(ptrs[end]) && !ptr_comes_from_slab(ptrs[end]) &&
+			       !ptr_comes_from_huge(ptrs[end]) && arena_of_ptr(ptrs[end]) == arena) {
+				end++;
+			}
+			if (arena_can_free_remotely(arena)) {
+				for (size_t i = begin; i + 1 < end; i++) {
+					remote_free_set_next(ptrs[i], ptrs[i + 1]);
+				}
+				arena_push_remote_frees(arena, ptrs[begin], ptrs[end - 1], end - begin);
+			}
+			else {
+				ARENA_MUTEX(arena, {
+					for (size_t i = begin; i < end; i++) {
+						arena_free(arena, ptrs[i]);
+					}
+				})
+			}
+		}
+		begin = end;
+	}
+}
+
+/**
+ * @brief Allocate memory and set it to zero. Should never be called by the user directly.
+ * @param size The size of the memory to allocate
+ * @return A pointer to the allocated memory
+ */
+void* __chacalloc(size_t nmemb, size_t size) {
+	// Allocate the memory
+	void* ptr = __chamalloc(nmemb * size);
+	if (ptr == NULL) {
+		return NULL;
+	}
+
+	// Check if the pointer comes from the minislab or a slab page before getting wrong metadata
+	if (ptr_comes_from_minislab(ptr) || ptr_comes_from_slab(ptr)) {
+		memset(ptr, 0, nmemb * size);
+		return ptr;
+	}
+
+	// A huge allocation is always a fresh mapping, zeroed by the kernel
+	if (ptr_comes_from_huge(ptr)) {
+		return ptr;
+	}
+
+	// Check if it comes from a freshly allocated block
+	AllocMetadata* metadata = challoc_get_metadata(ptr);
+	Arena* arena		= arena_of_ptr(ptr);
+	bool freshly_allocated;
+	ARENA_MUTEX(arena, freshly_allocated = block_of_ptr(metadata)->freshly_allocated)
+	if (freshly_allocated) { // No need to memset, the block is already zeroed
+		for (size_t i = 0; i < nmemb * size; i++) {
+			assert(((uint8_t*)ptr)[i] == 0);
+		}
+		return ptr;
+	}
+
+	// Set memory to zero
+	memset(ptr, 0, nmemb * size);
+
+	return ptr;
+}
+
+/**
+ * @brief Get the size of an allocation. Doesn't need any lock as long as the caller owns the allocation.
+ * @param ptr The pointer to the allocated memory
+ * @return The size of the allocation
+ */
+size_t challoc_ptr_size(void* ptr) {
+	if (ptr_comes_from_minislab(ptr)) {
+		return minislab_ptr_size(ptr);
+	}
+	if (ptr_comes_from_slab(ptr)) {
+		return slab_ptr_size(ptr);
+	}
+	if (ptr_comes_from_huge(ptr)) {
+		return chunk_size(challoc_get_metadata(ptr));
+	}
+	return chunk_size(challoc_get_metadata(ptr)) - sizeof(AllocMetadata);
+}
+
+/**
+ * @brief Resize an allocation without moving it, as close to a wanted size as possible. Takes the mutex of the arena of the
+ * allocation if it is in a block.
+ * @param ptr The pointer to the allocated memory
+ * @param min_size The smallest size accepted when growing
+ * @param max_size The size wanted
+ * @return The usable size of the allocation afterwards, smaller than min_size if it couldn't grow enough and wasn't changed
+ */
+size_t challoc_resize_in_place(void* ptr, size_t min_size, size_t max_size) {
+	// The objects of the minislab and of the slab pages always have the size of their class
+	if (ptr_comes_from_minislab(ptr) || ptr_comes_from_slab(ptr)) {
+		return challoc_ptr_size(ptr);
+	}
+	if (ptr_comes_from_huge(ptr)) {
+		return huge_resize(ptr, min_size, max_size);
+	}
+
+	// No block is that big, and the size of a chunk for it would overflow
+	if (min_size > SIZE_MAX / 2) {
+		return challoc_ptr_size(ptr);
+	}
+	max_size		= max_size > SIZE_MAX / 2 ? SIZE_MAX / 2 : max_size;
+	AllocMetadata* metadata = challoc_get_metadata(ptr);
+	Arena* arena		= arena_of_ptr(ptr);
+	size_t size;
+	ARENA_MUTEX(arena, size = block_resize(arena, block_of_ptr(metadata), metadata, chunk_size_for(min_size), chunk_size_for(max_size), true))
+	return size - sizeof(AllocMetadata);
+}
+
+/**
+ * @brief Check if an allocation can be resized without moving it, and resize it if so
+ * @param ptr The pointer to the allocated memory
+ * @param new_size The new size, not 0
+ * @return True if the allocation now holds new_size bytes, false if it has to move and wasn't changed
+ */
+bool realloc_in_place(void* ptr, size_t new_size) {
+	// Objects stay in their class as long as they don't waste more than half of it
+	if (ptr_comes_from_minislab(ptr) || ptr_comes_from_slab(ptr)) {
+		size_t old_size = challoc_ptr_size(ptr);
+		return new_size <= old_size && new_size > old_size / 2;
+	}
+
+	// A huge allocation shrunk below the threshold goes back to the blocks
+	if (ptr_comes_from_huge(ptr) && !size_is_huge(new_size)) {
+		return false;
+	}
+	return challoc_resize_in_place(ptr, new_size, new_size) >= new_size;
+}
+
+/**
+ * @brief Move an allocation to a new one of another size
+ * @param ptr The pointer to the allocated memory
+ * @param new_size The new size of the memory
+ * @return A pointer to the reallocated memory, or NULL if it couldn't be allocated, in which case ptr is untouched
+ */
+void* realloc_moving(void* ptr, size_t new_size) {
+	// Huge allocations are moved by the kernel, which remaps their pages instead of copying them.
+	// Objects of the minislab and of the slab pages have no metadata to look at.
+	bool huge = !ptr_comes_from_minislab(ptr) && !ptr_comes_from_slab(ptr) && ptr_comes_from_huge(ptr);
+	if (huge && size_is_huge(new_size)) {
+		return huge_remap(ptr, new_size);
+	}
+
+	// A chunk of a block which grows will likely grow again, so it moves to a chunk with as much room after it, left free for it
+	size_t old_size = challoc_ptr_size(ptr);
+	void* new_ptr	= NULL;
+	if (new_size > old_size && old_size > SLAB_MAX_SIZE && !huge && new_size <= SIZE_MAX / 4 &&
+	    !size_is_huge(new_size + old_size)) {
+		new_ptr = __chamalloc(new_size + old_size);
+		if (new_ptr != NULL) {
+			AllocMetadata* metadata = challoc_get_metadata(new_ptr);
+			Arena* arena		= arena_of_ptr(new_ptr);
+			size_t size_needed	= chunk_size_for(new_size);
+			ARENA_MUTEX(arena, block_resize(arena, block_of_ptr(metadata), metadata, size_needed, size_needed, false))
+		}
+	}
+	if (new_ptr == NULL) {
+		new_ptr = __chamalloc(new_size);
+	}
+	if (new_ptr == NULL) {
+		return NULL;
+	}
+
+	// Copy the old data
+	size_t min_size = old_size < new_size ? old_size : new_size;
+	memcpy(new_ptr, ptr, min_size);
+
+	// Free the old memory
+	__chafree(ptr);
+
+	return new_ptr;
+}
+
+/**
+ * @brief Reallocate memory. Should never be called by the user directly.
+ * Grows or shrinks the allocation where it is if it can, and moves it otherwise.
+ * @param ptr The pointer to the memory to reallocate
+ * @param new_size The new size of the memory
+ * @return A pointer to the reallocated memory
+ */
+void* __charealloc(void* ptr, size_t new_size) {
+	// If ptr is NULL, behave like malloc
+	if (ptr == NULL) {
+		return __chamalloc(new_size);
 	}
-
-	if (ptr == block->tail) {
-		block->tail = ptr->prev;
+	if (new_size != 0 && realloc_in_place(ptr, new_size)) {
+		return ptr;
 	}
-
-	// Update the free space
-	block->free_space += ptr->size + sizeof(AllocMetadata);
-	assert(block->free_space <= block->size);
+	return realloc_moving(ptr, new_size);
 }
 
 /**
- * @brief Free an allocation from a blocklist
+ * @brief Grow an allocation without moving it. Should never be called by the user directly.
  * @param ptr The pointer to the allocated memory
+ * @param min_size The smallest size the allocation must reach to be grown
+ * @param max_size The size it is grown to if there is room
+ * @return The usable size of the allocation afterwards, smaller than min_size if it couldn't be grown and wasn't changed
  */
-void blocklist_free(AllocMetadata* ptr) {
-	size_t block_idx = ptr->block_idx;
-	Block* block	 = &challoc_blocks_in_use.blocks[block_idx];
-	block_free(block, ptr);
-
-	// Check if the block is empty
-	if (block->free_space == block->size) {
-		assert(block->head == NULL);
-
-		// Invalidate the last free because the block can be unmapped later on
-		prev_of_last_block_free = NULL;
-
-		// Push the block to the freed list
-		blocklist_push_or_remove(&challoc_freed_blocks, *block);
-
-		// Remove and swap the block from the allocated
-		if (challoc_blocks_in_use.size == 1) {
-			// The list is empty
-			challoc_blocks_in_use.size = 0;
-			return;
-		}
-
-		// Move the last block to the empty block
-		Block* last_block			= &challoc_blocks_in_use.blocks[challoc_blocks_in_use.size - 1];
-		challoc_blocks_in_use.blocks[block_idx] = *last_block;
-		challoc_blocks_in_use.size--;
-		for (AllocMetadata* current = block->head; current != NULL; current = current->next) {
-			current->block_idx = block_idx;
-		}
+size_t __chaexpand(void* ptr, size_t min_size, size_t max_size) {
+	if (ptr == NULL) {
+		return 0;
 	}
-}
 
-/**
- * @brief Decrease the time to live of the blocks and unmap the ones which have reached 0.
- */
-void decrease_ttl_and_unmap() {
-	for (size_t i = 0; i < challoc_freed_blocks.size; i++) {
-		assert(challoc_freed_blocks.blocks[i].head == NULL);
-		Block* block = &challoc_freed_blocks.blocks[i];
-		if (block->time_to_live == 1) {
-			if (munmap(block->mmap_ptr, block->size) == -1) {
-				perror("munmap");
-			}
-			// Move the last block to the empty block
-			Block* last_block	       = &challoc_freed_blocks.blocks[challoc_freed_blocks.size - 1];
-			challoc_freed_blocks.blocks[i] = *last_block;
-			challoc_freed_blocks.size--;
-			i--;
-		}
-		else {
-			block->time_to_live--;
-		}
+	// Never shrink, an allocation already big enough is left as it is
+	size_t size = challoc_ptr_size(ptr);
+	max_size    = max_size < min_size ? min_size : max_size;
+	if (size >= max_size) {
+		return size;
 	}
+	return challoc_resize_in_place(ptr, min_size > size ? min_size : size, max_size);
 }
 /** @} */
 
 /// ------------------------------------------------
-/// Challoc Internal API
+/// Thread cache
 /// ------------------------------------------------
 
-/** \defgroup Challoc Challoc Internal API
+/** \defgroup Challoc_tcache Thread Cache
  *  @{
  */
 
+/// Number of size classes of the thread caches up to 512 bytes: 4 bytes for the minislab, then the classes of the slab pages
+#define TCACHE_NB_SMALL_CLASSES (1 + SLAB_NB_CLASSES)
+/// Log2 of the number of size classes of the thread caches between two powers of two above 512 bytes, served by the blocks
+#define TCACHE_SUBDIVISIONS_LOG2 2
+/// Log2 of the biggest size served by the thread caches
+#define TCACHE_MAX_SIZE_LOG2 15
+/// Number of size classes kept in the thread caches: 4 to 512 bytes, then 640 bytes to 32 KiB by quarters of powers of two like the slab
+#define TCACHE_NB_CLASSES (TCACHE_NB_SMALL_CLASSES + ((TCACHE_MAX_SIZE_LOG2 - 9) << TCACHE_SUBDIVISIONS_LOG2))
+/// Biggest size served by the thread caches
+#define TCACHE_MAX_SIZE ((size_t)1 << TCACHE_MAX_SIZE_LOG2)
+/// Maximum number of pointers a thread keeps for each size class
+#define TCACHE_CAPACITY 64
+
 /**
- * @brief Allocates memory. Should never be called by the user directly.
- * @param size The size of the memory to allocate
- * @return A pointer to the allocated memory
+ * @brief Stack of free pointers of the same size class
  */
-void* __chamalloc(size_t size) {
-	if (size == 0) {
-		return NULL;
-	}
+typedef struct {
+	void* ptrs[TCACHE_CAPACITY]; ///< Cached pointers, the next one to be given is ptrs[count - 1]
+	size_t count;		     ///< Number of cached pointers
+} TCacheBin;
 
-	// Try to allocate from the minislab
-	ClosePowerOfTwo close_pow2 = is_close_to_power_of_two(size);
-	if (close_pow2.is_close) {
-		void* ptr = minislab_alloc(close_pow2);
-		if (ptr != NULL) {
-			decrease_ttl_and_unmap();
-			return ptr;
-		}
-	}
+/**
+ * @brief Per-thread cache of free pointers, which serves mallocs and frees without taking any lock
+ */
+typedef struct {
+	TCacheBin bins[TCACHE_NB_CLASSES]; ///< One bin per size class
+	size_t hits;			   ///< Calls served by the cache, not published to challoc_stats yet
+	size_t misses;			   ///< Calls which had to go to the minislab or an arena, not published to challoc_stats yet
+} ThreadCache;
 
-	// Try to allocate next to the last allocation
-	if (last_block_alloc != NULL) {
-		AllocMetadata* metadata = challoc_get_metadata(last_block_alloc);
-		void* ptr		= try_allocate_next_to(metadata, size, size + sizeof(AllocMetadata), metadata->block_idx);
-		if (ptr != NULL) {
-			decrease_ttl_and_unmap();
-			last_block_alloc = ptr;
-			return ptr;
-		}
-	}
+/// Cache of the current thread, created on its first allocation
+__thread ThreadCache* challoc_tcache __attribute__((tls_model("initial-exec"))) = NULL;
 
-	// Try to allocate next to the last free
-	if (prev_of_last_block_free != NULL) {
-		AllocMetadata* metadata = prev_of_last_block_free;
-		void* ptr		= try_allocate_next_to(metadata, size, size + sizeof(AllocMetadata), metadata->block_idx);
-		if (ptr != NULL) {
-			decrease_ttl_and_unmap();
-			last_block_alloc = ptr;
-			return ptr;
-		}
+/// Key used to flush the cache of a thread when it exits
+pthread_key_t challoc_tcache_key;
+
+/**
+ * @brief Get the size class of a size
+ * @param size The size, between 1 and TCACHE_MAX_SIZE
+ * @return The index of the size class, whose size is the smallest class of the slab (or 4) greater or equal than size up to
+ * 512 bytes, then the smallest quarter of a power of two, so that an allocation wastes at most a fifth of its size past 64 bytes
+ */
+size_t tcache_class_of_size(size_t size) {
+	assert(size > 0 && size <= TCACHE_MAX_SIZE);
+	if (size <= 4) {
+		return 0;
 	}
+	if (size <= SLAB_MAX_SIZE) {
+		return 1 + slab_class_of_size(size);
+	}
+	size_t log2 = 63 - __builtin_clzll(size - 1);
+	size_t step = (size_t)1 << (log2 - TCACHE_SUBDIVISIONS_LOG2);
+	size_t sub  = (size - ((size_t)1 << log2) + step - 1) / step;
+	return TCACHE_NB_SMALL_CLASSES + ((log2 - 9) << TCACHE_SUBDIVISIONS_LOG2) + sub - 1;
+}
 
-	// Go through the list of mmap blocks
-	for (size_t i = 0; i < challoc_blocks_in_use.size; i++) {
-		Block* block = &challoc_blocks_in_use.blocks[i];
-		if (block_has_enough_space(block, size)) {
-			void* ptr = block_try_allocate(&challoc_blocks_in_use, i, size);
-			if (ptr != NULL) {
-				decrease_ttl_and_unmap();
-				last_block_alloc = ptr;
-				return ptr;
-			}
-		}
+/**
+ * @brief Get the size of a size class
+ * @param class_idx The index of the size class
+ * @return The size of the allocations of this class
+ */
+size_t tcache_class_size(size_t class_idx) {
+	if (class_idx == 0) {
+		return 4;
 	}
+	if (class_idx < TCACHE_NB_SMALL_CLASSES) {
+		return slab_class_size(class_idx - 1);
+	}
+	size_t log2 = 9 + ((class_idx - TCACHE_NB_SMALL_CLASSES) >> TCACHE_SUBDIVISIONS_LOG2);
+	size_t sub  = ((class_idx - TCACHE_NB_SMALL_CLASSES) & ((1 << TCACHE_SUBDIVISIONS_LOG2) - 1)) + 1;
+	return ((size_t)1 << log2) + (sub << (log2 - TCACHE_SUBDIVISIONS_LOG2));
+}
 
-	// Go through the list of freed blocks
-	for (size_t i = 0; i < challoc_freed_blocks.size; i++) {
-		Block block = challoc_freed_blocks.blocks[i];
-		if (block_has_enough_space(&block, size)) {
-			Block* last_block	       = &challoc_freed_blocks.blocks[challoc_freed_blocks.size - 1];
-			challoc_freed_blocks.blocks[i] = *last_block;
-			challoc_freed_blocks.size--;
-
-			// Revive the block into a ready-to-use one
-			block.time_to_live = time_to_live_with_size(block.size);
-			block.head	   = NULL;
-			block.tail	   = NULL;
-			block.free_space   = block.size;
-			blocklist_push(&challoc_blocks_in_use, block);
-			void* ptr = block_try_allocate(&challoc_blocks_in_use, challoc_blocks_in_use.size - 1, size);
-			decrease_ttl_and_unmap();
-			last_block_alloc = ptr;
-			return ptr;
-		}
+/**
+ * @brief Get the size class a pointer was allocated for by the thread caches
+ * @param ptr The pointer
+ * @return The index of its size class, or TCACHE_NB_CLASSES if it doesn't have the size of any class
+ */
+size_t tcache_class_of_ptr(void* ptr) {
+	// The chunks of blocks give their CHUNK_OFFSET bytes of padding on top of the classes, which are multiples of CHUNK_ALIGNMENT
+	size_t size = challoc_ptr_size(ptr);
+	if (size > SLAB_MAX_SIZE) {
+		size -= CHUNK_OFFSET;
 	}
+	if (size == 0 || size > TCACHE_MAX_SIZE) {
+		return TCACHE_NB_CLASSES;
+	}
+	size_t class_idx = tcache_class_of_size(size);
+	return tcache_class_size(class_idx) == size ? class_idx : TCACHE_NB_CLASSES;
+}
 
-	// No block had enough space, create a new one
-	blocklist_allocate_new_block(&challoc_blocks_in_use, size + sizeof(AllocMetadata) + sizeof(Block));
+/**
+ * @brief Number of pointers taken from or given back to the global heap at once, smaller for bigger classes
+ * @param class_idx The index of the size class
+ * @return The number of pointers in a batch
+ */
+size_t tcache_batch_size(size_t class_idx) {
+	size_t batch = 8192 / tcache_class_size(class_idx);
+	if (batch > TCACHE_CAPACITY / 2) {
+		return TCACHE_CAPACITY / 2;
+	}
+	return batch < 2 ? 2 : batch;
+}
 
-	// Check if we could allocate the new one
-	if (challoc_blocks_in_use.blocks == MAP_FAILED) {
+/**
+ * @brief Get the cache of the current thread, creating it if needed
+ * @return The cache of the thread, or NULL if the thread caches can't be used
+ */
+ThreadCache* tcache_get() {
+	if (challoc_tcache != NULL) {
+		return challoc_tcache;
+	}
+	if (!challoc_thread_keys_created) {
 		return NULL;
 	}
 
-	void* ptr = block_try_allocate(&challoc_blocks_in_use, challoc_blocks_in_use.size - 1, size);
-
-	decrease_ttl_and_unmap();
+	// Not allocated with challoc itself, it would need a thread cache to exist
+	ThreadCache* tcache = mmap(NULL, sizeof(ThreadCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (tcache == MAP_FAILED) {
+		return NULL;
+	}
+	pthread_setspecific(challoc_tcache_key, tcache);
+	challoc_tcache = tcache;
+	return tcache;
+}
 
-	last_block_alloc = ptr;
-	return ptr;
+/**
+ * @brief Add the counters of a thread cache to the global statistics
+ * @param tcache The thread cache
+ */
+void tcache_publish_stats(ThreadCache* tcache) {
+	__atomic_fetch_add(&challoc_stats.tcache_hits, tcache->hits, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&challoc_stats.tcache_misses, tcache->misses, __ATOMIC_RELAXED);
+	tcache->hits   = 0;
+	tcache->misses = 0;
 }
 
 /**
- * @brief Free memory. Should never be called by the user directly. Assumes the pointer comes from challoc.
- * @param ptr The pointer to the memory to free
+ * @brief Fill an empty bin with a batch of allocations from the global heap, taking the arena lock only once
+ * @param tcache The thread cache
+ * @param class_idx The size class of the bin
  */
-void __chafree(void* ptr) {
-	if (ptr == NULL) {
-		return;
+void tcache_refill(ThreadCache* tcache, size_t class_idx) {
+	TCacheBin* bin = &tcache->bins[class_idx];
+	assert(bin->count == 0);
+	size_t size  = tcache_class_size(class_idx);
+	size_t batch = tcache_batch_size(class_idx);
+	void* ptrs[TCACHE_CAPACITY / 2];
+	size_t nb_ptrs = 0;
+
+	// Take what the minislab can give, then complete the batch from the slab pages or the arena of the thread
+	ClosePowerOfTwo close_pow2 = is_close_to_power_of_two(size);
+	if (close_pow2.is_close) {
+		for (; nb_ptrs < batch; nb_ptrs++) {
+			ptrs[nb_ptrs] = minislab_alloc(close_pow2);
+			if (ptrs[nb_ptrs] == NULL) {
+				break;
+			}
+		}
 	}
-
-	// Check if the pointer comes from the minislab before getting wrong metadata
-	if (ptr_comes_from_minislab(ptr)) {
-		minislab_free(ptr);
-		return;
+	if (nb_ptrs < batch && size <= SLAB_MAX_SIZE) {
+		size_t slab_class_idx = slab_class_of_size(size);
+		CHALLOC_MUTEX(&challoc_slab_classes[slab_class_idx].lock,
+			      nb_ptrs += slab_class_alloc_batch(slab_class_idx, batch - nb_ptrs, ptrs + nb_ptrs))
 	}
+	if (nb_ptrs < batch) {
+		Arena* arena	 = arena_get();
+		size_t nb_before = nb_ptrs;
+		ARENA_MUTEX(arena, {
+			for (; nb_ptrs < batch; nb_ptrs++) {
+				ptrs[nb_ptrs] = arena_alloc(arena, size);
+				if (ptrs[nb_ptrs] == NULL) {
+					break;
+				}
+			}
+		})
+		arena_age_freed_blocks(arena, nb_ptrs - nb_before);
+	}
+	tcache_publish_stats(tcache);
 
-	if (last_block_alloc == ptr) {
-		last_block_alloc = NULL;
+	// Store them in reverse order so that they are given in the order they were allocated, minislab ones first
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		bin->ptrs[nb_ptrs - 1 - i] = ptrs[i];
 	}
+	bin->count = nb_ptrs;
+}
 
-	AllocMetadata* metadata = challoc_get_metadata(ptr);
+/**
+ * @brief Give the oldest pointers of a bin back to the global heap, taking a lock once for each run of pointers of the same arena
+ * or slab size class
+ * @param bin The bin to flush
+ * @param nb_ptrs The number of pointers to give back
+ */
+void tcache_bin_flush(TCacheBin* bin, size_t nb_ptrs) {
+	assert(nb_ptrs <= bin->count);
+	__chafree_batch(bin->ptrs, nb_ptrs);
+	memmove(bin->ptrs, bin->ptrs + nb_ptrs, (bin->count - nb_ptrs) * sizeof(void*));
+	bin->count -= nb_ptrs;
+}
 
-	if (metadata->prev != NULL) {
-		prev_of_last_block_free = metadata->prev;
+/**
+ * @brief Give everything a thread cache holds back to the global heap and destroy it. Called when a thread exits.
+ * @param arg The thread cache
+ */
+void tcache_destroy(void* arg) {
+	ThreadCache* tcache = arg;
+	for (size_t i = 0; i < TCACHE_NB_CLASSES; i++) {
+		tcache_bin_flush(&tcache->bins[i], tcache->bins[i].count);
 	}
-
-	// Free the memory from the block list
-	blocklist_free(metadata);
+	tcache_publish_stats(tcache);
+	if (challoc_tcache == tcache) {
+		challoc_tcache = NULL;
+		pthread_setspecific(challoc_tcache_key, NULL);
+	}
+	munmap(tcache, sizeof(ThreadCache));
 }
 
 /**
- * @brief Allocate memory and set it to zero. Should never be called by the user directly.
+ * @brief Allocate memory from the cache of the current thread, refilling it if needed
  * @param size The size of the memory to allocate
- * @return A pointer to the allocated memory
+ * @return A pointer to the allocated memory, or NULL if the size is not served by the thread caches
  */
-void* __chacalloc(size_t nmemb, size_t size) {
-	// Allocate the memory
-	void* ptr = __chamalloc(nmemb * size);
-
-	// Check if the pointer comes from the minislab before getting wrong metadata
-	if (ptr_comes_from_minislab(ptr)) {
-		memset(ptr, 0, nmemb * size);
-		return ptr;
+void* tcache_alloc(size_t size) {
+	if (size == 0 || size > TCACHE_MAX_SIZE || !challoc_options.tcache) {
+		return NULL;
+	}
+	ThreadCache* tcache = tcache_get();
+	if (tcache == NULL) {
+		return NULL;
 	}
 
-	// Check if it comes from a freshly allocated block
-	AllocMetadata* metadata = challoc_get_metadata(ptr);
-	size_t block_idx	= metadata->block_idx;
-	Block* block		= &challoc_blocks_in_use.blocks[block_idx];
-	if (block->freshly_allocated) { // No need to memset, the block is already zeroed
-		for (size_t i = 0; i < nmemb * size; i++) {
-			assert(((uint8_t*)ptr)[i] == 0);
+	size_t class_idx = tcache_class_of_size(size);
+	TCacheBin* bin	 = &tcache->bins[class_idx];
+	if (bin->count == 0) {
+		tcache->misses++;
+		tcache_refill(tcache, class_idx);
+		if (bin->count == 0) {
+			return NULL;
 		}
-		return ptr;
 	}
-
-	// Set memory to zero
-	if (ptr != NULL) {
-		memset(ptr, 0, nmemb * size);
+	else {
+		tcache->hits++;
 	}
 
-	return ptr;
+	bin->count--;
+	return bin->ptrs[bin->count];
 }
 
 /**
- * @brief Reallocate memory. Should never be called by the user directly.
- * @param ptr The pointer to the memory to reallocate
- * @param new_size The new size of the memory
- * @return A pointer to the reallocated memory
+ * @brief Give a pointer to the cache of the current thread, flushing half of its bin if it is full
+ * @param ptr The pointer to free
+ * @return True if the pointer was taken by the cache, false if it has to be freed through the global heap
  */
-void* __charealloc(void* ptr, size_t new_size) {
-	// If ptr is NULL, behave like malloc
-	if (ptr == NULL) {
-		return __chamalloc(new_size);
-	}
-
-	// Get the size of the allocation
-	size_t old_size = 0;
-	if (ptr_comes_from_minislab(ptr)) {
-		old_size = minislab_ptr_size(ptr);
+bool tcache_free(void* ptr) {
+	if (ptr == NULL || !challoc_options.tcache) {
+		return false;
 	}
-	else {
-		AllocMetadata* metadata = challoc_get_metadata(ptr);
-		old_size		= metadata->size;
+	ThreadCache* tcache = tcache_get();
+	if (tcache == NULL) {
+		return false;
 	}
 
-	void* new_ptr = __chamalloc(new_size);
-	if (new_ptr == NULL) {
-		return NULL;
+	// Only allocations made through the thread caches have exactly the size of their class
+	size_t class_idx = tcache_class_of_ptr(ptr);
+	if (class_idx == TCACHE_NB_CLASSES) {
+		return false;
 	}
 
-	// Copy the old data
-	size_t min_size = old_size < new_size ? old_size : new_size;
-	memcpy(new_ptr, ptr, min_size);
-
-	// Free the old memory
-	__chafree(ptr);
+	TCacheBin* bin = &tcache->bins[class_idx];
+	if (bin->count == TCACHE_CAPACITY) {
+		tcache->misses++;
+		tcache_bin_flush(bin, TCACHE_CAPACITY / 2);
+		tcache_publish_stats(tcache);
+	}
+	else {
+		tcache->hits++;
+	}
 
-	return new_ptr;
+	bin->ptrs[bin->count] = ptr;
+	bin->count++;
+	return true;
 }
 /** @} */
 
@@ -1073,17 +3442,53 @@ void leakcheck_list_free(LeakcheckTraceList* list) {
 }
 
 LeakcheckTraceList challoc_leaktracker = {0}; ///< List of allocations for leak checking
+ChallocLock challoc_leakcheck_lock     = {0}; ///< Lock to protect the leak tracker
 #endif
 /** @} */
 
 void __attribute__((constructor)) init() {
-	challoc_blocks_in_use = blocklist_with_capacity(30);
-	challoc_freed_blocks  = blocklist_with_capacity(10);
-	int res		      = pthread_mutex_init(&challoc_mutex, NULL);
+	long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nb_cpus == 1) {
+		challoc_lock_max_spins = 0;
+	}
+
+	challoc_options.tcache = option_from_env("CHALLOC_TCACHE", challoc_options.tcache) != 0;
+	long nb_arenas	       = option_from_env("CHALLOC_ARENAS", nb_cpus);
+	if (nb_arenas < 1) {
+		nb_arenas = 1;
+	}
+	if (nb_arenas > MAX_ARENAS) {
+		nb_arenas = MAX_ARENAS;
+	}
+	challoc_options.nb_arenas	= nb_arenas;
+	challoc_options.remote_free	= option_from_env("CHALLOC_REMOTE_FREE", challoc_options.remote_free) != 0;
+	challoc_options.rseq		= option_from_env("CHALLOC_RSEQ", challoc_options.rseq) != 0;
+	challoc_options.numa		= option_from_env("CHALLOC_NUMA", challoc_options.numa) != 0;
+	long numa_node			= option_from_env("CHALLOC_NUMA_NODE", challoc_options.numa_node);
+	challoc_options.numa_node	= numa_node >= 0 && numa_node < MAX_NUMA_NODES ? numa_node : -1;
+	long numa_interleave		= option_from_env("CHALLOC_NUMA_INTERLEAVE", 0);
+	challoc_options.numa_interleave = numa_interleave > 0 ? numa_interleave : 0;
+	long slab_reserve		= option_from_env("CHALLOC_SLAB_RESERVE", challoc_options.slab_reserve);
+	challoc_options.slab_reserve	= slab_reserve > 0 ? slab_reserve : 0;
+	long slab_idle_ms		= option_from_env("CHALLOC_SLAB_IDLE_MS", challoc_options.slab_idle_ms);
+	challoc_options.slab_idle_ms	= slab_idle_ms > 0 ? slab_idle_ms : 0;
+	long huge_threshold		= option_from_env("CHALLOC_HUGE_THRESHOLD", challoc_options.huge_threshold);
+	challoc_options.huge_threshold	= huge_threshold > 0 ? huge_threshold : 0;
+	numa_init();
+	minislab_init();
+	slab_init();
+
+	int res = pthread_key_create(&challoc_tcache_key, tcache_destroy);
+	if (res != 0) {
+		perror("Could not create the thread cache key");
+		exit(1);
+	}
+	res = pthread_key_create(&challoc_arena_key, arena_release);
 	if (res != 0) {
-		perror("Could not initialize mutex");
+		perror("Could not create the arena key");
 		exit(1);
 	}
+	challoc_thread_keys_created = true;
 
 #ifdef CHALLOC_LEAKCHECK
 	challoc_leaktracker = leakcheck_list_with_capacity(10);
@@ -1110,13 +3515,11 @@ void __attribute__((destructor)) fini() {
 
 	leakcheck_list_free(&challoc_leaktracker);
 #endif
-	blocklist_destroy(&challoc_blocks_in_use);
-	blocklist_destroy(&challoc_freed_blocks);
-
-	int res = pthread_mutex_destroy(&challoc_mutex);
-	if (res != 0) {
-		perror("Could not destroy mutex");
-		exit(1);
+	for (size_t i = 0; i < MAX_ARENAS; i++) {
+		if (challoc_arenas[i].initialized) {
+			blocklist_destroy(&challoc_arenas[i].blocks_in_use);
+			blocklist_destroy(&challoc_arenas[i].freed_blocks);
+		}
 	}
 }
 
@@ -1134,13 +3537,13 @@ void __attribute__((destructor)) fini() {
  * @return A pointer to the allocated memory
  */
 void* chamalloc(size_t size) {
-	void* ptr;
-	CHALLOC_MUTEX({
+	void* ptr = tcache_alloc(size);
+	if (ptr == NULL) {
 		ptr = __chamalloc(size);
+	}
 #ifdef CHALLOC_LEAKCHECK
-		leakcheck_list_push(&challoc_leaktracker, ptr, size);
+	CHALLOC_MUTEX(&challoc_leakcheck_lock, leakcheck_list_push(&challoc_leaktracker, ptr, size))
 #endif
-	})
 	return ptr;
 }
 
@@ -1149,12 +3552,12 @@ void* chamalloc(size_t size) {
  * @param ptr The pointer to the memory to free
  */
 void chafree(void* ptr) {
-	CHALLOC_MUTEX({
-		__chafree(ptr);
 #ifdef CHALLOC_LEAKCHECK
-		leakcheck_list_remove_ptr(&challoc_leaktracker, ptr);
+	CHALLOC_MUTEX(&challoc_leakcheck_lock, leakcheck_list_remove_ptr(&challoc_leaktracker, ptr))
 #endif
-	})
+	if (!tcache_free(ptr)) {
+		__chafree(ptr);
+	}
 }
 
 /**
@@ -1164,13 +3567,17 @@ void chafree(void* ptr) {
  * @return A pointer to the allocated memory
  */
 void* chacalloc(size_t nmemb, size_t size) {
-	void* ptr;
-	CHALLOC_MUTEX({
+	// Cached pointers may have been used before, so they always need to be zeroed
+	void* ptr = tcache_alloc(nmemb * size);
+	if (ptr != NULL) {
+		memset(ptr, 0, nmemb * size);
+	}
+	else {
 		ptr = __chacalloc(nmemb, size);
+	}
 #ifdef CHALLOC_LEAKCHECK
-		leakcheck_list_push(&challoc_leaktracker, ptr, nmemb * size);
+	CHALLOC_MUTEX(&challoc_leakcheck_lock, leakcheck_list_push(&challoc_leaktracker, ptr, nmemb * size))
 #endif
-	})
 	return ptr;
 }
 
@@ -1182,16 +3589,220 @@ void* chacalloc(size_t nmemb, size_t size) {
  */
 void* charealloc(void* ptr, size_t size) {
 	void* new_ptr;
-	CHALLOC_MUTEX({
+	if (ptr == NULL || size == 0) {
 		new_ptr = __charealloc(ptr, size);
+	}
+	else if (realloc_in_place(ptr, size)) {
+		new_ptr = ptr;
+	}
+	else {
+		// Small reallocations which have to move go through the thread caches like a malloc, a copy and a free, except for the
+		// chunks of blocks which grow, as the chunks of a class are cached side by side and leave no room to grow again
+		size_t old_size = challoc_ptr_size(ptr);
+		if (size <= TCACHE_MAX_SIZE && challoc_options.tcache && (old_size <= SLAB_MAX_SIZE || size < old_size)) {
+			new_ptr = chamalloc(size);
+			if (new_ptr == NULL) {
+				return NULL;
+			}
+			memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+			chafree(ptr);
+			return new_ptr;
+		}
+		new_ptr = realloc_moving(ptr, size);
+	}
 #ifdef CHALLOC_LEAKCHECK
+	CHALLOC_MUTEX(&challoc_leakcheck_lock, {
 		leakcheck_list_remove_ptr(&challoc_leaktracker, ptr);
 		leakcheck_list_push(&challoc_leaktracker, new_ptr, size);
-#endif
 	})
+#endif
 	return new_ptr;
 }
 
+/**
+ * @brief Grow an allocation without moving it, like jemalloc's xallocx
+ * @param ptr The pointer to the allocated memory
+ * @param min_size The smallest size the allocation must reach to be grown
+ * @param max_size The size it is grown to if there is room
+ * @return The usable size of the allocation afterwards, smaller than min_size if it couldn't be grown and wasn't changed
+ */
+size_t chaexpand(void* ptr, size_t min_size, size_t max_size) {
+	size_t size = __chaexpand(ptr, min_size, max_size);
+#ifdef CHALLOC_LEAKCHECK
+	if (ptr != NULL) {
+		CHALLOC_MUTEX(&challoc_leakcheck_lock, {
+			leakcheck_list_remove_ptr(&challoc_leaktracker, ptr);
+			leakcheck_list_push(&challoc_leaktracker, ptr, size);
+		})
+	}
+#endif
+	return size;
+}
+
+/**
+ * @brief Allocate many pointers of the same size at once
+ * @param size The size of each allocation
+ * @param nb_ptrs The number of allocations
+ * @param ptrs Where to store the pointers
+ * @return The number of pointers allocated, less than nb_ptrs only if memory ran out
+ */
+size_t chamalloc_batch(size_t size, size_t nb_ptrs, void** ptrs) {
+	size_t nb_allocated = __chamalloc_batch(size, nb_ptrs, ptrs);
+#ifdef CHALLOC_LEAKCHECK
+	CHALLOC_MUTEX(&challoc_leakcheck_lock, {
+		for (size_t i = 0; i < nb_allocated; i++) {
+			leakcheck_list_push(&challoc_leaktracker, ptrs[i], size);
+		}
+	})
+#endif
+	return nb_allocated;
+}
+
+/**
+ * @brief Free many pointers at once
+ * @param ptrs The pointers to free, NULL ones are skipped
+ * @param nb_ptrs The number of pointers
+ */
+void chafree_batch(void** ptrs, size_t nb_ptrs) {
+#ifdef CHALLOC_LEAKCHECK
+	CHALLOC_MUTEX(&challoc_leakcheck_lock, {
+		for (size_t i = 0; i < nb_ptrs; i++) {
+			if (ptrs[i] != NULL) {
+				leakcheck_list_remove_ptr(&challoc_leaktracker, ptrs[i]);
+			}
+		}
+	})
+#endif
+	__chafree_batch(ptrs, nb_ptrs);
+}
+
+/**
+ * @brief Change a tunable parameter of challoc at runtime
+ * @param option The parameter to change
+ * @param value The new value of the parameter
+ * @return 1 on success, 0 if the option is unknown or the value is invalid
+ */
+int chamallopt(ChallocOption option, long value) {
+	switch (option) {
+		case CHALLOC_OPT_TCACHE: {
+			// Give back what the current thread holds, the other threads flush theirs when they exit
+			if (value == 0 && challoc_tcache != NULL) {
+				tcache_destroy(challoc_tcache);
+			}
+			challoc_options.tcache = value != 0;
+			return 1;
+		}
+		case CHALLOC_OPT_ARENAS: {
+			// Threads which are already bound keep their arena
+			if (value < 1 || value > MAX_ARENAS) {
+				return 0;
+			}
+			CHALLOC_MUTEX(&challoc_arena_bind_lock, challoc_options.nb_arenas = value)
+			return 1;
+		}
+		case CHALLOC_OPT_REMOTE_FREE: {
+			// Pointers already in the queues are still freed by the next allocation of their arena
+			challoc_options.remote_free = value != 0;
+			return 1;
+		}
+		case CHALLOC_OPT_NUMA_NODE: {
+			// Threads which are already bound keep their arena, and arenas keep their node
+			if (value < -1 || value >= MAX_NUMA_NODES) {
+				return 0;
+			}
+			CHALLOC_MUTEX(&challoc_arena_bind_lock, challoc_options.numa_node = value)
+			return 1;
+		}
+		case CHALLOC_OPT_NUMA_INTERLEAVE: {
+			// Only applies to blocks created from now on
+			if (value < 0) {
+				return 0;
+			}
+			challoc_options.numa_interleave = value;
+			return 1;
+		}
+		case CHALLOC_OPT_SLAB_RESERVE: {
+			// Pages beyond the new reserve are released the next time a page of their class gets empty
+			if (value < 0) {
+				return 0;
+			}
+			challoc_options.slab_reserve = value;
+			return 1;
+		}
+		case CHALLOC_OPT_SLAB_IDLE_MS: {
+			if (value < 0) {
+				return 0;
+			}
+			challoc_options.slab_idle_ms = value;
+			return 1;
+		}
+		case CHALLOC_OPT_HUGE_THRESHOLD: {
+			// Allocations already made keep where they live, a free finds it from their metadata
+			if (value < 0) {
+				return 0;
+			}
+			challoc_options.huge_threshold = value;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Add the counters of a lock to statistics
+ * @param lock The lock
+ * @param stats The statistics to add to
+ */
+void lock_add_stats(ChallocLock* lock, ChallocStats* stats) {
+	stats->lock_acquisitions += __atomic_load_n(&lock->acquisitions, __ATOMIC_RELAXED);
+	stats->lock_contended += __atomic_load_n(&lock->contended, __ATOMIC_RELAXED);
+	stats->lock_spins += __atomic_load_n(&lock->spins, __ATOMIC_RELAXED);
+	stats->lock_futex_waits += __atomic_load_n(&lock->futex_waits, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Get the statistics of challoc, giving back to the OS the slab pages which have been idle long enough on the way
+ * @return A snapshot of the statistics, which includes the current thread but not what other live threads haven't published yet
+ */
+ChallocStats chastats(void) {
+	if (challoc_tcache != NULL) {
+		tcache_publish_stats(challoc_tcache);
+	}
+
+	// The classes nobody allocates from or frees to anymore only give their idle pages back here
+	// Without a delay, empty pages are given back as soon as they are freed, so there is nothing to look for
+	for (size_t i = 0; i < SLAB_NB_CLASSES && challoc_options.slab_idle_ms > 0; i++) {
+		CHALLOC_MUTEX(&challoc_slab_classes[i].lock, slab_class_release_idle_pages(&challoc_slab_classes[i]))
+	}
+	ChallocStats stats = {
+	    .tcache_hits	 = __atomic_load_n(&challoc_stats.tcache_hits, __ATOMIC_RELAXED),
+	    .tcache_misses	 = __atomic_load_n(&challoc_stats.tcache_misses, __ATOMIC_RELAXED),
+	    .remote_frees	 = __atomic_load_n(&challoc_stats.remote_frees, __ATOMIC_RELAXED),
+	    .slab_pages_released = __atomic_load_n(&challoc_stats.slab_pages_released, __ATOMIC_RELAXED),
+	    .huge_mappings	 = huge_nb_mappings(),
+	};
+
+	// Sum the counters of the lock of every subsystem and of every arena
+	lock_add_stats(&challoc_arena_bind_lock, &stats);
+	for (size_t i = 0; i < SLAB_NB_CLASSES; i++) {
+		lock_add_stats(&challoc_slab_classes[i].lock, &stats);
+	}
+	lock_add_stats(&challoc_slab_released_lock, &stats);
+	for (size_t i = 0; i < (1 << HUGE_REGISTRY_BUCKETS_LOG2); i++) {
+		lock_add_stats(&challoc_huge_registry[i].lock, &stats);
+	}
+#ifdef CHALLOC_LEAKCHECK
+	lock_add_stats(&challoc_leakcheck_lock, &stats);
+#endif
+	for (size_t i = 0; i < MAX_ARENAS; i++) {
+		if (__atomic_load_n(&challoc_arenas[i].initialized, __ATOMIC_RELAXED)) {
+			lock_add_stats(&challoc_arenas[i].mutex, &stats);
+			lock_add_stats(&challoc_arenas[i].freed_lock, &stats);
+		}
+	}
+	return stats;
+}
+
 /** @} */
 
 // Set the interposing functions
@@ -72,4 +72,74 @@ void* charealloc(void* ptr, size_t size);
 
 #endif
 
+/**
+ * @brief Allocate many pointers of the same size at once, taking the locks only once
+ * @param size The size of each allocation
+ * @param nb_ptrs The number of allocations
+ * @param ptrs Where to store the pointers
+ * @return The number of pointers allocated, less than nb_ptrs only if memory ran out
+ */
+size_t chamalloc_batch(size_t size, size_t nb_ptrs, void** ptrs);
+
+/**
+ * @brief Free many pointers at once, taking a lock once for each run of pointers which share it
+ * @param ptrs The pointers to free, NULL ones are skipped
+ * @param nb_ptrs The number of pointers
+ */
+void chafree_batch(void** ptrs, size_t nb_ptrs);
+
+/**
+ * @brief Grow an allocation without moving it, like jemalloc's xallocx
+ * @param ptr The pointer to the allocated memory
+ * @param min_size The smallest size the allocation must reach to be grown
+ * @param max_size The size it is grown to if there is room
+ * @return The usable size of the allocation afterwards, smaller than min_size if it couldn't be grown and wasn't changed.
+ * An allocation is never shrunk, and objects of 512 bytes or less can't grow past the size of their class.
+ */
+size_t chaexpand(void* ptr, size_t min_size, size_t max_size);
+
+/**
+ * @brief Tunable parameters of challoc. Each of them can also be set with an environment variable of the same name without OPT_.
+ */
+typedef enum {
+	CHALLOC_OPT_TCACHE,	     ///< Serve small allocations from per-thread caches, 1 (default) or 0
+	CHALLOC_OPT_ARENAS,	     ///< Number of arenas new threads are spread over, from 1 to 64 (default: number of CPUs)
+	CHALLOC_OPT_REMOTE_FREE,     ///< Give blocks freed by another thread back to their arena without locking it, 1 (default) or 0
+	CHALLOC_OPT_NUMA_NODE,	     ///< NUMA node new threads are considered to run on, from 0 to 63, or -1 to ask the kernel (default)
+	CHALLOC_OPT_NUMA_INTERLEAVE, ///< Size in bytes from which new blocks are interleaved over all the NUMA nodes, 0 to never (default)
+	CHALLOC_OPT_SLAB_RESERVE,    ///< Number of empty slab pages each size class keeps before giving the others back to the OS (default: 4)
+	CHALLOC_OPT_SLAB_IDLE_MS,    ///< Milliseconds a slab page has to stay empty before it is given back to the OS (default: 0)
+	CHALLOC_OPT_HUGE_THRESHOLD,  ///< Size in bytes from which allocations get a mapping of their own instead of a block, 0 to never (default: 16 MiB)
+} ChallocOption;
+
+/**
+ * @brief Change a tunable parameter of challoc at runtime
+ * @param option The parameter to change
+ * @param value The new value of the parameter
+ * @return 1 on success, 0 if the option is unknown or the value is invalid
+ */
+int chamallopt(ChallocOption option, long value);
+
+/**
+ * @brief Statistics about the allocator
+ */
+typedef struct {
+	size_t tcache_hits;	    ///< Small allocations and frees served by a thread cache without taking a lock
+	size_t tcache_misses;	    ///< Small allocations and frees for which a thread cache had to go to the global heap
+	size_t remote_frees;	    ///< Frees pushed to the remote-free queue of another arena instead of taking its lock
+	size_t lock_acquisitions;   ///< Times one of the internal locks was taken
+	size_t lock_contended;	    ///< Times one of the internal locks was already held by another thread
+	size_t lock_spins;	    ///< Pause instructions executed while spinning for one of the internal locks
+	size_t lock_futex_waits;    ///< Times a thread was parked because spinning for one of the internal locks was not enough
+	size_t slab_pages_released; ///< Empty slab pages whose memory was given back to the OS
+	size_t huge_mappings;	    ///< Huge allocations currently living in a mapping of their own
+} ChallocStats;
+
+/**
+ * @brief Get the statistics of challoc. Threads publish their thread cache counters when they go to the global heap and when they
+ * exit. With CHALLOC_OPT_SLAB_IDLE_MS, it also gives back to the OS the slab pages which have been empty for long enough.
+ * @return A snapshot of the statistics
+ */
+ChallocStats chastats(void);
+
 #endif // CHALLOC_H
\ No newline at end of file
@@ -3,6 +3,7 @@
  * @brief Internal tests for the challoc library
  */
 
+#define _GNU_SOURCE // Needed by challoc.c, which is included after the standard headers
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -13,11 +14,11 @@
 #include "../src/challoc.c"
 
 bool test_minislab_fits_page() {
-	if (sizeof(challoc_minislab) > 4096) {
-		printf("minislab is too big : %zu\n", sizeof(challoc_minislab));
+	if (sizeof(MiniSlab) > 4096) {
+		printf("minislab is too big : %zu\n", sizeof(MiniSlab));
 		return false;
 	}
-	return sizeof(challoc_minislab) <= 4096;
+	return sizeof(MiniSlab) <= 4096;
 }
 
 bool test_minislab_malloc() {
@@ -90,7 +91,7 @@ bool test_fill_minislab() {
 			sizes[all_alloced_size]	      = current_size;
 			all_alloced_size++;
 		}
-		blocklist_print(&challoc_blocks_in_use);
+		blocklist_print(&arena_get()->blocks_in_use);
 
 		current_size *= 2;
 	}
@@ -109,7 +110,7 @@ bool test_fill_minislab() {
 		volatile uint8_t* ptr = chamalloc(pow * sizeof(uint8_t));
 		if (ptr_comes_from_minislab(ptr)) {
 			printf("minislab is not full\n\n");
-			minislab_print_usage(challoc_minislab);
+			minislab_print_usage(minislab_of_current_cpu());
 			chafree(ptr);
 			return false;
 		}
@@ -124,7 +125,7 @@ bool test_fill_minislab() {
 	void* ptr = chamalloc(4 * sizeof(uint8_t));
 	if (!ptr_comes_from_minislab(ptr)) {
 		printf("minislab is not empty\n\n");
-		minislab_print_usage(challoc_minislab);
+		minislab_print_usage(minislab_of_current_cpu());
 		chafree(ptr);
 		return false;
 	}
@@ -146,10 +147,11 @@ bool test_block_reusage() {
 	}
 
 	// Check that there is nothing in the freed list
-	if (challoc_freed_blocks.size != 0) {
-		printf("challoc_freed_blocks list has %zu elements, expected 0\n", challoc_freed_blocks.size);
-		Block* block = &challoc_freed_blocks.blocks[0];
-		block_print(block);
+	BlockList* freed_blocks = &arena_get()->freed_blocks;
+	if (freed_blocks->size != 0) {
+		printf("freed list has %zu elements, expected 0\n", freed_blocks->size);
+		Block* block = freed_blocks->blocks[0];
+		block_print(freed_blocks, block);
 		chafree(ptr);
 		return false;
 	}
@@ -158,11 +160,11 @@ bool test_block_reusage() {
 	chafree(ptr);
 
 	// Check that there is one block in the freed list and not with a TTL of 0
-	if (challoc_freed_blocks.size != 1) {
-		printf("freed list has %zu elements, expected 1\n", challoc_freed_blocks.size);
+	if (freed_blocks->size != 1) {
+		printf("freed list has %zu elements, expected 1\n", freed_blocks->size);
 		return false;
 	}
-	Block* block = blocklist_peek(&challoc_freed_blocks, 0);
+	Block* block = blocklist_peek(freed_blocks, 0);
 	if (block->time_to_live == 0) {
 		printf("freed block has TTL of 0\n");
 		return false;
@@ -229,6 +231,18 @@ bool test_minislab_concurrent_usage() {
 	return true;
 }
 
+bool test_lock_skipped_while_single_threaded() {
+	// Must run before any test creates a thread
+	ChallocLock lock = {0};
+	challoc_lock(&lock);
+	bool skipped = lock.state == 0 && lock.acquisitions == 0;
+	challoc_unlock(&lock);
+	if (!skipped) {
+		printf("the lock was taken in a single-threaded process\n");
+	}
+	return skipped;
+}
+
 bool test_block_fragmentation() {
 	void* ptr1 = chamalloc(1001);
 	void* ptr2 = chamalloc(1002);
@@ -250,56 +264,965 @@ bool test_block_fragmentation() {
 	AllocMetadata* metadata_ptr1 = challoc_get_metadata(ptr1);
 	AllocMetadata* metadata_ptr2 = challoc_get_metadata(ptr2);
 	AllocMetadata* metadata_ptr3 = challoc_get_metadata(ptr3);
-	Block* block		     = blocklist_peek(&challoc_blocks_in_use, metadata_ptr1->block_idx);
+	BlockList* blocks_in_use     = &arena_get()->blocks_in_use;
+	Block* block		     = block_of_ptr(metadata_ptr1);
 
-	if (block->head != metadata_ptr1) {
-		printf("ptr1 should have been the head\n");
-		block_print(block);
+	if (chunk_next(metadata_ptr1) != metadata_ptr2) {
+		printf("ptr2 should have been right after ptr1\n");
+		block_print(blocks_in_use, block);
 		return false;
 	}
-	if (metadata_ptr1->next != metadata_ptr2) {
-		printf("ptr2 should have the next of ptr1\n");
-		block_print(block);
+	if (chunk_next(metadata_ptr2) != metadata_ptr3) {
+		printf("ptr3 should have been right after ptr2\n");
+		block_print(blocks_in_use, block);
 		return false;
 	}
-	if (metadata_ptr2->next != metadata_ptr3) {
-		printf("ptr2 should have the next of ptr1\n");
-		block_print(block);
+	if (chunk_size(metadata_ptr1) < 1001 + sizeof(AllocMetadata) || (uintptr_t)ptr1 % CHUNK_ALIGNMENT != 0) {
+		printf("ptr1 got a chunk of %zu bytes at %p\n", chunk_size(metadata_ptr1), ptr1);
+		block_print(blocks_in_use, block);
 		return false;
 	}
 
 	chafree(ptr1);
 
-	if (block->head != metadata_ptr2) {
-		printf("ptr2 should have been the head\n");
-		block_print(block);
+	if (metadata_ptr1->size & CHUNK_IN_USE || metadata_ptr2->size & CHUNK_PREV_IN_USE) {
+		printf("ptr1 should have been a free chunk before ptr2\n");
+		block_print(blocks_in_use, block);
 		return false;
 	}
-	if (metadata_ptr2->next != metadata_ptr3) {
-		printf("ptr2 should have the next of ptr1\n");
-		block_print(block);
+	if (!(metadata_ptr3->size & CHUNK_PREV_IN_USE)) {
+		printf("ptr2 should have still been in use\n");
+		block_print(blocks_in_use, block);
 		return false;
 	}
 
 	chafree(ptr3);
 
-	if (block->head != metadata_ptr2) {
-		printf("ptr2 should have been the head\n");
-		block_print(block);
+	if (!(metadata_ptr2->size & CHUNK_IN_USE)) {
+		printf("ptr2 should have still been in use\n");
+		block_print(blocks_in_use, block);
+		return false;
+	}
+
+	// Freeing ptr2 merges it with both its free neighbours
+	size_t merged_size = chunk_size(metadata_ptr1) + chunk_size(metadata_ptr2);
+	chafree(ptr2);
+
+	if (block->free_space != block->size && chunk_size(metadata_ptr1) < merged_size) {
+		printf("ptr1 and ptr2 should have been merged\n");
+		block_print(blocks_in_use, block);
+		return false;
+	}
+
+	return true;
+}
+
+bool test_tcache_reuses_freed_ptr() {
+	chamallopt(CHALLOC_OPT_TCACHE, 1);
+	ChallocStats before = chastats();
+
+	void* ptr1 = chamalloc(16);
+	chafree(ptr1);
+	void* ptr2 = chamalloc(16);
+	chafree(ptr2);
+
+	ChallocStats after = chastats();
+	chamallopt(CHALLOC_OPT_TCACHE, 0);
+
+	if (ptr1 != ptr2) {
+		printf("the freed pointer %p was not reused, got %p\n", ptr1, ptr2);
+		return false;
+	}
+	// Only the first allocation needs to refill the cache
+	if (after.tcache_hits - before.tcache_hits != 3 || after.tcache_misses - before.tcache_misses != 1) {
+		printf("expected 3 hits and 1 miss, got %zu hits and %zu misses\n",
+		       after.tcache_hits - before.tcache_hits,
+		       after.tcache_misses - before.tcache_misses);
+		return false;
+	}
+	return true;
+}
+
+bool test_tcache_size_classes() {
+	// Every size gets the smallest class holding it, and a chunk of a block allocated for a class goes back to that class
+	for (size_t size = 1; size <= TCACHE_MAX_SIZE; size++) {
+		size_t class_idx = tcache_class_of_size(size);
+		if (class_idx >= TCACHE_NB_CLASSES || tcache_class_size(class_idx) < size || (class_idx > 0 && tcache_class_size(class_idx - 1) >= size)) {
+			printf("size %zu got class %zu of %zu bytes\n", size, class_idx, tcache_class_size(class_idx));
+			return false;
+		}
+	}
+	bool passed = true;
+	for (size_t class_idx = TCACHE_NB_SMALL_CLASSES; class_idx < TCACHE_NB_CLASSES; class_idx++) {
+		size_t size = tcache_class_size(class_idx);
+		void* ptr   = __chamalloc(size);
+		if (tcache_class_of_ptr(ptr) != class_idx || size > tcache_class_size(class_idx - 1) * 5 / 4) {
+			printf("class %zu of %zu bytes isn't found back from its pointers or is too far from the previous one\n", class_idx, size);
+			passed = false;
+		}
+		__chafree(ptr);
+	}
+	return passed;
+}
+
+thread_func alloc_and_free_thread(void* unused) {
+	void* ptrs[16];
+	for (size_t i = 0; i < 16; i++) {
+		ptrs[i] = chamalloc(8);
+	}
+	for (size_t i = 0; i < 16; i++) {
+		chafree(ptrs[i]);
+	}
+	return NULL;
+}
+
+/// Chunks of a layer used in any minislab, without the ones freed from another CPU and not collected yet
+uint64_t minislab_layer_usage(size_t layer) {
+	uint64_t usage = 0;
+	for (size_t i = 0; i < challoc_nb_minislabs; i++) {
+		usage |= challoc_minislabs[i].usage[layer] & ~challoc_minislabs[i].remote_frees[layer];
+	}
+	return usage;
+}
+
+bool test_tcache_flushed_on_thread_exit() {
+	chamallopt(CHALLOC_OPT_TCACHE, 1);
+	uint64_t usage_before = minislab_layer_usage(6);
+
+	pthread_t thread_id;
+	pthread_create(&thread_id, NULL, (thread_func)alloc_and_free_thread, NULL);
+	pthread_join(thread_id, NULL);
+
+	chamallopt(CHALLOC_OPT_TCACHE, 0);
+	if (minislab_layer_usage(6) != usage_before) {
+		printf("the thread cache wasn't flushed: usage %lx before, %lx after\n", usage_before, minislab_layer_usage(6));
 		return false;
 	}
+	return true;
+}
+
+void* alloc_block_thread(void* arg) {
+	(void)arg;
+	return chamalloc(1024);
+}
 
+bool test_arena_routing() {
+	chamallopt(CHALLOC_OPT_ARENAS, 2);
+	Arena* main_arena = arena_get();
+
+	void* ptr;
+	pthread_t thread_id;
+	pthread_create(&thread_id, NULL, (thread_func)alloc_block_thread, NULL);
+	pthread_join(thread_id, &ptr);
+
+	Arena* thread_arena = arena_of_ptr(ptr);
+	if (thread_arena == main_arena) {
+		printf("the thread used the arena of the main thread\n");
+		chafree(ptr);
+		return false;
+	}
+
+	// Freeing from another thread must give the block back to the arena which allocated it
+	size_t freed_before = thread_arena->freed_blocks.size;
+	chafree(ptr);
+	if (thread_arena->freed_blocks.size != freed_before + 1) {
+		printf("the block wasn't given back to arena %u\n", thread_arena->idx);
+		return false;
+	}
+	return true;
+}
+
+bool test_arena_adoption() {
+	chamallopt(CHALLOC_OPT_ARENAS, 4);
+
+	void* ptr1;
+	void* ptr2;
+	pthread_t thread_id;
+	pthread_create(&thread_id, NULL, (thread_func)alloc_block_thread, NULL);
+	pthread_join(thread_id, &ptr1);
+	pthread_create(&thread_id, NULL, (thread_func)alloc_block_thread, NULL);
+	pthread_join(thread_id, &ptr2);
+
+	// The second thread should have adopted the arena left with a live allocation by the first one
+	bool same_arena = arena_of_ptr(ptr1) == arena_of_ptr(ptr2);
+	if (!same_arena) {
+		printf("orphaned arena %u wasn't adopted, got arena %u\n", arena_of_ptr(ptr1)->idx, arena_of_ptr(ptr2)->idx);
+	}
+	chafree(ptr1);
 	chafree(ptr2);
+	return same_arena;
+}
+
+bool test_minislab_remote_free() {
+	void* ptr = chamalloc(8);
+	if (!ptr_comes_from_minislab(ptr)) {
+		printf("allocation with size 8 doesn't come from the minislab\n");
+		return false;
+	}
+
+	// Free it as if the thread was running on another CPU, the owner must collect it once the layer is full
+	minislab_remote_free(ptr);
+	void* ptrs[65];
+	size_t nb_ptrs = 0;
+	bool reused    = false;
+	while (nb_ptrs < 65 && !reused) {
+		ptrs[nb_ptrs] = chamalloc(8);
+		reused	      = ptrs[nb_ptrs] == ptr;
+		nb_ptrs++;
+	}
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		chafree(ptrs[i]);
+	}
+	if (!reused) {
+		printf("the chunk freed from another CPU was never reused\n");
+		minislab_print_usage(minislab_of_current_cpu());
+	}
+	return reused;
+}
+
+pthread_barrier_t remote_free_barrier;
+
+void* alloc_then_wait_thread(void* arg) {
+	void** ptr = arg;
+	*ptr	   = chamalloc(1024);
+	pthread_barrier_wait(&remote_free_barrier); // Let the main thread free ptr
+	pthread_barrier_wait(&remote_free_barrier); // Wait for the main thread to check the queue
+	chafree(chamalloc(1024));
+	return NULL;
+}
+
+bool test_remote_free_queue() {
+	chamallopt(CHALLOC_OPT_ARENAS, 2);
+	arena_get();
+
+	void* ptr;
+	pthread_t thread_id;
+	pthread_barrier_init(&remote_free_barrier, NULL, 2);
+	pthread_create(&thread_id, NULL, (thread_func)alloc_then_wait_thread, &ptr);
+	pthread_barrier_wait(&remote_free_barrier);
+
+	// The owner is alive, so the free must go to its queue without touching its blocks
+	Arena* arena = arena_of_ptr(ptr);
+	chafree(ptr);
+	bool queued = arena->remote_frees == ptr;
+	if (!queued) {
+		printf("the pointer wasn't pushed to the remote-free queue of arena %u\n", arena->idx);
+	}
+
+	// The next allocation of the owner drains it
+	pthread_barrier_wait(&remote_free_barrier);
+	pthread_join(thread_id, NULL);
+	pthread_barrier_destroy(&remote_free_barrier);
+	if (arena->remote_frees != NULL) {
+		printf("the remote-free queue of arena %u wasn't drained\n", arena->idx);
+		return false;
+	}
+	return queued;
+}
+
+#define LOCK_TEST_THREADS	   4
+#define LOCK_TEST_ITERATIONS 10000
+
+ChallocLock test_lock	 = {0};
+size_t test_lock_counter = 0;
+
+void* lock_increment_thread(void* arg) {
+	(void)arg;
+	for (size_t i = 0; i < LOCK_TEST_ITERATIONS; i++) {
+		challoc_lock(&test_lock);
+		test_lock_counter++;
+		challoc_unlock(&test_lock);
+	}
+	return NULL;
+}
+
+bool test_lock_counts() {
+	pthread_t thread_ids[LOCK_TEST_THREADS];
+	for (size_t i = 0; i < LOCK_TEST_THREADS; i++) {
+		pthread_create(&thread_ids[i], NULL, (thread_func)lock_increment_thread, NULL);
+	}
+	for (size_t i = 0; i < LOCK_TEST_THREADS; i++) {
+		pthread_join(thread_ids[i], NULL);
+	}
+
+	size_t expected = LOCK_TEST_THREADS * LOCK_TEST_ITERATIONS;
+	if (test_lock_counter != expected || test_lock.acquisitions != expected) {
+		printf("expected %zu increments and acquisitions, got %zu and %zu\n", expected, test_lock_counter, test_lock.acquisitions);
+		return false;
+	}
+	if (test_lock.state != 0 || test_lock.contended > test_lock.acquisitions) {
+		printf("lock left in state %u with %zu contended acquisitions\n", test_lock.state, test_lock.contended);
+		return false;
+	}
+
+	// The counters of the internal locks are exposed through chastats
+	ChallocStats before = chastats();
+	void* ptr	    = chamalloc(4096);
+	chafree(ptr);
+	ChallocStats after = chastats();
+	if (after.lock_acquisitions < before.lock_acquisitions + 2) {
+		printf("chastats counted %zu lock acquisitions for a block malloc and free\n", after.lock_acquisitions - before.lock_acquisitions);
+		return false;
+	}
+	return true;
+}
+
+bool test_subsystem_locks_are_independent() {
+	// Small allocations must not wait for the arenas
+	challoc_lock(&challoc_arena_bind_lock);
+	challoc_lock(&arena_get()->mutex);
+	void* ptr	   = chamalloc(16);
+	bool from_minislab = ptr_comes_from_minislab(ptr);
+	chafree(ptr);
+	challoc_unlock(&arena_get()->mutex);
+	challoc_unlock(&challoc_arena_bind_lock);
+	return from_minislab;
+}
+
+bool test_freed_blocks_lock() {
+	// Empty blocks are retained and aged under their own lock, never waiting for the blocks in use of the arena
+	Arena* arena = arena_get();
+	chafree(chamalloc(2 * BLOCK_MIN_SIZE));
+	if (arena->freed_blocks.size == 0) {
+		printf("the empty block wasn't retained\n");
+		return false;
+	}
+	challoc_lock(&arena->mutex);
+	arena_age_freed_blocks(arena, UINT8_MAX);
+	challoc_unlock(&arena->mutex);
+	if (arena->freed_blocks.size != 0) {
+		printf("%zu freed blocks outlived their time to live\n", arena->freed_blocks.size);
+		return false;
+	}
+	return arena->freed_lock.state == 0;
+}
+
+void* numa_node_of_arena_thread(void* arg) {
+	(void)arg;
+	void* ptr     = chamalloc(1 << 16);
+	Arena* arena  = arena_get();
+	bool in_arena = arena_of_ptr(ptr) == arena;
+	chafree(ptr);
+	return in_arena ? (void*)(uintptr_t)arena->numa_node : (void*)UINTPTR_MAX;
+}
+
+bool test_numa_node_routing() {
+	// Pretend every new thread runs on node 1, which the kernel refuses to bind to on a single node machine
+	chamallopt(CHALLOC_OPT_ARENAS, MAX_ARENAS);
+	chamallopt(CHALLOC_OPT_NUMA_NODE, 1);
+	bool passed = true;
+	for (int i = 0; i < 2; i++) {
+		void* node;
+		pthread_t thread_id;
+		pthread_create(&thread_id, NULL, (thread_func)numa_node_of_arena_thread, NULL);
+		pthread_join(thread_id, &node);
+		if ((uintptr_t)node != 1) {
+			printf("thread %d was bound to an arena of node %ld\n", i, (long)(uintptr_t)node);
+			passed = false;
+		}
+	}
+	chamallopt(CHALLOC_OPT_NUMA_NODE, -1);
+	return passed;
+}
+
+#define SLAB_TEST_NB_PTRS (3 * SLAB_PAGE_SIZE / 8)
+
+bool test_slab_grows_past_one_page() {
+	// Many more 8 bytes objects than a minislab and a slab page can hold
+	void* ptrs[SLAB_TEST_NB_PTRS];
+	size_t sizes[SLAB_TEST_NB_PTRS];
+	SlabClass* slab_class = &challoc_slab_classes[slab_class_of_size(8)];
+	for (size_t i = 0; i < SLAB_TEST_NB_PTRS; i++) {
+		ptrs[i]	 = chamalloc(8);
+		sizes[i] = 8;
+		if (!ptr_comes_from_minislab(ptrs[i]) && !ptr_comes_from_slab(ptrs[i])) {
+			printf("allocation %zu of 8 bytes fell through to the blocks\n", i);
+			return false;
+		}
+	}
+	if (any_overlaps(ptrs, sizes, SLAB_TEST_NB_PTRS)) {
+		printf("overlaps detected\n");
+		return false;
+	}
+	if (slab_class->nb_pages < SLAB_TEST_NB_PTRS * 8 / SLAB_PAGE_SIZE || slab_class->full == NULL) {
+		printf("the 8 bytes class has %zu pages\n", slab_class->nb_pages);
+		return false;
+	}
+
+	// Once everything is freed, the pages are kept empty for the next allocations of the class
+	// Earlier tests may still hold a few chunks, so one page can stay partial
+	for (size_t i = 0; i < SLAB_TEST_NB_PTRS; i++) {
+		chafree(ptrs[i]);
+	}
+	if (slab_class->full != NULL || slab_class->empty == NULL || (slab_class->partial != NULL && slab_class->partial->next != NULL)) {
+		printf("pages of the 8 bytes class are still in use after freeing everything\n");
+		return false;
+	}
+	return true;
+}
+
+bool test_slab_size_classes() {
+	for (size_t size = 1; size <= SLAB_MAX_SIZE; size++) {
+		size_t class_size = slab_class_size(slab_class_of_size(size));
+		// From 64 bytes on, the chunk is at most 25% bigger than the size
+		if (class_size < size || (size > 64 && class_size * 4 > size * 5) || (size > 1 && class_size > 2 * size + 8)) {
+			printf("size %zu is served by chunks of %zu bytes\n", size, class_size);
+			return false;
+		}
+	}
+
+	// Sizes far from a power of two don't go to the blocks anymore
+	size_t sizes[] = {40, 100, 200, 300, 420};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		void* ptr    = chamalloc(sizes[i]);
+		bool in_slab = ptr_comes_from_minislab(ptr) || ptr_comes_from_slab(ptr);
+		if (!in_slab || challoc_ptr_size(ptr) < sizes[i]) {
+			printf("allocation of %zu bytes wasn't served by a slab chunk big enough\n", sizes[i]);
+			return false;
+		}
+		chafree(ptr);
+	}
+	return true;
+}
 
-	if (block->head != NULL) {
-		printf("head should be NULL\n");
-		block_print(block);
+bool test_slab_page_headers() {
+	// The header of the page is found by masking the pointer, and the chunks never overlap it
+	size_t sizes[] = {24, 100, 300, 500};
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		void* ptr = slab_alloc(sizes[i]);
+		if (ptr == NULL) {
+			printf("no slab page for %zu bytes\n", sizes[i]);
+			return false;
+		}
+		SlabPage* page = slab_page_of_ptr(ptr);
+		if ((uintptr_t)page % SLAB_PAGE_SIZE != 0 || (uint8_t*)ptr < slab_page_memory(page) ||
+		    (uint8_t*)ptr + slab_ptr_size(ptr) > (uint8_t*)page + SLAB_PAGE_SIZE) {
+			printf("chunk %p of %zu bytes is outside of its page %p\n", ptr, sizes[i], (void*)page);
+			return false;
+		}
+		if (page->class_idx != slab_class_of_size(sizes[i]) || slab_ptr_size(ptr) < sizes[i]) {
+			printf("header of the chunk of %zu bytes has the class of %zu bytes\n", sizes[i], slab_ptr_size(ptr));
+			return false;
+		}
+		slab_free(ptr);
+	}
+	return true;
+}
+
+bool test_bitmap_search() {
+	// With the layout of a slab page, the summary leads to the first free chunk wherever it is
+	uint64_t usage[SLAB_MAX_CHUNKS / 64];
+	uint64_t summary[SLAB_SUMMARY_WORDS];
+	for (size_t free_word = 0; free_word < SLAB_MAX_CHUNKS / 64; free_word++) {
+		memset(summary, 0, sizeof(summary));
+		for (size_t i = 0; i < SLAB_MAX_CHUNKS / 64; i++) {
+			usage[i] = i < free_word ? ALL_ONES(uint64_t) : 0;
+			if (i < free_word) {
+				summary[i / 64] |= 1ULL << (i % 64);
+			}
+		}
+		usage[free_word] = ~(1ULL << (free_word % 64));
+
+		size_t expected = free_word * 64 + free_word % 64;
+		size_t found	= bitmap_first_bit_at_0(summary, SLAB_SUMMARY_WORDS, usage);
+		if (found != expected) {
+			printf("search with %zu full words found bit %zu instead of %zu\n", free_word, found, expected);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool test_slab_releases_empty_pages() {
+	// Fill a few pages of a class, then free everything with a reserve of a single page
+	size_t class_idx      = slab_class_of_size(200);
+	SlabClass* slab_class = &challoc_slab_classes[class_idx];
+	size_t nb_ptrs	      = 4 * slab_class_nb_chunks(class_idx);
+	void** ptrs	      = chamalloc(nb_ptrs * sizeof(void*));
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		ptrs[i] = slab_alloc(200);
+		memset(ptrs[i], 0xAB, 200);
+	}
+	chamallopt(CHALLOC_OPT_SLAB_RESERVE, 1);
+	size_t released_before = chastats().slab_pages_released;
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		slab_free(ptrs[i]);
+	}
+	chamallopt(CHALLOC_OPT_SLAB_RESERVE, 4);
+	size_t nb_released = chastats().slab_pages_released - released_before;
+	if (slab_class->nb_empty > 1 || challoc_slab_nb_released < 3 || nb_released < 3) {
+		printf("%zu pages are still empty in memory, %zu were released\n", slab_class->nb_empty, nb_released);
+		return false;
+	}
+
+	// A released page is not in memory anymore
+	uint8_t* released_page = challoc_slab_region + (size_t)challoc_slab_released[challoc_slab_nb_released - 1] * SLAB_PAGE_SIZE;
+	unsigned char residency[SLAB_PAGE_SIZE / 4096];
+	if (mincore(released_page, SLAB_PAGE_SIZE, residency) == 0 && (residency[0] & 1)) {
+		printf("released page %p is still in memory\n", (void*)released_page);
 		return false;
 	}
 
+	// Released pages are reused by any class before new ones are carved
+	size_t next_page = challoc_slab_next_page;
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		ptrs[i] = slab_alloc(100);
+	}
+	bool reused = challoc_slab_next_page == next_page;
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		slab_free(ptrs[i]);
+	}
+	chafree(ptrs);
+	if (!reused) {
+		printf("released pages weren't reused\n");
+		return false;
+	}
 	return true;
 }
 
+bool test_slab_releases_idle_pages() {
+	// Empty pages wait for the delay before being released, even if the class isn't used anymore
+	size_t class_idx      = slab_class_of_size(300);
+	SlabClass* slab_class = &challoc_slab_classes[class_idx];
+	size_t nb_ptrs	      = 4 * slab_class_nb_chunks(class_idx);
+	void** ptrs	      = chamalloc(nb_ptrs * sizeof(void*));
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		ptrs[i] = slab_alloc(300);
+	}
+	chamallopt(CHALLOC_OPT_SLAB_RESERVE, 1);
+	chamallopt(CHALLOC_OPT_SLAB_IDLE_MS, 50);
+	size_t released_before = chastats().slab_pages_released;
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		slab_free(ptrs[i]);
+	}
+	bool passed = true;
+	if (chastats().slab_pages_released != released_before) {
+		printf("pages were released before being idle\n");
+		passed = false;
+	}
+	usleep(100 * 1000);
+	size_t nb_released = chastats().slab_pages_released - released_before;
+	if (slab_class->nb_empty > 1 || nb_released < 3) {
+		printf("%zu idle pages are still empty in memory, %zu were released\n", slab_class->nb_empty, nb_released);
+		passed = false;
+	}
+
+	// Allocating from a class also releases its idle pages
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		ptrs[i] = slab_alloc(300);
+	}
+	for (size_t i = 0; i < nb_ptrs; i++) {
+		slab_free(ptrs[i]);
+	}
+	usleep(100 * 1000);
+	released_before = __atomic_load_n(&challoc_stats.slab_pages_released, __ATOMIC_RELAXED);
+	slab_free(slab_alloc(300));
+	nb_released = __atomic_load_n(&challoc_stats.slab_pages_released, __ATOMIC_RELAXED) - released_before;
+	if (nb_released < 2) {
+		printf("allocating released %zu idle pages\n", nb_released);
+		passed = false;
+	}
+	chamallopt(CHALLOC_OPT_SLAB_IDLE_MS, 0);
+	chamallopt(CHALLOC_OPT_SLAB_RESERVE, 4);
+	chafree(ptrs);
+	return passed;
+}
+
+bool test_allocation_coloring() {
+	// Big buffers allocated one after the other, carved from the same free chunk, start on different cache lines of a page
+	const size_t NB_BUFFERS = 8;
+	void* buffers[NB_BUFFERS];
+	for (size_t i = 0; i < NB_BUFFERS; i++) {
+		buffers[i] = chamalloc(64 * 1024);
+	}
+	bool passed = true;
+	for (size_t i = 0; i < NB_BUFFERS; i++) {
+		for (size_t j = 0; j < i; j++) {
+			size_t distance = ((uintptr_t)buffers[i] - (uintptr_t)buffers[j]) % 4096;
+			distance	= distance < 4096 - distance ? distance : 4096 - distance;
+			if (distance < CACHE_LINE_SIZE) {
+				printf("buffers %zu and %zu start at offsets %lu and %lu of a page\n", j, i, (uintptr_t)buffers[j] % 4096,
+				       (uintptr_t)buffers[i] % 4096);
+				passed = false;
+			}
+		}
+	}
+	for (size_t i = 0; i < NB_BUFFERS; i++) {
+		chafree(buffers[i]);
+	}
+
+	// Consecutive pages of a slab class get different colors when their chunks leave room for it
+	size_t class_idx      = slab_class_of_size(448);
+	SlabClass* slab_class = &challoc_slab_classes[class_idx];
+	size_t first	      = 0;
+	CHALLOC_MUTEX(&slab_class->lock, first = slab_class_next_color(slab_class, class_idx))
+	size_t second = 0;
+	CHALLOC_MUTEX(&slab_class->lock, second = slab_class_next_color(slab_class, class_idx))
+	if (first == second || second % CACHE_LINE_SIZE != 0 || slab_class_nb_chunks(class_idx) * 448 + second > SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) {
+		printf("consecutive pages of 448 bytes chunks got colors %zu and %zu\n", first, second);
+		passed = false;
+	}
+	return passed;
+}
+
+bool test_batch_api() {
+	// A batch spanning several slab pages gives distinct chunks, all from the slab
+	const size_t NB_PTRS = 3 * SLAB_PAGE_SIZE / 100;
+	void** ptrs	     = chamalloc(NB_PTRS * sizeof(void*));
+	if (chamalloc_batch(100, NB_PTRS, ptrs) != NB_PTRS) {
+		printf("the batch wasn't fully allocated\n");
+		return false;
+	}
+	bool passed = true;
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		if (!ptr_comes_from_slab(ptrs[i]) || slab_ptr_size(ptrs[i]) < 100) {
+			printf("pointer %zu (%p) isn't a slab chunk of at least 100 bytes\n", i, ptrs[i]);
+			passed = false;
+		}
+		memset(ptrs[i], (int)i, 100);
+	}
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		if (((uint8_t*)ptrs[i])[0] != (uint8_t)i || ((uint8_t*)ptrs[i])[99] != (uint8_t)i) {
+			printf("pointer %zu overlaps another one\n", i);
+			passed = false;
+		}
+	}
+
+	// Mix in other sizes and NULLs, which break the runs of the free
+	ptrs[1]		  = NULL;
+	ptrs[NB_PTRS / 2] = chamalloc(24);
+	ptrs[NB_PTRS / 3] = chamalloc(4000);
+	ptrs[NB_PTRS / 4] = chamalloc(64);
+	chafree_batch(ptrs, NB_PTRS);
+
+	// A batch too big for the slab is allocated in the arena
+	if (chamalloc_batch(10000, 4, ptrs) != 4 || ptr_comes_from_slab(ptrs[0]) || chamalloc_batch(0, 4, ptrs + 4) != 0) {
+		printf("batches of 10000 or 0 bytes weren't handled\n");
+		passed = false;
+	}
+	chafree_batch(ptrs, 4);
+	chafree(ptrs);
+	return passed;
+}
+
+bool test_block_free_bins() {
+	// Every bin holds a range of sizes, in increasing order
+	for (size_t size = CHUNK_MIN_SIZE; size + 1 < FREE_EXTENT_MIN_SIZE; size++) {
+		if (free_bin_of_size(size + 1) < free_bin_of_size(size) || free_bin_of_size(size + 1) > free_bin_of_size(size) + 1) {
+			printf("sizes %zu and %zu are in bins %zu and %zu\n", size, size + 1, free_bin_of_size(size), free_bin_of_size(size + 1));
+			return false;
+		}
+	}
+
+	// A gap left in the middle of many allocations is found again through its bin, the thread cache would keep it otherwise
+	const size_t NB_PTRS = 64;
+	void* ptrs[NB_PTRS];
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		ptrs[i] = __chamalloc(1000);
+	}
+	Arena* arena	 = arena_get();
+	void* freed	 = ptrs[NB_PTRS / 2];
+	FreeChunk* chunk = (FreeChunk*)challoc_get_metadata(freed);
+	__chafree(freed);
+	bool passed    = true;
+	size_t bin_idx = free_bin_of_size(chunk_size(&chunk->metadata));
+	if (arena->free_bins[bin_idx] != chunk || !(arena->free_bins_used & (1ULL << bin_idx))) {
+		printf("the freed chunk %p isn't at the head of bin %zu\n", (void*)chunk, bin_idx);
+		passed = false;
+	}
+	ptrs[NB_PTRS / 2] = __chamalloc(1000);
+	if (ptrs[NB_PTRS / 2] != freed) {
+		printf("the freed chunk %p wasn't reused, got %p\n", freed, ptrs[NB_PTRS / 2]);
+		passed = false;
+	}
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		__chafree(ptrs[i]);
+	}
+	return passed;
+}
+
+bool test_free_extent_tree() {
+	// Extents of a few sizes, several of each, inserted in a scrambled order
+	const size_t NB_EXTENTS = 200;
+	static FreeExtent extents[200];
+	bool in_tree[200] = {false};
+	FreeExtent* root  = NULL;
+	for (size_t n = 0; n < NB_EXTENTS; n++) {
+		size_t i		 = (n * 73) % NB_EXTENTS;
+		extents[i].metadata.size = FREE_EXTENT_MIN_SIZE + (i % 13) * 4096;
+		root			 = free_extent_insert(root, &extents[i]);
+		in_tree[i]		 = true;
+	}
+
+	// Remove some of them, then compare the best fit of each size with the one found by going through all of them
+	bool passed = true;
+	for (size_t round = 0; round < 2; round++) {
+		for (size_t size = FREE_EXTENT_MIN_SIZE - 16; size <= FREE_EXTENT_MIN_SIZE + 14 * 4096; size += 2048) {
+			FreeExtent* expected = NULL;
+			for (size_t i = 0; i < NB_EXTENTS; i++) {
+				if (in_tree[i] && chunk_size(&extents[i].metadata) >= size
+				    && (expected == NULL || free_extent_before(&extents[i], expected))) {
+					expected = &extents[i];
+				}
+			}
+			FreeExtent* found = free_extent_best_fit(root, size);
+			if (found != expected) {
+				printf("best fit of %zu is %p, expected %p\n", size, (void*)found, (void*)expected);
+				passed = false;
+			}
+		}
+		for (size_t i = round; i < NB_EXTENTS; i += 3) {
+			if (in_tree[i]) {
+				root	   = free_extent_remove(root, &extents[i]);
+				in_tree[i] = false;
+			}
+		}
+	}
+	return passed;
+}
+
+bool test_block_page_map() {
+	// Allocations too big to share a block each get their own, found again from any of their bytes
+	const size_t NB_PTRS = 4;
+	uint8_t* ptrs[NB_PTRS];
+	Block* blocks[NB_PTRS];
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		ptrs[i]	  = __chamalloc(BLOCK_MIN_SIZE);
+		blocks[i] = block_of_ptr(challoc_get_metadata(ptrs[i]));
+	}
+	bool passed = true;
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		if (block_of_ptr(ptrs[i] + BLOCK_MIN_SIZE - 1) != blocks[i] || blocks[i]->mmap_ptr > (void*)ptrs[i]) {
+			printf("the last byte of pointer %zu isn't in its block %p\n", i, (void*)blocks[i]);
+			passed = false;
+		}
+	}
+
+	// Emptying a block in the middle of the list moves the last one, which still finds its descriptor from its chunks
+	Arena* arena = arena_get();
+	__chafree(ptrs[1]);
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		if (i != 1 && (block_of_ptr(challoc_get_metadata(ptrs[i])) != blocks[i] || arena->blocks_in_use.blocks[blocks[i]->list_idx] != blocks[i])) {
+			printf("block %zu was lost when block 1 was emptied\n", i);
+			passed = false;
+		}
+	}
+	if (arena->freed_blocks.blocks[blocks[1]->list_idx] != blocks[1]) {
+		printf("the emptied block isn't in the freed list\n");
+		passed = false;
+	}
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		if (i != 1) {
+			__chafree(ptrs[i]);
+		}
+	}
+
+	// Two blocks sharing a segment are told apart by where the second one starts, even once it is unmapped
+	uint8_t* segment = (uint8_t*)((uintptr_t)0x6F << 40);
+	Block first	 = {.mmap_ptr = segment - BLOCK_MIN_SIZE / 2, .size = BLOCK_MIN_SIZE};
+	Block second	 = {.mmap_ptr = segment + BLOCK_MIN_SIZE / 2, .size = BLOCK_MIN_SIZE};
+	pagemap_set(&first, &first);
+	pagemap_set(&second, &second);
+	if (block_of_ptr(segment + BLOCK_MIN_SIZE / 2 - 1) != &first || block_of_ptr(segment + BLOCK_MIN_SIZE / 2) != &second) {
+		printf("the blocks sharing a segment were mixed up\n");
+		passed = false;
+	}
+	pagemap_set(&second, NULL);
+	if (block_of_ptr(segment) != &first) {
+		printf("the first block of a segment was lost when the second one was unmapped\n");
+		passed = false;
+	}
+	pagemap_set(&first, NULL);
+	return passed;
+}
+
+bool test_block_header_size() {
+	// Consecutive allocations of a block are only apart by their size rounded up and their 8 bytes of metadata
+	const size_t NB_PTRS = 16;
+	uint8_t* ptrs[NB_PTRS];
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		ptrs[i] = __chamalloc(1000);
+	}
+	bool passed = true;
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		if ((uintptr_t)ptrs[i] % CHUNK_ALIGNMENT != 0 || ptrs[i] - (uint8_t*)challoc_get_metadata(ptrs[i]) != 8) {
+			printf("pointer %zu (%p) is misaligned or has more than 8 bytes of metadata\n", i, (void*)ptrs[i]);
+			passed = false;
+		}
+		if (i > 0 && ptrs[i] - ptrs[i - 1] != 1008) {
+			printf("pointers %zu and %zu are %td bytes apart, expected 1008\n", i - 1, i, ptrs[i] - ptrs[i - 1]);
+			passed = false;
+		}
+	}
+	for (size_t i = 0; i < NB_PTRS; i++) {
+		__chafree(ptrs[i]);
+	}
+
+	// A chunk of a whole number of pages still gets a block with room for the edges which are never part of a chunk
+	uint8_t* big = __chamalloc(2 * BLOCK_MIN_SIZE - sizeof(AllocMetadata));
+	if (big == NULL || chunk_size(challoc_get_metadata(big)) < 2 * BLOCK_MIN_SIZE) {
+		printf("a chunk of exactly %d bytes wasn't allocated\n", 2 * BLOCK_MIN_SIZE);
+		passed = false;
+	}
+	big[2 * BLOCK_MIN_SIZE - sizeof(AllocMetadata) - 1] = 1;
+	__chafree(big);
+	return passed;
+}
+
+bool test_huge_allocations() {
+	// A buffer past the threshold gets its own mapping, which isn't a block of the arena
+	const size_t SIZE = 4 << 20;
+	chamallopt(CHALLOC_OPT_HUGE_THRESHOLD, SIZE);
+	Arena* arena	   = arena_get();
+	size_t nb_blocks   = arena->blocks_in_use.size;
+	size_t nb_mappings = chastats().huge_mappings;
+	uint8_t* huge	   = __chamalloc(SIZE);
+	uint8_t* zeroed	   = __chacalloc(SIZE, 2);
+	uint8_t* below	   = __chamalloc(SIZE - 1);
+	bool passed	   = true;
+	if (!ptr_comes_from_huge(huge) || !ptr_comes_from_huge(zeroed) || ptr_comes_from_huge(below)) {
+		printf("only the allocations past the threshold should be huge\n");
+		passed = false;
+	}
+	if ((uintptr_t)huge % CHUNK_ALIGNMENT != 0 || challoc_ptr_size(huge) < SIZE || challoc_ptr_size(zeroed) < 2 * SIZE) {
+		printf("huge allocation %p only has %zu bytes\n", (void*)huge, challoc_ptr_size(huge));
+		passed = false;
+	}
+	if (arena->blocks_in_use.size != nb_blocks + 1 || chastats().huge_mappings != nb_mappings + 2) {
+		printf("%zu blocks and %zu huge mappings were added\n", arena->blocks_in_use.size - nb_blocks, chastats().huge_mappings - nb_mappings);
+		passed = false;
+	}
+	huge[SIZE - 1] = 1;
+	for (size_t i = 0; i < 2 * SIZE; i += 4096) {
+		if (zeroed[i] != 0) {
+			printf("huge calloc isn't zeroed at %zu\n", i);
+			passed = false;
+			break;
+		}
+	}
+
+	// Frees unmap them directly, whatever the threshold has become
+	chamallopt(CHALLOC_OPT_HUGE_THRESHOLD, 0);
+	void* batch[3] = {huge, below, zeroed};
+	__chafree_batch(batch, 3);
+	if (chastats().huge_mappings != nb_mappings) {
+		printf("%zu huge mappings are still registered\n", chastats().huge_mappings - nb_mappings);
+		passed = false;
+	}
+	unsigned char residency;
+	if (mincore((void*)((uintptr_t)huge & ~(uintptr_t)4095), 4096, &residency) == 0) {
+		printf("huge allocation %p is still mapped\n", (void*)huge);
+		passed = false;
+	}
+	errno = 0; // mincore fails with ENOMEM on the unmapped page
+
+	// Without a threshold, the same size is served by a block
+	uint8_t* in_block = __chamalloc(SIZE);
+	if (ptr_comes_from_huge(in_block) || block_of_ptr(challoc_get_metadata(in_block))->arena_idx != arena->idx) {
+		printf("allocation %p should be in a block when there is no threshold\n", (void*)in_block);
+		passed = false;
+	}
+	__chafree(in_block);
+	chamallopt(CHALLOC_OPT_HUGE_THRESHOLD, 16 << 20);
+	return passed;
+}
+
+bool test_realloc_in_place() {
+	// Shrinking a chunk of a block keeps it in place and frees its end
+	uint8_t* ptr = __chamalloc(30000);
+	for (size_t i = 0; i < 30000; i++) {
+		ptr[i] = (uint8_t)i;
+	}
+	bool passed = true;
+	if (__charealloc(ptr, 10000) != ptr || challoc_ptr_size(ptr) >= 30000 || challoc_get_metadata(ptr + challoc_ptr_size(ptr) + sizeof(AllocMetadata))->size & CHUNK_IN_USE) {
+		printf("shrinking %p moved it or didn't free its end, it has %zu bytes\n", (void*)ptr, challoc_ptr_size(ptr));
+		passed = false;
+	}
+
+	// Growing it takes the free chunk after it back, without copying
+	if (__charealloc(ptr, 20000) != ptr || challoc_ptr_size(ptr) < 20000) {
+		printf("growing %p into its free neighbour moved it\n", (void*)ptr);
+		passed = false;
+	}
+	for (size_t i = 0; i < 10000; i++) {
+		if (ptr[i] != (uint8_t)i) {
+			printf("byte %zu changed while growing in place\n", i);
+			passed = false;
+			break;
+		}
+	}
+	if (__chaexpand(ptr, 25000, 30000) < 30000 || challoc_ptr_size(ptr) < 30000) {
+		printf("%p should have been expanded to 30000 bytes, it has %zu\n", (void*)ptr, challoc_ptr_size(ptr));
+		passed = false;
+	}
+	size_t size = challoc_ptr_size(ptr);
+	if (__chaexpand(ptr, (size_t)1 << 40, (size_t)1 << 40) >= (size_t)1 << 40 || challoc_ptr_size(ptr) != size) {
+		printf("an expansion which can't be done changed %p\n", (void*)ptr);
+		passed = false;
+	}
+	__chafree(ptr);
+
+	// A big shrink gives the pages of the end back to the OS
+	uint8_t* big = __chamalloc(BLOCK_MIN_SIZE / 2);
+	memset(big, 0xAB, BLOCK_MIN_SIZE / 2);
+	unsigned char residency;
+	uint8_t* middle = (uint8_t*)(((uintptr_t)big + BLOCK_MIN_SIZE / 4) & ~(uintptr_t)4095);
+	if (__charealloc(big, 4096) != big || mincore(middle, 4096, &residency) != 0 || (residency & 1)) {
+		printf("the end of %p is still in memory after shrinking it\n", (void*)big);
+		passed = false;
+	}
+	__chafree(big);
+
+	// Small objects stay in their class as long as they use more than half of it
+	uint8_t* small = __chamalloc(100);
+	if (__charealloc(small, 90) != small) {
+		printf("a small object moved while staying in its class\n");
+		passed = false;
+	}
+	uint8_t* moved = __charealloc(small, 40);
+	if (moved == small) {
+		printf("a small object stayed in a class twice too big\n");
+		passed = false;
+	}
+	__chafree(moved);
+
+	// Huge allocations are shrunk by unmapping their end and grown by the kernel, which never copies them
+	chamallopt(CHALLOC_OPT_HUGE_THRESHOLD, 4 << 20);
+	uint8_t* huge = __chamalloc(8 << 20);
+	huge[0]	      = 1;
+	huge[(6 << 20) - 1] = 2;
+	if (__charealloc(huge, 6 << 20) != huge || challoc_ptr_size(huge) >= 8 << 20) {
+		printf("shrinking huge allocation %p moved it or kept its end\n", (void*)huge);
+		passed = false;
+	}
+	huge = __charealloc(huge, 64 << 20);
+	if (!ptr_comes_from_huge(huge) || challoc_ptr_size(huge) < 64 << 20 || huge[0] != 1 || huge[(6 << 20) - 1] != 2) {
+		printf("growing huge allocation %p lost its content\n", (void*)huge);
+		passed = false;
+	}
+	__chafree(huge);
+
+	// A small object growing past the threshold is never mistaken for a huge one by the bytes before it, which belong to its neighbour
+	uint8_t* neighbour = __chamalloc(24);
+	small		   = __chamalloc(24);
+	size_t stride	   = challoc_ptr_size(neighbour);
+	if (neighbour == small + stride) {
+		neighbour = small;
+		small	  = neighbour + stride;
+	}
+	memset(neighbour, 0xFF, stride);
+	small[0] = 3;
+	huge	 = __charealloc(small, 32 << 20);
+	if (!ptr_comes_from_huge(huge) || challoc_ptr_size(huge) < 32 << 20 || huge[0] != 3) {
+		printf("a small object grown past the threshold wasn't moved to a huge allocation\n");
+		passed = false;
+	}
+	__chafree(huge);
+	__chafree(neighbour);
+	chamallopt(CHALLOC_OPT_HUGE_THRESHOLD, 16 << 20);
+	return passed;
+}
+
 typedef struct {
 	const char* name;
 	bool (*test)();
@@ -312,6 +1235,7 @@ typedef struct {
 #define RESET	   "\033[0m"
 
 Test tests[] = {
+    TEST(test_lock_skipped_while_single_threaded),
     TEST(test_block_fragmentation),
     TEST(test_block_reusage),
     TEST(test_minislab_fits_page),
@@ -319,11 +1243,39 @@ Test tests[] = {
     TEST(test_fill_minislab),
     TEST(test_unmap_a_block),
     TEST(test_minislab_concurrent_usage),
+    TEST(test_tcache_reuses_freed_ptr),
+    TEST(test_tcache_flushed_on_thread_exit),
+    TEST(test_tcache_size_classes),
+    TEST(test_arena_routing),
+    TEST(test_arena_adoption),
+    TEST(test_remote_free_queue),
+    TEST(test_minislab_remote_free),
+    TEST(test_lock_counts),
+    TEST(test_subsystem_locks_are_independent),
+    TEST(test_freed_blocks_lock),
+    TEST(test_numa_node_routing),
+    TEST(test_slab_grows_past_one_page),
+    TEST(test_slab_size_classes),
+    TEST(test_slab_page_headers),
+    TEST(test_bitmap_search),
+    TEST(test_slab_releases_empty_pages),
+    TEST(test_slab_releases_idle_pages),
+    TEST(test_allocation_coloring),
+    TEST(test_batch_api),
+    TEST(test_block_free_bins),
+    TEST(test_free_extent_tree),
+    TEST(test_block_page_map),
+    TEST(test_block_header_size),
+    TEST(test_huge_allocations),
+    TEST(test_realloc_in_place),
 };
 
 int main() {
 	bool all_passed = true;
 
+	// Most tests look at the global heap directly, so the thread cache is only enabled by the tests about it
+	chamallopt(CHALLOC_OPT_TCACHE, 0);
+
 	for (size_t i = 0; i < sizeof(tests) / sizeof(Test); i++) {
 		Test test = tests[i];
 		printf("[Running] %s\n", test.name);